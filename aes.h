@@ -0,0 +1,5833 @@
+#ifndef AES_H
+#define AES_H
+
+#include <iostream>
+#include <climits>
+#include <vector>
+#include <bitset>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <span>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <unordered_map>
+#include <random>
+#include <bit>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AES_HAS_AES_NI 1
+#include <immintrin.h>
+#include <cpuid.h>
+/// Lets the AES-NI functions use the instructions without the rest of the file requiring a CPU that has them.
+#define AES_NI_TARGET __attribute__((target("aes,ssse3")))
+/// Carry-less multiplication for GHASH.
+#define AES_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#define AES_HAS_AVX2 1
+#define AES_AVX2_TARGET __attribute__((target("avx2")))
+#define AES_SSSE3_TARGET __attribute__((target("ssse3")))
+#else
+#define AES_AVX2_TARGET
+#endif
+
+/// Source: https://en.wikipedia.org/wiki/Circular_shift#Implementing_circular_shifts
+inline uint32_t rotateleft (uint32_t value, unsigned int count) {
+    const unsigned int mask = CHAR_BIT * sizeof(value) - 1;
+     count &= mask;
+    return (value << count) | (value >> (-count & mask));
+}
+
+inline std::vector<uint32_t> convert_be(const std::string& data) {
+    int bits = 0;
+
+    std::vector<uint32_t> out;
+
+    for (char ch : data) {
+        if (bits % 32 == 0) {
+            out.push_back(0);
+        }
+
+        out[bits / 32] |= ((ch << (24 - (bits % 32))) & (0xFF << (24 - (bits % 32))));
+
+        bits += 8;
+    }
+
+    return out;
+}
+
+inline void aes_get_round_constants(uint8_t rounds, uint32_t* output) {
+
+    /// There are never more than 15 round keys so this doesn't need to depend on rounds.
+    uint8_t rc[16];
+
+    for (int round = 1; round <= rounds; round++) {
+        if (round == 1) {
+            rc[round] = 1;
+        } else if (rc[round - 1] < 0x80) {
+            rc[round] = 2 * rc[round - 1];
+        } else {
+            rc[round] = (2 * rc[round - 1]) ^ 0x11b;
+        }
+    }
+
+    for (int round = 1; round <= rounds; round++) {
+        output[round] = (rc[round] << 24);
+    }
+}
+
+
+inline uint32_t aes_rot_word(uint32_t word) {
+    return rotateleft(word, 8);
+}
+
+constexpr uint8_t sbox_matrix[8][8] = {{1, 0, 0, 0, 1, 1, 1, 1},
+                                        {1, 1, 0, 0, 0, 1, 1, 1},
+                                        {1, 1, 1, 0, 0, 0, 1, 1},
+                                        {1, 1, 1, 1, 0, 0, 0, 1},
+                                        {1, 1, 1, 1, 1, 0, 0, 0},
+                                        {0, 1, 1, 1, 1, 1, 0, 0},
+                                        {0, 0, 1, 1, 1, 1, 1, 0},
+                                        {0, 0, 0, 1, 1, 1, 1, 1}};
+
+constexpr uint8_t sbox_vector[] = {1, 1, 0, 0, 0, 1, 1, 0};
+
+const uint16_t AES_IRREDUCIBLE_POLYNOMIAL = 0b100011011;
+
+/// The published S-Box values (https://en.wikipedia.org/wiki/Rijndael_S-box). These are not used for encryption, they are only here to check the generated S-Box against.
+constexpr uint8_t sbox_const[] = {0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+           0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+           0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+           0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+           0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+           0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+           0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+           0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+           0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+           0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+           0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+           0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+           0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+           0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+           0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+           0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
+
+
+
+/**
+ * @return the degree of a nonzero polynomial, which is the position of its highest set bit
+ */
+constexpr uint8_t gf2_8_degree(uint16_t polynomial) {
+    return std::bit_width(polynomial) - 1;
+}
+
+constexpr uint8_t gf2_8_reduce_product(uint16_t value, uint16_t polynomial) {
+    const uint8_t polynomial_degree = gf2_8_degree(polynomial);
+
+    /// Cancel the highest term with a shifted copy of the polynomial until the degree is below the polynomial's.
+    while (value >> polynomial_degree) {
+        value ^= polynomial << (gf2_8_degree(value) - polynomial_degree);
+    }
+
+    return value;
+}
+
+constexpr uint8_t gf2_8_multiplication(uint8_t a, uint8_t b, uint16_t polynomial) {
+    uint16_t output = 0;
+
+    for (int bit = 0; bit < 8; bit++) {
+        if ((a >> bit) & (0b1)) {
+            output ^= (uint16_t) b << bit;
+        }
+    }
+
+    return gf2_8_reduce_product(output, polynomial);
+}
+
+/**
+ *
+ * @param a
+ * @param b
+ * @return A 16-bit value which is comprised of the quotient in the first 8-bits and the remainder in the last 8-bits
+ */
+constexpr uint16_t gf2_8_division(uint16_t a, uint16_t b) {
+    if (b == 0) {
+        std::cerr << "DIV ERROR: Divide by zero\n";
+        exit(1);
+    }
+
+    const uint8_t b_degree = gf2_8_degree(b);
+    uint8_t quotient = 0;
+
+    while (a >> b_degree) {
+        uint8_t degree_difference = gf2_8_degree(a) - b_degree;
+
+        quotient |= 0b1 << degree_difference;
+
+        a ^= b << degree_difference;
+    }
+
+    return ((quotient << 8) | a);
+}
+
+
+/**
+ *
+ * @param value - Any value on the fininte field GF(2^8)
+ * @param polynomial - any irreducible polynomial in binary (AES uses x^8 + x^4 + x^3 + x + 1 or 0b100011011)
+ * @return The <b>value</b>'s inverse
+ *
+ * Uses the Extended Euclidean algorithm to find the inverse of the given value in GF(2^8).
+ */
+constexpr uint8_t gf_2_8_get_value_inverse(const uint8_t value, uint16_t polynomial) {
+    /// Each remainder has a lower degree than the last so the algorithm finishes in at most 10 steps.
+    uint16_t remainders[12] = {polynomial, value};
+    uint16_t quotients[12] = {0};
+    uint8_t quotients_size = 1;
+
+    uint16_t first_result = gf2_8_division(polynomial, value);
+
+    quotients[quotients_size++] = (first_result >> 8) & 0xff;
+    remainders[2] = first_result & 0xff;
+
+    for (int n = 2; remainders[n]; n++) {
+        uint16_t result = gf2_8_division(remainders[n - 1], remainders[n]);
+
+        quotients[quotients_size++] = (result >> 8) & 0xff;
+        remainders[n + 1] = result & 0xff;
+    }
+
+    uint8_t aux[13] = {0, 1};
+
+    for (int n = 2; n < quotients_size + 1; n++) {
+        aux[n] = aux[n - 2] ^ gf2_8_multiplication(quotients[n - 1], aux[n - 1], polynomial);
+    }
+
+    return aux[quotients_size - 1];
+}
+
+/// The rest of the GF(2^8) functions are fixed to the AES field, x^8 + x^4 + x^3 + x + 1, which is also the one most other byte oriented codes use.
+
+/**
+ * Multiplies by x (2), which is usually called xtime: a shift, then a reduction when the high bit falls off. There is no branch so it takes the same time for every value.
+ */
+constexpr uint8_t gf2_8_xtime(uint8_t value) {
+    return (value << 1) ^ (0x1b & -(value >> 7));
+}
+
+/**
+ * Shift and add multiplication built on xtime. Slower than the tables but constant time.
+ */
+constexpr uint8_t gf2_8_multiply_xtime(uint8_t a, uint8_t b) {
+    uint8_t out = 0;
+
+    for (int bit = 0; bit < 8; bit++) {
+        out ^= a & -(b & 1);
+        a = gf2_8_xtime(a);
+        b >>= 1;
+    }
+
+    return out;
+}
+
+/**
+ * @return the powers of the generator 3. The table is doubled so a sum of two logs can index it without reducing mod 255.
+ */
+constexpr std::array<uint8_t, 512> gf2_8_generate_exp_table() {
+    std::array<uint8_t, 512> out = {};
+    uint8_t value = 1;
+
+    for (int power = 0; power < 255; power++) {
+        out[power] = value;
+        out[power + 255] = value;
+        /// value * 3 = value * 2 + value
+        value ^= gf2_8_xtime(value);
+    }
+    out[510] = out[0];
+    out[511] = out[1];
+
+    return out;
+}
+
+constexpr std::array<uint8_t, 512> gf2_8_exp = gf2_8_generate_exp_table();
+
+/**
+ * @return the discrete log base 3 of every nonzero value. Zero has no log and is left at 0.
+ */
+constexpr std::array<uint8_t, 256> gf2_8_generate_log_table() {
+    std::array<uint8_t, 256> out = {};
+
+    for (int power = 0; power < 255; power++) {
+        out[gf2_8_exp[power]] = power;
+    }
+
+    return out;
+}
+
+constexpr std::array<uint8_t, 256> gf2_8_log = gf2_8_generate_log_table();
+
+/**
+ * a * b = 3^(log a + log b). The lookups depend on the values, so use gf2_8_multiply_xtime for secret data.
+ */
+constexpr uint8_t gf2_8_multiply(uint8_t a, uint8_t b) {
+    return (a && b) ? gf2_8_exp[gf2_8_log[a] + gf2_8_log[b]] : 0;
+}
+
+/**
+ * @return the inverse of every value, with 0 mapping to 0 the way the S-Box treats it
+ */
+constexpr std::array<uint8_t, 256> gf2_8_generate_inverse_table() {
+    std::array<uint8_t, 256> out = {};
+
+    for (int value = 1; value < 256; value++) {
+        out[value] = gf2_8_exp[255 - gf2_8_log[value]];
+    }
+
+    return out;
+}
+
+constexpr std::array<uint8_t, 256> gf2_8_inverse_table = gf2_8_generate_inverse_table();
+
+constexpr uint8_t gf2_8_inverse(uint8_t value) {
+    return gf2_8_inverse_table[value];
+}
+
+/**
+ * Multiplying by a constant is linear, so c * v = c * (v & 0x0f) ^ c * (v & 0xf0). Two 16 entry tables cover every value and fit in a vector register,
+ * which is what lets PSHUFB do 16 or 32 lookups at once.
+ */
+struct gf2_8_nibble_tables {
+    alignas(16) uint8_t low[16];
+    alignas(16) uint8_t high[16];
+};
+
+constexpr gf2_8_nibble_tables gf2_8_get_nibble_tables(uint8_t multiplier) {
+    gf2_8_nibble_tables out = {};
+
+    for (int nibble = 0; nibble < 16; nibble++) {
+        out.low[nibble] = gf2_8_multiply(multiplier, nibble);
+        out.high[nibble] = gf2_8_multiply(multiplier, nibble << 4);
+    }
+
+    return out;
+}
+
+/**
+ * @return true if the CPU (and OS) support AVX2, so the bitsliced engine can process 16 blocks at once instead of 8 and gf2_8_multiply_region 32 bytes at a time
+ */
+inline bool aes_avx2_supported() {
+#ifdef AES_HAS_AVX2
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+template <bool accumulate>
+inline size_t gf2_8_region_scalar(const gf2_8_nibble_tables& tables, const uint8_t* input, uint8_t* output, size_t position, size_t length) {
+    for (; position < length; position++) {
+        uint8_t product = tables.low[input[position] & 0x0f] ^ tables.high[input[position] >> 4];
+        output[position] = accumulate ? output[position] ^ product : product;
+    }
+    return position;
+}
+
+#ifdef AES_HAS_AES_NI
+
+inline bool gf2_8_ssse3_supported() {
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
+
+/// @return <b>length</b>, the last partial block goes through a padded copy so every byte is looked up in a register
+template <bool accumulate>
+AES_SSSE3_TARGET size_t gf2_8_region_ssse3(const gf2_8_nibble_tables& tables, const uint8_t* input, uint8_t* output, size_t position, size_t length) {
+    const __m128i low = _mm_load_si128((const __m128i*) tables.low);
+    const __m128i high = _mm_load_si128((const __m128i*) tables.high);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    auto multiply = [&](const uint8_t* in, uint8_t* out) AES_SSSE3_TARGET {
+        __m128i value = _mm_loadu_si128((const __m128i*) in);
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(value, mask)), _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(value, 4), mask)));
+        if (accumulate) {
+            product = _mm_xor_si128(product, _mm_loadu_si128((const __m128i*) out));
+        }
+        _mm_storeu_si128((__m128i*) out, product);
+    };
+
+    for (; position + 16 <= length; position += 16) {
+        multiply(input + position, output + position);
+    }
+
+    if (position < length) {
+        alignas(16) uint8_t in[16] = {};
+        alignas(16) uint8_t out[16] = {};
+        std::memcpy(in, input + position, length - position);
+        std::memcpy(out, output + position, length - position);
+        multiply(in, out);
+        std::memcpy(output + position, out, length - position);
+    }
+    return length;
+}
+
+#endif
+
+#ifdef AES_HAS_AVX2
+
+/// @return how far it got, at most 31 bytes short of <b>length</b>
+template <bool accumulate>
+AES_AVX2_TARGET size_t gf2_8_region_avx2(const gf2_8_nibble_tables& tables, const uint8_t* input, uint8_t* output, size_t position, size_t length) {
+    /// VPSHUFB looks up within each 128-bit half, so both halves get a copy of the tables.
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) tables.low));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) tables.high));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    for (; position + 32 <= length; position += 32) {
+        __m256i value = _mm256_loadu_si256((const __m256i*) (input + position));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(value, mask)), _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(value, 4), mask)));
+        if (accumulate) {
+            product = _mm256_xor_si256(product, _mm256_loadu_si256((const __m256i*) (output + position)));
+        }
+        _mm256_storeu_si256((__m256i*) (output + position), product);
+    }
+    return position;
+}
+
+#endif
+
+template <bool accumulate>
+inline void gf2_8_region(uint8_t multiplier, const uint8_t* input, uint8_t* output, size_t length) {
+    const gf2_8_nibble_tables tables = gf2_8_get_nibble_tables(multiplier);
+    size_t position = 0;
+
+    /// Each one picks up where the wider one before it stopped.
+#ifdef AES_HAS_AVX2
+    if (aes_avx2_supported()) {
+        position = gf2_8_region_avx2<accumulate>(tables, input, output, position, length);
+    }
+#endif
+#ifdef AES_HAS_AES_NI
+    if (gf2_8_ssse3_supported()) {
+        position = gf2_8_region_ssse3<accumulate>(tables, input, output, position, length);
+    }
+#endif
+
+    gf2_8_region_scalar<accumulate>(tables, input, output, position, length);
+}
+
+/**
+ * @param multiplier - the constant to multiply by
+ * @param input - the bytes to multiply
+ * @param output - receives each byte of <b>input</b> multiplied by <b>multiplier</b>, may be the same as <b>input</b>
+ * @param length - the number of bytes
+ *
+ * Uses PSHUFB on the nibble tables 32 bytes at a time with AVX2 and 16 with SSSE3, including the last few bytes. The lookups are into registers, so unlike gf2_8_multiply
+ * this is constant time. Without SSSE3 (other architectures, or very old x86 CPUs) it indexes the nibble tables in memory with the data, which isn't.
+ */
+inline void gf2_8_multiply_region(uint8_t multiplier, const uint8_t* input, uint8_t* output, size_t length) {
+    gf2_8_region<false>(multiplier, input, output, length);
+}
+
+/**
+ * The same as gf2_8_multiply_region but xors the products into <b>output</b>, which is the inner step of a matrix multiply or a Reed-Solomon encoder.
+ */
+inline void gf2_8_multiply_add_region(uint8_t multiplier, const uint8_t* input, uint8_t* output, size_t length) {
+    gf2_8_region<true>(multiplier, input, output, length);
+}
+
+constexpr uint8_t aes_generate_sbox_value(uint8_t value) {
+    uint8_t inverse = 0;
+    if (value != 0) {
+        inverse = gf_2_8_get_value_inverse(value, AES_IRREDUCIBLE_POLYNOMIAL);
+    }
+    uint8_t result = 0;
+
+    uint8_t current_bit;
+
+    for (int bit = 0; bit < 8; bit++) {
+        current_bit = ((sbox_matrix[bit][0] * (inverse & 0b00000001)) ^
+                       (sbox_matrix[bit][1] * ((inverse & 0b00000010) >> 1)) ^
+                       (sbox_matrix[bit][2] * ((inverse & 0b00000100) >> 2)) ^
+                       (sbox_matrix[bit][3] * ((inverse & 0b00001000) >> 3)) ^
+                       (sbox_matrix[bit][4] * ((inverse & 0b00010000) >> 4)) ^
+                       (sbox_matrix[bit][5] * ((inverse & 0b00100000) >> 5)) ^
+                       (sbox_matrix[bit][6] * ((inverse & 0b01000000) >> 6)) ^
+                       (sbox_matrix[bit][7] * ((inverse & 0b10000000) >> 7))) ^
+                      sbox_vector[bit];
+
+        result |= current_bit << bit;
+    }
+
+    return result;
+}
+
+
+constexpr std::array<uint8_t, 256> aes_generate_sbox() {
+    std::array<uint8_t, 256> out = {};
+
+    for (int value = 0; value < 256; value++) {
+        out[value] = aes_generate_sbox_value(value);
+    }
+
+    return out;
+}
+
+constexpr std::array<uint8_t, 256> aes_generate_inverse_sbox(const std::array<uint8_t, 256>& forward) {
+    std::array<uint8_t, 256> out = {};
+
+    for (int index = 0; index < 256; index++) {
+        out[forward[index]] = index;
+    }
+
+    return out;
+}
+
+/**
+ * @param multiplier - the constant every table entry is multiplied by
+ * @return a table where each index holds the index multiplied by <b>multiplier</b> in GF(2^8)
+ */
+constexpr std::array<uint8_t, 256> aes_generate_multiplication_table(uint8_t multiplier) {
+    std::array<uint8_t, 256> out = {};
+
+    for (int value = 0; value < 256; value++) {
+        out[value] = gf2_8_multiplication(multiplier, value, AES_IRREDUCIBLE_POLYNOMIAL);
+    }
+
+    return out;
+}
+
+/// All of these are generated when compiling so they are never built at runtime and end up in read-only memory.
+constexpr std::array<uint8_t, 256> sbox = aes_generate_sbox();
+constexpr std::array<uint8_t, 256> inverse_sbox = aes_generate_inverse_sbox(sbox);
+
+/// Multiplication by 2 is usually called xtime. The rest are the constants used by mix columns and its inverse.
+constexpr std::array<uint8_t, 256> aes_multiply_by_2 = aes_generate_multiplication_table(2);
+constexpr std::array<uint8_t, 256> aes_multiply_by_3 = aes_generate_multiplication_table(3);
+constexpr std::array<uint8_t, 256> aes_multiply_by_9 = aes_generate_multiplication_table(9);
+constexpr std::array<uint8_t, 256> aes_multiply_by_11 = aes_generate_multiplication_table(11);
+constexpr std::array<uint8_t, 256> aes_multiply_by_13 = aes_generate_multiplication_table(13);
+constexpr std::array<uint8_t, 256> aes_multiply_by_14 = aes_generate_multiplication_table(14);
+
+constexpr bool aes_verify_tables() {
+    for (int value = 0; value < 256; value++) {
+        if (sbox[value] != sbox_const[value] || inverse_sbox[sbox[value]] != value) {
+            return false;
+        }
+
+        uint8_t xtime = gf2_8_xtime(value);
+        if (aes_multiply_by_2[value] != xtime || aes_multiply_by_3[value] != (xtime ^ value)) {
+            return false;
+        }
+
+        /// The log table inverse has to agree with the extended Euclidean one the S-Box is built from.
+        if (value != 0 && gf2_8_inverse(value) != gf_2_8_get_value_inverse(value, AES_IRREDUCIBLE_POLYNOMIAL)) {
+            return false;
+        }
+
+        /// 9, 11, 13 and 14 can all be built out of repeated xtimes.
+        uint8_t x4 = aes_multiply_by_2[xtime], x8 = aes_multiply_by_2[x4];
+        if (aes_multiply_by_9[value] != (x8 ^ value) || aes_multiply_by_11[value] != (x8 ^ xtime ^ value) ||
+            aes_multiply_by_13[value] != (x8 ^ x4 ^ value) || aes_multiply_by_14[value] != (x8 ^ x4 ^ xtime)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static_assert(aes_verify_tables(), "The generated AES tables do not match the published S-Box");
+
+inline uint8_t aes_sub_word8(uint8_t word) {
+    return sbox[word];
+}
+
+inline uint32_t aes_sub_word32(uint32_t word) {
+    uint32_t out = 0;
+
+    out |= aes_sub_word8((word >> 24) & 0xff) << 24;
+    out |= aes_sub_word8((word >> 16) & 0xff) << 16;
+    out |= aes_sub_word8((word >> 8) & 0xff) << 8;
+    out |= aes_sub_word8(word & 0xff);
+
+    return out;
+}
+
+
+inline uint8_t aes_inverse_sub_word8(uint8_t word) {
+    return inverse_sbox[word];
+}
+
+inline uint32_t aes_inverse_sub_word32(uint32_t word) {
+    uint32_t out = 0;
+
+    out |= aes_inverse_sub_word8((word >> 24) & 0xff) << 24;
+    out |= aes_inverse_sub_word8((word >> 16) & 0xff) << 16;
+    out |= aes_inverse_sub_word8((word >> 8) & 0xff) << 8;
+    out |= aes_inverse_sub_word8(word & 0xff);
+
+    return out;
+}
+
+/**
+ * The sizes that depend on the key length, so that everything past the key expansion can be specialized for each key size.
+ * key_len is the key size in 32-bit words (N in the key expansion).
+ */
+template <size_t key_bytes>
+struct aes_key_size {
+    static_assert(key_bytes == 16 || key_bytes == 24 || key_bytes == 32, "AES keys are 128, 192 or 256 bits");
+
+    static constexpr uint8_t key_len = key_bytes / 4;
+    static constexpr uint8_t rounds = key_len + 6;
+};
+
+/**
+ *
+ * @param n - length of key (4 for 128-bit)
+ * @param key - <b>n</b> key words
+ * @param r - number of rounds (11 for 128-bit)
+ * @param w - receives the 4 * <b>r</b> words of the round keys
+ * @param sub_word - applies the S-Box to each byte of a word, aes_bitslice_sub_word32 for the bitsliced engine so the schedule doesn't look up the key bytes in a table
+ */
+inline void aes_get_round_keys(uint8_t n, const uint32_t* key, uint8_t r, uint32_t* w, uint32_t (*sub_word)(uint32_t) = aes_sub_word32) {
+    uint32_t rc[16];
+    aes_get_round_constants(r, rc);
+
+
+    /// There are four words for every round key, so stop there rather than at n * r which overruns the schedule for every key size.
+    for (int round = 0; round < 4 * r; round++) {
+        if (round < n) {
+            w[round] = key[round];
+        }
+        else if ((round % n) == 0) {
+            w[round] = (w[round - n] ^ (sub_word(aes_rot_word(w[round - 1])))) ^ rc[round / n];
+        }
+        else if (n > 6 && (round % n) == 4) {
+            w[round] = w[round - n] ^ sub_word(w[round - 1]);
+        }
+        else {
+            w[round] = w[round - n] ^ w[round - 1];
+        }
+    }
+}
+
+/**
+ * @param n - length of key (4 for 128-bit)
+ * @param key - key as a vector of uint32_t
+ * @param r - number of rounds (11 for 128-bit)
+ * @param sub_word - see above
+ * @return a vector of round keys
+ */
+inline std::vector<uint32_t> aes_get_round_keys(uint8_t n, std::vector<uint32_t> key, uint8_t r, uint32_t (*sub_word)(uint32_t) = aes_sub_word32) {
+    std::vector<uint32_t> w(4 * r);
+    aes_get_round_keys(n, key.data(), r, w.data(), sub_word);
+    return w;
+}
+
+
+/**
+ * The 16 byte state in the order the bytes of a block come in, so byte 4 * column + row is the byte at that row and column.
+ * On x86 it is a single SSE register, which makes add round key one xor and shift rows one byte shuffle, and nothing about it allocates.
+ */
+struct alignas(16) aes_state {
+#ifdef AES_HAS_AES_NI
+    __m128i bytes;
+#else
+    std::array<uint8_t, 16> bytes;
+#endif
+};
+
+/**
+ * @param words - four big endian column words, the way blocks and round keys are stored everywhere else
+ */
+inline aes_state aes_state_load(const uint32_t* words) {
+#ifdef AES_HAS_AES_NI
+    return {_mm_set_epi32(__builtin_bswap32(words[3]), __builtin_bswap32(words[2]), __builtin_bswap32(words[1]), __builtin_bswap32(words[0]))};
+#else
+    aes_state state;
+    for (uint8_t index = 0; index < 16; index++) {
+        state.bytes[index] = words[index / 4] >> (24 - (index % 4) * 8);
+    }
+    return state;
+#endif
+}
+
+inline std::array<uint8_t, 16> aes_state_get_bytes(const aes_state& state) {
+#ifdef AES_HAS_AES_NI
+    std::array<uint8_t, 16> bytes;
+    _mm_storeu_si128((__m128i*) bytes.data(), state.bytes);
+    return bytes;
+#else
+    return state.bytes;
+#endif
+}
+
+inline void aes_state_set_bytes(aes_state& state, const std::array<uint8_t, 16>& bytes) {
+#ifdef AES_HAS_AES_NI
+    state.bytes = _mm_loadu_si128((const __m128i*) bytes.data());
+#else
+    state.bytes = bytes;
+#endif
+}
+
+inline void aes_state_store(const aes_state& state, uint32_t* words) {
+    std::array<uint8_t, 16> bytes = aes_state_get_bytes(state);
+    for (uint8_t column = 0; column < 4; column++) {
+        words[column] = ((uint32_t) bytes[column * 4] << 24) | ((uint32_t) bytes[column * 4 + 1] << 16) | ((uint32_t) bytes[column * 4 + 2] << 8) | bytes[column * 4 + 3];
+    }
+}
+
+inline void aes_add_round_key(aes_state& state, const uint32_t* round_key) {
+#ifdef AES_HAS_AES_NI
+    state.bytes = _mm_xor_si128(state.bytes, aes_state_load(round_key).bytes);
+#else
+    aes_state key = aes_state_load(round_key);
+    for (uint8_t index = 0; index < 16; index++) {
+        state.bytes[index] ^= key.bytes[index];
+    }
+#endif
+}
+
+inline void aes_sub_bytes(aes_state& state) {
+    std::array<uint8_t, 16> bytes = aes_state_get_bytes(state);
+    for (uint8_t& byte : bytes) {
+        byte = aes_sub_word8(byte);
+    }
+    aes_state_set_bytes(state, bytes);
+}
+
+inline void aes_inverse_sub_bytes(aes_state& state) {
+    std::array<uint8_t, 16> bytes = aes_state_get_bytes(state);
+    for (uint8_t& byte : bytes) {
+        byte = aes_inverse_sub_word8(byte);
+    }
+    aes_state_set_bytes(state, bytes);
+}
+
+/**
+ * @param state
+ * @param row_index
+ * @return the row in the state at row_index
+ *
+ * Since the state is stored rotated from how AES operates we need to go through all the columns in the state and grab one byte of the row from each.
+ */
+inline uint32_t aes_extract_row(const aes_state& state, uint8_t row_index) {
+    std::array<uint8_t, 16> bytes = aes_state_get_bytes(state);
+    uint32_t row = 0;
+    for (uint8_t col = 0; col < 4; col++) {
+        row |= (uint32_t) bytes[col * 4 + row_index] << (24 - (8 * col));
+    }
+    return row;
+}
+
+inline void aes_print_state(const aes_state& state) {
+    for (uint8_t row_index = 0; row_index < 4; row_index++) {
+        uint32_t row = aes_extract_row(state, row_index);
+        for (int column_index = 0; column_index < 4; column_index++) {
+            std::cout << std::hex << ((row >> (24 - (column_index * 8))) & 0xff) << ' ';
+        }
+        std::cout << '\n';
+    }
+    std::cout << '\n' << std::dec;
+}
+
+/// Where each byte of the state comes from after shift rows, row r moves r columns to the left. This is the PSHUFB control for it.
+constexpr uint8_t aes_shift_rows_order[16] = {0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11};
+/// And the other way round, row r moves r columns to the right.
+constexpr uint8_t aes_reverse_shift_rows_order[16] = {0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3};
+
+#if defined(AES_HAS_AES_NI) && !defined(__SSSE3__)
+/**
+ * Shift rows without PSHUFB, which isn't part of the x86-64 baseline. Rotating whole columns only takes a PSHUFD, so each row is taken out of the state rotated by that row's amount.
+ * The template parameters are the PSHUFD controls that rotate the columns for rows 1, 2 and 3.
+ */
+template <int row_1, int row_2, int row_3>
+inline __m128i aes_shift_rows_sse2(__m128i state) {
+    /// Within each column word row r is byte r.
+    const __m128i mask_0 = _mm_set1_epi32(0x000000ff), mask_1 = _mm_set1_epi32(0x0000ff00), mask_2 = _mm_set1_epi32(0x00ff0000), mask_3 = _mm_set1_epi32((int) 0xff000000);
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(state, mask_0), _mm_and_si128(_mm_shuffle_epi32(state, row_1), mask_1)),
+                        _mm_or_si128(_mm_and_si128(_mm_shuffle_epi32(state, row_2), mask_2), _mm_and_si128(_mm_shuffle_epi32(state, row_3), mask_3)));
+}
+#endif
+
+inline void aes_shift_rows(aes_state& state) {
+#if defined(AES_HAS_AES_NI) && defined(__SSSE3__)
+    state.bytes = _mm_shuffle_epi8(state.bytes, _mm_loadu_si128((const __m128i*) aes_shift_rows_order));
+#elif defined(AES_HAS_AES_NI)
+    state.bytes = aes_shift_rows_sse2<_MM_SHUFFLE(0, 3, 2, 1), _MM_SHUFFLE(1, 0, 3, 2), _MM_SHUFFLE(2, 1, 0, 3)>(state.bytes);
+#else
+    std::array<uint8_t, 16> bytes = state.bytes;
+    for (uint8_t index = 0; index < 16; index++) {
+        state.bytes[index] = bytes[aes_shift_rows_order[index]];
+    }
+#endif
+}
+
+inline void aes_reverse_shift_rows(aes_state& state) {
+#if defined(AES_HAS_AES_NI) && defined(__SSSE3__)
+    state.bytes = _mm_shuffle_epi8(state.bytes, _mm_loadu_si128((const __m128i*) aes_reverse_shift_rows_order));
+#elif defined(AES_HAS_AES_NI)
+    state.bytes = aes_shift_rows_sse2<_MM_SHUFFLE(2, 1, 0, 3), _MM_SHUFFLE(1, 0, 3, 2), _MM_SHUFFLE(0, 3, 2, 1)>(state.bytes);
+#else
+    std::array<uint8_t, 16> bytes = state.bytes;
+    for (uint8_t index = 0; index < 16; index++) {
+        state.bytes[index] = bytes[aes_reverse_shift_rows_order[index]];
+    }
+#endif
+}
+
+/**
+ * Shift and add like gf2_8_multiply_xtime, so mix columns has no lookups indexed by the state. It only loops over the bits of <b>a</b>, the constant from the matrix,
+ * so once inlined it comes down to one or two xtimes.
+ */
+inline uint8_t aes_mix_column_multiply(uint8_t a, uint8_t b) {
+    uint8_t out = 0;
+
+    for (; a; a >>= 1) {
+        if (a & 1) {
+            out ^= b;
+        }
+        b = gf2_8_xtime(b);
+    }
+
+    return out;
+}
+/**
+ *
+ * @param value - a column from the state
+ * @return the column after applying the mix to it
+ *
+ *  This is one implementation of the mix column function that uses matrix multiplication. I prefer the polynomial multiplication for its understandability but this also a correct implementation.
+ */
+inline uint32_t aes_mix_column_matrix(uint32_t value) {
+    uint16_t b[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
+                    (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
+
+    uint8_t d[] = {(uint8_t)(aes_multiply_by_2[b[0]] ^ aes_multiply_by_3[b[1]] ^ b[2] ^ b[3]),
+                   (uint8_t)(aes_multiply_by_2[b[1]] ^ aes_multiply_by_3[b[2]] ^ b[3] ^ b[0]),
+                   (uint8_t)(aes_multiply_by_2[b[2]] ^ aes_multiply_by_3[b[3]] ^ b[0] ^ b[1]),
+                   (uint8_t)(aes_multiply_by_2[b[3]] ^ aes_multiply_by_3[b[0]] ^ b[1] ^ b[2])};
+
+    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+}
+
+/**
+ * @param value - a column from the state
+ * @return the column after applying the mix to it
+ *
+ * This is my preferred implementation of the mix column function that uses polynomial multiplication. I prefer it because it uses the math that the matrix multiplication is derived from. This implementation doesn't use magical constants, and so I have an easier time understanding it.
+ */
+inline uint32_t aes_mix_column_polynomial(uint32_t value) {
+    uint8_t a[] = {2, 1, 1, 3};
+    uint16_t b[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
+                   (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
+    uint8_t c[] = {aes_mix_column_multiply(a[0], b[0]),
+                   (uint8_t)((aes_mix_column_multiply(a[1], b[0]) ^ aes_mix_column_multiply(a[0], b[1]))),
+                   (uint8_t)((aes_mix_column_multiply(a[2], b[0]) ^ aes_mix_column_multiply(a[1], b[1])) ^ aes_mix_column_multiply(a[0], b[2])),
+                   (uint8_t)((aes_mix_column_multiply(a[3], b[0]) ^ aes_mix_column_multiply(a[2], b[1])) ^ aes_mix_column_multiply(a[1], b[2]) ^ aes_mix_column_multiply(a[0], b[3])),
+                   (uint8_t)((aes_mix_column_multiply(a[3], b[1]) ^ aes_mix_column_multiply(a[2], b[2])) ^ aes_mix_column_multiply(a[1], b[3])),
+                   (uint8_t)((aes_mix_column_multiply(a[3], b[2]) ^ aes_mix_column_multiply(a[2], b[3]))),
+                   aes_mix_column_multiply(a[3], b[3])};
+
+    return ((c[0] ^ c[4]) << 24) | ((c[1] ^ c[5]) << 16) | ((c[2] ^ c[6]) << 8) | c[3];
+}
+
+// This is an alternative inverse which is harder to understand in my opinion, but I left it in in case it help someone understand.
+//uint32_t aes_inverse_mix_column(uint32_t value) {
+//    uint16_t d[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
+//                    (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
+//
+//    uint8_t b[] = {(uint8_t)(aes_mix_column_multiply(14, b[0]) ^ aes_mix_column_multiply(11, b[1]) ^ aes_mix_column_multiply(13, b[2]) ^ aes_mix_column_multiply(9, b[3])),
+//                   (uint8_t)(aes_mix_column_multiply(9, b[0]) ^ aes_mix_column_multiply(14, b[1]) ^ aes_mix_column_multiply(11, b[2]) ^ aes_mix_column_multiply(13, b[3])),
+//                   (uint8_t)(aes_mix_column_multiply(13, b[0]) ^ aes_mix_column_multiply(9, b[1]) ^ aes_mix_column_multiply(14, b[2]) ^ aes_mix_column_multiply(11, b[3])),
+//                   (uint8_t)(aes_mix_column_multiply(11, b[0]) ^ aes_mix_column_multiply(13, b[1]) ^ aes_mix_column_multiply(9, b[2]) ^ aes_mix_column_multiply(14, b[3]))};
+//
+//    return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+//}
+
+inline uint32_t aes_inverse_mix_column(uint32_t value) {
+    uint8_t d[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
+                   (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
+
+    // 14 11 13 9
+    // 9 14 11 13
+    // 13 9 14 11
+    // 11 13 9 14
+    uint8_t b[4];
+
+    for (int row = 0; row < 4; row++) {
+        b[row] = aes_multiply_by_14[d[row]] ^
+                 aes_multiply_by_11[d[(row + 1) % 4]] ^
+                 aes_multiply_by_13[d[(row + 2) % 4]] ^
+                 aes_multiply_by_9[d[(row + 3) % 4]];
+    }
+
+    return (b[3]) | (b[2] << 8) | (b[1] << 16) | (b[0] << 24);
+}
+
+/// aes_mix_column_polynomial or aes_mix_column_matrix.
+typedef uint32_t (*aes_mix_column_type)(uint32_t);
+
+/// The mix column function aes_mix_columns uses. Both give the same result, so aes_use_selected_mix_column can switch it to whichever is faster on the CPU it runs on.
+inline std::atomic<aes_mix_column_type> aes_mix_column_function = aes_mix_column_polynomial;
+
+inline void aes_mix_columns(aes_state& state) {
+    uint32_t columns[4];
+    aes_state_store(state, columns);
+
+    aes_mix_column_type mix_column = aes_mix_column_function.load(std::memory_order_relaxed);
+    for (uint32_t& column : columns) {
+        column = mix_column(column);
+    }
+
+    state = aes_state_load(columns);
+}
+
+inline void aes_inverse_mix_columns(aes_state& state) {
+    uint32_t columns[4];
+    aes_state_store(state, columns);
+
+    for (uint32_t& column : columns) {
+        column = aes_inverse_mix_column(column);
+    }
+
+    state = aes_state_load(columns);
+}
+
+
+/**
+ * @param shift - how many bytes to rotate the column to the right
+ * @return one of the four encryption T-tables
+ *
+ * A T-table entry is the column you get from mix columns when a single s-boxed byte is in the row <b>shift</b> and the other three bytes are zero.
+ * Since mix columns is linear the full mixed column is the xor of the four entries for its bytes, which lets one round be done with lookups and xors.
+ */
+constexpr std::array<uint32_t, 256> aes_generate_encryption_table(uint8_t shift) {
+    std::array<uint32_t, 256> out = {};
+
+    for (int value = 0; value < 256; value++) {
+        uint8_t s = sbox[value];
+        uint32_t column = (aes_multiply_by_2[s] << 24) | (s << 16) | (s << 8) | aes_multiply_by_3[s];
+
+        out[value] = shift ? (column >> (shift * 8)) | (column << (32 - shift * 8)) : column;
+    }
+
+    return out;
+}
+
+constexpr std::array<uint32_t, 256> aes_te0 = aes_generate_encryption_table(0);
+constexpr std::array<uint32_t, 256> aes_te1 = aes_generate_encryption_table(1);
+constexpr std::array<uint32_t, 256> aes_te2 = aes_generate_encryption_table(2);
+constexpr std::array<uint32_t, 256> aes_te3 = aes_generate_encryption_table(3);
+
+static_assert(aes_te0[0x00] == 0xc66363a5 && aes_te3[0xff] == 0x16163a2c, "The T-tables do not match the published values");
+
+/**
+ * @tparam rounds - number of rounds (10 for 128-bit), fixed when compiling so the loop is unrolled for every key size
+ * @param state - four column words of a single block, replaced with the encrypted block
+ * @param round_keys - the output of aes_get_round_keys
+ *
+ * Does the same work as the reference implementation in aes_encrypt but sub bytes, shift rows, mix columns and add round key are fused into table lookups.
+ * Shift rows is handled by which column each byte is read from: row r of output column c comes from column (c + r) % 4.
+ */
+template <uint8_t rounds>
+void aes_encrypt_block_ttable(uint32_t* state, const uint32_t* round_keys) {
+    uint32_t s0 = state[0] ^ round_keys[0];
+    uint32_t s1 = state[1] ^ round_keys[1];
+    uint32_t s2 = state[2] ^ round_keys[2];
+    uint32_t s3 = state[3] ^ round_keys[3];
+
+#pragma GCC unroll 16
+    for (uint8_t round = 1; round < rounds; round++) {
+        const uint32_t* round_key = round_keys + (round * 4);
+
+        uint32_t t0 = aes_te0[s0 >> 24] ^ aes_te1[(s1 >> 16) & 0xff] ^ aes_te2[(s2 >> 8) & 0xff] ^ aes_te3[s3 & 0xff] ^ round_key[0];
+        uint32_t t1 = aes_te0[s1 >> 24] ^ aes_te1[(s2 >> 16) & 0xff] ^ aes_te2[(s3 >> 8) & 0xff] ^ aes_te3[s0 & 0xff] ^ round_key[1];
+        uint32_t t2 = aes_te0[s2 >> 24] ^ aes_te1[(s3 >> 16) & 0xff] ^ aes_te2[(s0 >> 8) & 0xff] ^ aes_te3[s1 & 0xff] ^ round_key[2];
+        uint32_t t3 = aes_te0[s3 >> 24] ^ aes_te1[(s0 >> 16) & 0xff] ^ aes_te2[(s1 >> 8) & 0xff] ^ aes_te3[s2 & 0xff] ^ round_key[3];
+
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    /// The last round has no mix columns so the s-box is used directly.
+    const uint32_t* round_key = round_keys + (rounds * 4);
+
+    state[0] = ((sbox[s0 >> 24] << 24) | (sbox[(s1 >> 16) & 0xff] << 16) | (sbox[(s2 >> 8) & 0xff] << 8) | sbox[s3 & 0xff]) ^ round_key[0];
+    state[1] = ((sbox[s1 >> 24] << 24) | (sbox[(s2 >> 16) & 0xff] << 16) | (sbox[(s3 >> 8) & 0xff] << 8) | sbox[s0 & 0xff]) ^ round_key[1];
+    state[2] = ((sbox[s2 >> 24] << 24) | (sbox[(s3 >> 16) & 0xff] << 16) | (sbox[(s0 >> 8) & 0xff] << 8) | sbox[s1 & 0xff]) ^ round_key[2];
+    state[3] = ((sbox[s3 >> 24] << 24) | (sbox[(s0 >> 16) & 0xff] << 16) | (sbox[(s1 >> 8) & 0xff] << 8) | sbox[s2 & 0xff]) ^ round_key[3];
+}
+
+/**
+ * @param shift - how many bytes to rotate the column to the right
+ * @return one of the four decryption T-tables
+ *
+ * The decryption entries are the same idea with the inverse s-box and inverse mix columns: the column for a single inverse s-boxed byte in the row <b>shift</b>.
+ */
+constexpr std::array<uint32_t, 256> aes_generate_decryption_table(uint8_t shift) {
+    std::array<uint32_t, 256> out = {};
+
+    for (int value = 0; value < 256; value++) {
+        uint8_t s = inverse_sbox[value];
+        uint32_t column = (aes_multiply_by_14[s] << 24) | (aes_multiply_by_9[s] << 16) | (aes_multiply_by_13[s] << 8) | aes_multiply_by_11[s];
+
+        out[value] = shift ? (column >> (shift * 8)) | (column << (32 - shift * 8)) : column;
+    }
+
+    return out;
+}
+
+constexpr std::array<uint32_t, 256> aes_td0 = aes_generate_decryption_table(0);
+constexpr std::array<uint32_t, 256> aes_td1 = aes_generate_decryption_table(1);
+constexpr std::array<uint32_t, 256> aes_td2 = aes_generate_decryption_table(2);
+constexpr std::array<uint32_t, 256> aes_td3 = aes_generate_decryption_table(3);
+
+static_assert(aes_td0[0x00] == 0x51f4a750 && aes_td0[0xff] == 0xd0b85742 && aes_td3[0xff] == 0xb85742d0, "The decryption T-tables do not match the published values");
+
+/**
+ * @tparam rounds - number of rounds (10 for 128-bit)
+ * @param state - four column words of a single encrypted block, replaced with the decrypted block
+ * @param decryption_round_keys - the round keys for the equivalent inverse cipher from aes_key
+ *
+ * The equivalent inverse cipher (FIPS-197 section 5.3.5) swaps inverse shift rows with inverse sub bytes and inverse mix columns with add round key,
+ * which works because inverse mix columns is linear and was already applied to the middle round keys. That puts the steps in the same order as encryption,
+ * so a round is the same four lookups per column. Inverse shift rows reads row r of output column c from column (c - r) % 4.
+ */
+template <uint8_t rounds>
+void aes_decrypt_block_ttable(uint32_t* state, const uint32_t* decryption_round_keys) {
+    uint32_t s0 = state[0] ^ decryption_round_keys[0];
+    uint32_t s1 = state[1] ^ decryption_round_keys[1];
+    uint32_t s2 = state[2] ^ decryption_round_keys[2];
+    uint32_t s3 = state[3] ^ decryption_round_keys[3];
+
+#pragma GCC unroll 16
+    for (uint8_t round = 1; round < rounds; round++) {
+        const uint32_t* round_key = decryption_round_keys + (round * 4);
+
+        uint32_t t0 = aes_td0[s0 >> 24] ^ aes_td1[(s3 >> 16) & 0xff] ^ aes_td2[(s2 >> 8) & 0xff] ^ aes_td3[s1 & 0xff] ^ round_key[0];
+        uint32_t t1 = aes_td0[s1 >> 24] ^ aes_td1[(s0 >> 16) & 0xff] ^ aes_td2[(s3 >> 8) & 0xff] ^ aes_td3[s2 & 0xff] ^ round_key[1];
+        uint32_t t2 = aes_td0[s2 >> 24] ^ aes_td1[(s1 >> 16) & 0xff] ^ aes_td2[(s0 >> 8) & 0xff] ^ aes_td3[s3 & 0xff] ^ round_key[2];
+        uint32_t t3 = aes_td0[s3 >> 24] ^ aes_td1[(s2 >> 16) & 0xff] ^ aes_td2[(s1 >> 8) & 0xff] ^ aes_td3[s0 & 0xff] ^ round_key[3];
+
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    /// The last round has no inverse mix columns so the inverse s-box is used directly.
+    const uint32_t* round_key = decryption_round_keys + (rounds * 4);
+
+    state[0] = (((uint32_t) inverse_sbox[s0 >> 24] << 24) | (inverse_sbox[(s3 >> 16) & 0xff] << 16) | (inverse_sbox[(s2 >> 8) & 0xff] << 8) | inverse_sbox[s1 & 0xff]) ^ round_key[0];
+    state[1] = (((uint32_t) inverse_sbox[s1 >> 24] << 24) | (inverse_sbox[(s0 >> 16) & 0xff] << 16) | (inverse_sbox[(s3 >> 8) & 0xff] << 8) | inverse_sbox[s2 & 0xff]) ^ round_key[1];
+    state[2] = (((uint32_t) inverse_sbox[s2 >> 24] << 24) | (inverse_sbox[(s1 >> 16) & 0xff] << 16) | (inverse_sbox[(s0 >> 8) & 0xff] << 8) | inverse_sbox[s3 & 0xff]) ^ round_key[2];
+    state[3] = (((uint32_t) inverse_sbox[s3 >> 24] << 24) | (inverse_sbox[(s2 >> 16) & 0xff] << 16) | (inverse_sbox[(s1 >> 8) & 0xff] << 8) | inverse_sbox[s0 & 0xff]) ^ round_key[3];
+}
+
+/**
+ * @return true if the CPU has the AES instructions (and SSSE3 for the byte shuffles)
+ *
+ * This checks CPUID once and remembers the result.
+ */
+inline bool aes_ni_supported() {
+#ifdef AES_HAS_AES_NI
+    static const bool supported = [] {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+        return (ecx & bit_AES) && (ecx & bit_SSSE3);
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+#ifdef AES_HAS_AES_NI
+
+/**
+ * The state and round keys are stored as big endian words but the AES instructions want the bytes in order, so every word has its bytes reversed on the way in and out.
+ */
+inline AES_NI_TARGET __m128i aes_ni_load(const uint32_t* words) {
+    const __m128i byte_swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) words), byte_swap);
+}
+
+inline AES_NI_TARGET void aes_ni_store(uint32_t* words, __m128i value) {
+    const __m128i byte_swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    _mm_storeu_si128((__m128i*) words, _mm_shuffle_epi8(value, byte_swap));
+}
+
+/**
+ * @param key - the previous round key
+ * @param assist - the result of aeskeygenassist on the previous round key
+ * @return the next round key
+ *
+ * aeskeygenassist does the SubWord(RotWord(w)) ^ rcon part of the key expansion, the shifts and xors chain the words of the previous round key together.
+ */
+inline AES_NI_TARGET __m128i aes_ni_key_expansion_step(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, _MM_SHUFFLE(3, 3, 3, 3));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+/**
+ * The second half of every step of the 256-bit key expansion only does SubWord (no RotWord or round constant), which aeskeygenassist leaves in its third word.
+ */
+inline AES_NI_TARGET __m128i aes_ni_key_expansion_step_sub_word(__m128i key, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, _MM_SHUFFLE(2, 2, 2, 2));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+/**
+ * @tparam key_bytes - 16 or 32, 192-bit keys don't line up with 128-bit registers so they use aes_get_round_keys
+ * @param key - the key words
+ * @param out - receives the same round keys as aes_get_round_keys
+ *
+ * The round constant has to be an immediate value for aeskeygenassist so every round is written out.
+ */
+template <size_t key_bytes>
+AES_NI_TARGET void aes_get_round_keys_aes_ni(const uint32_t* key, uint32_t* out) {
+    static_assert(key_bytes == 16 || key_bytes == 32, "Only 128 and 256-bit keys can be expanded with AES-NI");
+    const uint8_t rounds = aes_key_size<key_bytes>::rounds;
+
+    __m128i w[rounds + 1];
+
+    if constexpr (key_bytes == 32) {
+        w[0] = aes_ni_load(key);
+        w[1] = aes_ni_load(key + 4);
+        w[2] = aes_ni_key_expansion_step(w[0], _mm_aeskeygenassist_si128(w[1], 0x01));
+        w[3] = aes_ni_key_expansion_step_sub_word(w[1], _mm_aeskeygenassist_si128(w[2], 0x00));
+        w[4] = aes_ni_key_expansion_step(w[2], _mm_aeskeygenassist_si128(w[3], 0x02));
+        w[5] = aes_ni_key_expansion_step_sub_word(w[3], _mm_aeskeygenassist_si128(w[4], 0x00));
+        w[6] = aes_ni_key_expansion_step(w[4], _mm_aeskeygenassist_si128(w[5], 0x04));
+        w[7] = aes_ni_key_expansion_step_sub_word(w[5], _mm_aeskeygenassist_si128(w[6], 0x00));
+        w[8] = aes_ni_key_expansion_step(w[6], _mm_aeskeygenassist_si128(w[7], 0x08));
+        w[9] = aes_ni_key_expansion_step_sub_word(w[7], _mm_aeskeygenassist_si128(w[8], 0x00));
+        w[10] = aes_ni_key_expansion_step(w[8], _mm_aeskeygenassist_si128(w[9], 0x10));
+        w[11] = aes_ni_key_expansion_step_sub_word(w[9], _mm_aeskeygenassist_si128(w[10], 0x00));
+        w[12] = aes_ni_key_expansion_step(w[10], _mm_aeskeygenassist_si128(w[11], 0x20));
+        w[13] = aes_ni_key_expansion_step_sub_word(w[11], _mm_aeskeygenassist_si128(w[12], 0x00));
+        w[14] = aes_ni_key_expansion_step(w[12], _mm_aeskeygenassist_si128(w[13], 0x40));
+    }
+    else {
+        w[0] = aes_ni_load(key);
+        w[1] = aes_ni_key_expansion_step(w[0], _mm_aeskeygenassist_si128(w[0], 0x01));
+        w[2] = aes_ni_key_expansion_step(w[1], _mm_aeskeygenassist_si128(w[1], 0x02));
+        w[3] = aes_ni_key_expansion_step(w[2], _mm_aeskeygenassist_si128(w[2], 0x04));
+        w[4] = aes_ni_key_expansion_step(w[3], _mm_aeskeygenassist_si128(w[3], 0x08));
+        w[5] = aes_ni_key_expansion_step(w[4], _mm_aeskeygenassist_si128(w[4], 0x10));
+        w[6] = aes_ni_key_expansion_step(w[5], _mm_aeskeygenassist_si128(w[5], 0x20));
+        w[7] = aes_ni_key_expansion_step(w[6], _mm_aeskeygenassist_si128(w[6], 0x40));
+        w[8] = aes_ni_key_expansion_step(w[7], _mm_aeskeygenassist_si128(w[7], 0x80));
+        w[9] = aes_ni_key_expansion_step(w[8], _mm_aeskeygenassist_si128(w[8], 0x1b));
+        w[10] = aes_ni_key_expansion_step(w[9], _mm_aeskeygenassist_si128(w[9], 0x36));
+    }
+
+    for (int round = 0; round <= rounds; round++) {
+        aes_ni_store(out + (round * 4), w[round]);
+    }
+}
+
+/**
+ * @param round_keys - the output of aes_get_round_keys
+ * @param rounds - number of rounds (10 for 128-bit)
+ * @param out - receives the round keys for aes_decrypt_block_aes_ni
+ *
+ * aesdec does inverse mix columns before adding the round key, so the middle round keys need inverse mix columns (aesimc) applied to them to cancel it out.
+ * The keys are also reversed so the decryption can walk forward through them.
+ */
+inline AES_NI_TARGET void aes_get_decryption_round_keys_aes_ni(const uint32_t* round_keys, uint8_t rounds, uint32_t* out) {
+    aes_ni_store(out, aes_ni_load(round_keys + (rounds * 4)));
+    for (uint8_t round = 1; round < rounds; round++) {
+        aes_ni_store(out + (round * 4), _mm_aesimc_si128(aes_ni_load(round_keys + ((rounds - round) * 4))));
+    }
+    aes_ni_store(out + (rounds * 4), aes_ni_load(round_keys));
+}
+
+/**
+ * @tparam rounds - number of rounds (10 for 128-bit)
+ * @param state - four column words of a single block, replaced with the encrypted block
+ * @param round_keys - the output of aes_get_round_keys or aes_get_round_keys_aes_ni
+ */
+template <uint8_t rounds>
+AES_NI_TARGET void aes_encrypt_block_aes_ni(uint32_t* state, const uint32_t* round_keys) {
+    __m128i block = _mm_xor_si128(aes_ni_load(state), aes_ni_load(round_keys));
+
+#pragma GCC unroll 16
+    for (uint8_t round = 1; round < rounds; round++) {
+        block = _mm_aesenc_si128(block, aes_ni_load(round_keys + (round * 4)));
+    }
+
+    aes_ni_store(state, _mm_aesenclast_si128(block, aes_ni_load(round_keys + (rounds * 4))));
+}
+
+/**
+ * @tparam rounds - number of rounds (10 for 128-bit)
+ * @param state - four column words of a single encrypted block, replaced with the decrypted block
+ * @param decryption_round_keys - the output of aes_get_decryption_round_keys_aes_ni
+ */
+template <uint8_t rounds>
+AES_NI_TARGET void aes_decrypt_block_aes_ni(uint32_t* state, const uint32_t* decryption_round_keys) {
+    __m128i block = _mm_xor_si128(aes_ni_load(state), aes_ni_load(decryption_round_keys));
+
+#pragma GCC unroll 16
+    for (uint8_t round = 1; round < rounds; round++) {
+        block = _mm_aesdec_si128(block, aes_ni_load(decryption_round_keys + (round * 4)));
+    }
+
+    aes_ni_store(state, _mm_aesdeclast_si128(block, aes_ni_load(decryption_round_keys + (rounds * 4))));
+}
+
+/// How many blocks the multi-block AES-NI functions work on at once. An aesenc takes a few cycles to finish but a new one can start every cycle,
+/// so running independent blocks side by side keeps the AES unit busy instead of waiting on one block.
+const size_t AES_NI_PARALLEL_BLOCKS = 8;
+
+/**
+ * @tparam rounds - number of rounds (10 for 128-bit)
+ * @param blocks - <b>block_count</b> blocks, each as four column words, replaced with the encrypted blocks
+ * @param block_count - the number of blocks
+ * @param round_keys - the output of aes_get_round_keys or aes_get_round_keys_aes_ni
+ */
+template <uint8_t rounds>
+AES_NI_TARGET void aes_encrypt_blocks_aes_ni(uint32_t* blocks, size_t block_count, const uint32_t* round_keys) {
+    __m128i keys[rounds + 1];
+    for (uint8_t round = 0; round <= rounds; round++) {
+        keys[round] = aes_ni_load(round_keys + (round * 4));
+    }
+
+    size_t block = 0;
+    for (; block + AES_NI_PARALLEL_BLOCKS <= block_count; block += AES_NI_PARALLEL_BLOCKS) {
+        __m128i state[AES_NI_PARALLEL_BLOCKS];
+
+#pragma GCC unroll 8
+        for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+            state[index] = _mm_xor_si128(aes_ni_load(blocks + ((block + index) * 4)), keys[0]);
+        }
+
+        for (uint8_t round = 1; round < rounds; round++) {
+#pragma GCC unroll 8
+            for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+                state[index] = _mm_aesenc_si128(state[index], keys[round]);
+            }
+        }
+
+#pragma GCC unroll 8
+        for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+            aes_ni_store(blocks + ((block + index) * 4), _mm_aesenclast_si128(state[index], keys[rounds]));
+        }
+    }
+
+    for (; block < block_count; block++) {
+        aes_encrypt_block_aes_ni<rounds>(blocks + (block * 4), round_keys);
+    }
+}
+
+/**
+ * @tparam rounds - number of rounds (10 for 128-bit)
+ * @param blocks - <b>block_count</b> encrypted blocks, each as four column words, replaced with the decrypted blocks
+ * @param block_count - the number of blocks
+ * @param decryption_round_keys - the output of aes_get_decryption_round_keys_aes_ni
+ */
+template <uint8_t rounds>
+AES_NI_TARGET void aes_decrypt_blocks_aes_ni(uint32_t* blocks, size_t block_count, const uint32_t* decryption_round_keys) {
+    __m128i keys[rounds + 1];
+    for (uint8_t round = 0; round <= rounds; round++) {
+        keys[round] = aes_ni_load(decryption_round_keys + (round * 4));
+    }
+
+    size_t block = 0;
+    for (; block + AES_NI_PARALLEL_BLOCKS <= block_count; block += AES_NI_PARALLEL_BLOCKS) {
+        __m128i state[AES_NI_PARALLEL_BLOCKS];
+
+#pragma GCC unroll 8
+        for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+            state[index] = _mm_xor_si128(aes_ni_load(blocks + ((block + index) * 4)), keys[0]);
+        }
+
+        for (uint8_t round = 1; round < rounds; round++) {
+#pragma GCC unroll 8
+            for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+                state[index] = _mm_aesdec_si128(state[index], keys[round]);
+            }
+        }
+
+#pragma GCC unroll 8
+        for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+            aes_ni_store(blocks + ((block + index) * 4), _mm_aesdeclast_si128(state[index], keys[rounds]));
+        }
+    }
+
+    for (; block < block_count; block++) {
+        aes_decrypt_block_aes_ni<rounds>(blocks + (block * 4), decryption_round_keys);
+    }
+}
+
+#endif
+
+/// Source: BearSSL's constant-time aes_ct64 (https://bearssl.org/constanttime.html) and the Boyar-Peralta S-Box circuit
+///
+/// The bitsliced implementation never indexes memory with secret data. Four blocks are transposed into eight 64-bit words where word i holds bit i of every byte,
+/// so sub bytes becomes a circuit of and/xor/not on whole words and shift rows / mix columns become shifts and rotations inside each word.
+/// Using vector types with two or four 64-bit lanes processes 8 or 16 blocks with the exact same code.
+typedef uint64_t aes_bitslice_u64x2 __attribute__((vector_size(16)));
+typedef uint64_t aes_bitslice_u64x4 __attribute__((vector_size(32)));
+
+#define AES_ALWAYS_INLINE inline __attribute__((always_inline))
+
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_swap(W& a, W& b, uint64_t mask_low, uint64_t mask_high, int distance) {
+    W x = a, y = b;
+    a = (x & mask_low) | ((y & mask_low) << distance);
+    b = ((x & mask_high) >> distance) | (y & mask_high);
+}
+
+/**
+ * @param q - the eight words of the state, replaced with the same bits moved into (or out of) the bitsliced layout
+ *
+ * This is its own inverse, so it is used both to enter and leave the bitsliced layout.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_ortho(W* q) {
+    aes_bitslice_swap(q[0], q[1], 0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1);
+    aes_bitslice_swap(q[2], q[3], 0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1);
+    aes_bitslice_swap(q[4], q[5], 0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1);
+    aes_bitslice_swap(q[6], q[7], 0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1);
+
+    aes_bitslice_swap(q[0], q[2], 0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2);
+    aes_bitslice_swap(q[1], q[3], 0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2);
+    aes_bitslice_swap(q[4], q[6], 0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2);
+    aes_bitslice_swap(q[5], q[7], 0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2);
+
+    aes_bitslice_swap(q[0], q[4], 0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4);
+    aes_bitslice_swap(q[1], q[5], 0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4);
+    aes_bitslice_swap(q[2], q[6], 0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4);
+    aes_bitslice_swap(q[3], q[7], 0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4);
+}
+
+/**
+ * @param q0 - receives the even bytes of the block
+ * @param q1 - receives the odd bytes of the block
+ * @param w - a block as four little endian words (one block per lane)
+ *
+ * Spreads the bytes of a block out so that four blocks can be merged into eight words before aes_bitslice_ortho.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_interleave_in(W* q0, W* q1, const W* w) {
+    W x[4];
+
+    for (int index = 0; index < 4; index++) {
+        x[index] = w[index];
+        x[index] |= x[index] << 16;
+        x[index] &= 0x0000FFFF0000FFFF;
+        x[index] |= x[index] << 8;
+        x[index] &= 0x00FF00FF00FF00FF;
+    }
+
+    *q0 = x[0] | (x[2] << 8);
+    *q1 = x[1] | (x[3] << 8);
+}
+
+/**
+ * The inverse of aes_bitslice_interleave_in.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_interleave_out(W* w, const W& q0, const W& q1) {
+    W x[] = {q0 & 0x00FF00FF00FF00FF, q1 & 0x00FF00FF00FF00FF,
+             (q0 >> 8) & 0x00FF00FF00FF00FF, (q1 >> 8) & 0x00FF00FF00FF00FF};
+
+    for (int index = 0; index < 4; index++) {
+        x[index] |= x[index] >> 8;
+        x[index] &= 0x0000FFFF0000FFFF;
+        w[index] = (x[index] | (x[index] >> 16)) & 0xFFFFFFFF;
+    }
+}
+
+/**
+ * @param q - the bitsliced state, where q[i] holds bit i of every byte
+ *
+ * The S-Box as the 113 gate circuit found by Boyar and Peralta. It computes the field inverse and the affine transformation together.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_sbox(W* q) {
+    W x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    /// Top linear transformation
+    W y14 = x3 ^ x5;
+    W y13 = x0 ^ x6;
+    W y9 = x0 ^ x3;
+    W y8 = x0 ^ x5;
+    W t0 = x1 ^ x2;
+    W y1 = t0 ^ x7;
+    W y4 = y1 ^ x3;
+    W y12 = y13 ^ y14;
+    W y2 = y1 ^ x0;
+    W y5 = y1 ^ x6;
+    W y3 = y5 ^ y8;
+    W t1 = x4 ^ y12;
+    W y15 = t1 ^ x5;
+    W y20 = t1 ^ x1;
+    W y6 = y15 ^ x7;
+    W y10 = y15 ^ t0;
+    W y11 = y20 ^ y9;
+    W y7 = x7 ^ y11;
+    W y17 = y10 ^ y11;
+    W y19 = y10 ^ y8;
+    W y16 = t0 ^ y11;
+    W y21 = y13 ^ y16;
+    W y18 = x0 ^ y16;
+
+    /// Non-linear section
+    W t2 = y12 & y15;
+    W t3 = y3 & y6;
+    W t4 = t3 ^ t2;
+    W t5 = y4 & x7;
+    W t6 = t5 ^ t2;
+    W t7 = y13 & y16;
+    W t8 = y5 & y1;
+    W t9 = t8 ^ t7;
+    W t10 = y2 & y7;
+    W t11 = t10 ^ t7;
+    W t12 = y9 & y11;
+    W t13 = y14 & y17;
+    W t14 = t13 ^ t12;
+    W t15 = y8 & y10;
+    W t16 = t15 ^ t12;
+    W t17 = t4 ^ t14;
+    W t18 = t6 ^ t16;
+    W t19 = t9 ^ t14;
+    W t20 = t11 ^ t16;
+    W t21 = t17 ^ y20;
+    W t22 = t18 ^ y19;
+    W t23 = t19 ^ y21;
+    W t24 = t20 ^ y18;
+
+    W t25 = t21 ^ t22;
+    W t26 = t21 & t23;
+    W t27 = t24 ^ t26;
+    W t28 = t25 & t27;
+    W t29 = t28 ^ t22;
+    W t30 = t23 ^ t24;
+    W t31 = t22 ^ t26;
+    W t32 = t31 & t30;
+    W t33 = t32 ^ t24;
+    W t34 = t23 ^ t33;
+    W t35 = t27 ^ t33;
+    W t36 = t24 & t35;
+    W t37 = t36 ^ t34;
+    W t38 = t27 ^ t36;
+    W t39 = t29 & t38;
+    W t40 = t25 ^ t39;
+
+    W t41 = t40 ^ t37;
+    W t42 = t29 ^ t33;
+    W t43 = t29 ^ t40;
+    W t44 = t33 ^ t37;
+    W t45 = t42 ^ t41;
+    W z0 = t44 & y15;
+    W z1 = t37 & y6;
+    W z2 = t33 & x7;
+    W z3 = t43 & y16;
+    W z4 = t40 & y1;
+    W z5 = t29 & y7;
+    W z6 = t42 & y11;
+    W z7 = t45 & y17;
+    W z8 = t41 & y10;
+    W z9 = t44 & y12;
+    W z10 = t37 & y3;
+    W z11 = t33 & y4;
+    W z12 = t43 & y13;
+    W z13 = t40 & y5;
+    W z14 = t29 & y2;
+    W z15 = t42 & y9;
+    W z16 = t45 & y14;
+    W z17 = t41 & y8;
+
+    /// Bottom linear transformation
+    W t46 = z15 ^ z16;
+    W t47 = z10 ^ z11;
+    W t48 = z5 ^ z13;
+    W t49 = z9 ^ z10;
+    W t50 = z2 ^ z12;
+    W t51 = z2 ^ z5;
+    W t52 = z7 ^ z8;
+    W t53 = z0 ^ z3;
+    W t54 = z6 ^ z7;
+    W t55 = z16 ^ z17;
+    W t56 = z12 ^ t48;
+    W t57 = t50 ^ t53;
+    W t58 = z4 ^ t46;
+    W t59 = z3 ^ t54;
+    W t60 = t46 ^ t57;
+    W t61 = z14 ^ t57;
+    W t62 = t52 ^ t58;
+    W t63 = t49 ^ t58;
+    W t64 = z4 ^ t59;
+    W t65 = t61 ^ t62;
+    W t66 = z1 ^ t63;
+    W s0 = t59 ^ t63;
+    W s6 = t56 ^ ~t62;
+    W s7 = t48 ^ ~t60;
+    W t67 = t64 ^ t65;
+    W s3 = t53 ^ t66;
+    W s4 = t51 ^ t66;
+    W s5 = t47 ^ t65;
+    W s1 = t64 ^ ~s3;
+    W s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/**
+ * @param q - the bitsliced state
+ *
+ * The inverse affine transformation (without the 0x63) applied to each byte. Doing it on both sides of aes_bitslice_sbox gives the inverse S-Box
+ * because the field inverse is its own inverse.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_inverse_affine(W* q) {
+    W q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3], q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_inverse_sbox(W* q) {
+    aes_bitslice_inverse_affine(q);
+    aes_bitslice_sbox(q);
+    aes_bitslice_inverse_affine(q);
+}
+
+/**
+ * Each 64-bit word holds four rows of 16 bits (four blocks of four bytes), so a row shift is a rotation of the 4-bit groups inside its 16 bits.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_shift_rows(W* q) {
+    for (int index = 0; index < 8; index++) {
+        W x = q[index];
+        q[index] = (x & (uint64_t) 0x000000000000FFFF)
+                   | ((x & (uint64_t) 0x00000000FFF00000) >> 4)
+                   | ((x & (uint64_t) 0x00000000000F0000) << 12)
+                   | ((x & (uint64_t) 0x0000FF0000000000) >> 8)
+                   | ((x & (uint64_t) 0x000000FF00000000) << 8)
+                   | ((x & (uint64_t) 0xF000000000000000) >> 12)
+                   | ((x & (uint64_t) 0x0FFF000000000000) << 4);
+    }
+}
+
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_inverse_shift_rows(W* q) {
+    for (int index = 0; index < 8; index++) {
+        W x = q[index];
+        q[index] = (x & (uint64_t) 0x000000000000FFFF)
+                   | ((x & (uint64_t) 0x000000000FFF0000) << 4)
+                   | ((x & (uint64_t) 0x00000000F0000000) >> 12)
+                   | ((x & (uint64_t) 0x000000FF00000000) << 8)
+                   | ((x & (uint64_t) 0x0000FF0000000000) >> 8)
+                   | ((x & (uint64_t) 0x000F000000000000) << 12)
+                   | ((x & (uint64_t) 0xFFF0000000000000) >> 4);
+    }
+}
+
+/**
+ * Multiplying by 2 in the bitsliced layout moves every bit plane up by one and folds bit 7 back in at bits 0, 1, 3 and 4 (0x1b).
+ * Rotating by 16 bits moves to the next row of the column and rotating by 32 bits moves two rows, which is all mix columns needs.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_mix_columns(W* q) {
+    W r[8];
+    for (int index = 0; index < 8; index++) {
+        r[index] = (q[index] >> 16) | (q[index] << 48);
+    }
+
+    W q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+    W s[8];
+    for (int index = 0; index < 8; index++) {
+        s[index] = q[index] ^ r[index];
+        s[index] = (s[index] << 32) | (s[index] >> 32);
+    }
+
+    q[0] = q7 ^ r[7] ^ r[0] ^ s[0];
+    q[1] = q0 ^ r[0] ^ q7 ^ r[7] ^ r[1] ^ s[1];
+    q[2] = q1 ^ r[1] ^ r[2] ^ s[2];
+    q[3] = q2 ^ r[2] ^ q7 ^ r[7] ^ r[3] ^ s[3];
+    q[4] = q3 ^ r[3] ^ q7 ^ r[7] ^ r[4] ^ s[4];
+    q[5] = q4 ^ r[4] ^ r[5] ^ s[5];
+    q[6] = q5 ^ r[5] ^ r[6] ^ s[6];
+    q[7] = q6 ^ r[6] ^ r[7] ^ s[7];
+}
+
+/**
+ * The inverse mix column matrix is the mix column matrix multiplied by {5, 0, 4, 0} (as a circulant matrix), so this multiplies by that and then mixes.
+ */
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_inverse_mix_columns(W* q) {
+    W x[8];
+    for (int index = 0; index < 8; index++) {
+        x[index] = (q[index] << 32) | (q[index] >> 32);
+    }
+
+    /// y = 4 * (q ^ rotate(q, 2 rows)), then q ^= y
+    W t[8];
+    for (int index = 0; index < 8; index++) {
+        t[index] = q[index] ^ x[index];
+    }
+    W y[8] = {t[6], t[6] ^ t[7], t[0] ^ t[7], t[1] ^ t[6], t[2] ^ t[6] ^ t[7], t[3] ^ t[7], t[4], t[5]};
+    for (int index = 0; index < 8; index++) {
+        q[index] ^= y[index];
+    }
+
+    aes_bitslice_mix_columns(q);
+}
+
+template <typename W>
+AES_ALWAYS_INLINE void aes_bitslice_add_round_key(W* q, const W* round_key) {
+    for (int index = 0; index < 8; index++) {
+        q[index] ^= round_key[index];
+    }
+}
+
+/**
+ * @param blocks - 4 * (lanes in W) blocks, each as four big endian column words like the rest of the file, replaced with the result
+ * @param bitsliced_round_keys - the output of aes_get_bitsliced_round_keys
+ * @param decrypt - run the inverse cipher instead
+ */
+template <typename W, uint8_t rounds>
+AES_ALWAYS_INLINE void aes_bitslice_process(uint32_t* blocks, const uint64_t* bitsliced_round_keys, bool decrypt) {
+    const int lanes = sizeof(W) / sizeof(uint64_t);
+
+    /// Every lane is a separate group of four blocks, so lane l of q[b] and q[b + 4] come from block 4 * l + b.
+    W q[8];
+    for (int block = 0; block < 4; block++) {
+        uint64_t words[4][lanes];
+        for (int lane = 0; lane < lanes; lane++) {
+            for (int index = 0; index < 4; index++) {
+                words[index][lane] = __builtin_bswap32(blocks[(lane * 4 + block) * 4 + index]);
+            }
+        }
+
+        W w[4];
+        std::memcpy(w, words, sizeof(w));
+        aes_bitslice_interleave_in(&q[block], &q[block + 4], w);
+    }
+    aes_bitslice_ortho(q);
+
+    W round_keys[8 * (rounds + 1)];
+    W zero = {};
+    for (int index = 0; index < 8 * (rounds + 1); index++) {
+        round_keys[index] = zero ^ bitsliced_round_keys[index];
+    }
+
+    if (!decrypt) {
+        aes_bitslice_add_round_key(q, round_keys);
+        for (uint8_t round = 1; round < rounds; round++) {
+            aes_bitslice_sbox(q);
+            aes_bitslice_shift_rows(q);
+            aes_bitslice_mix_columns(q);
+            aes_bitslice_add_round_key(q, round_keys + (round * 8));
+        }
+        aes_bitslice_sbox(q);
+        aes_bitslice_shift_rows(q);
+        aes_bitslice_add_round_key(q, round_keys + (rounds * 8));
+    }
+    else {
+        aes_bitslice_add_round_key(q, round_keys + (rounds * 8));
+        for (uint8_t round = rounds - 1; round > 0; round--) {
+            aes_bitslice_inverse_shift_rows(q);
+            aes_bitslice_inverse_sbox(q);
+            aes_bitslice_add_round_key(q, round_keys + (round * 8));
+            aes_bitslice_inverse_mix_columns(q);
+        }
+        aes_bitslice_inverse_shift_rows(q);
+        aes_bitslice_inverse_sbox(q);
+        aes_bitslice_add_round_key(q, round_keys);
+    }
+
+    aes_bitslice_ortho(q);
+    for (int block = 0; block < 4; block++) {
+        W w[4];
+        aes_bitslice_interleave_out(w, q[block], q[block + 4]);
+
+        uint64_t words[4][lanes];
+        std::memcpy(words, w, sizeof(w));
+        for (int lane = 0; lane < lanes; lane++) {
+            for (int index = 0; index < 4; index++) {
+                blocks[(lane * 4 + block) * 4 + index] = __builtin_bswap32((uint32_t) words[index][lane]);
+            }
+        }
+    }
+}
+
+template <uint8_t rounds>
+void aes_bitslice_process_8(uint32_t* blocks, const uint64_t* bitsliced_round_keys, bool decrypt) {
+    aes_bitslice_process<aes_bitslice_u64x2, rounds>(blocks, bitsliced_round_keys, decrypt);
+}
+
+template <uint8_t rounds>
+AES_AVX2_TARGET void aes_bitslice_process_16(uint32_t* blocks, const uint64_t* bitsliced_round_keys, bool decrypt) {
+    aes_bitslice_process<aes_bitslice_u64x4, rounds>(blocks, bitsliced_round_keys, decrypt);
+}
+
+/**
+ * @param round_keys - the output of aes_get_round_keys
+ * @param rounds - number of rounds (10 for 128-bit)
+ * @param out - receives eight words per round key: the round key copied into four blocks and transposed the same way as the state
+ */
+inline void aes_get_bitsliced_round_keys(const uint32_t* round_keys, uint8_t rounds, uint64_t* out) {
+    for (uint8_t round = 0; round <= rounds; round++) {
+        uint64_t w[4];
+        for (int index = 0; index < 4; index++) {
+            w[index] = __builtin_bswap32(round_keys[round * 4 + index]);
+        }
+
+        uint64_t* q = out + (round * 8);
+        for (int block = 0; block < 4; block++) {
+            aes_bitslice_interleave_in(&q[block], &q[block + 4], w);
+        }
+        aes_bitslice_ortho(q);
+    }
+}
+
+/**
+ * aes_sub_word32 without the table, for the bitsliced engine's key schedule. The word goes in as the first 32 bits of an otherwise empty state and comes back out of the same place,
+ * since every byte goes through the circuit on its own. Like BearSSL's ct64 key schedule this costs a whole S-Box pass per word, which only matters for key expansion.
+ */
+inline uint32_t aes_bitslice_sub_word32(uint32_t word) {
+    uint64_t q[8] = {word, 0, 0, 0, 0, 0, 0, 0};
+    aes_bitslice_ortho(q);
+    aes_bitslice_sbox(q);
+    aes_bitslice_ortho(q);
+    return (uint32_t) q[0];
+}
+
+/**
+ * @param blocks - <b>block_count</b> blocks, each as four big endian column words, replaced with the result
+ * @param block_count - how many blocks there are, this doesn't need to be a multiple of anything
+ * @param bitsliced_round_keys - the output of aes_get_bitsliced_round_keys
+ * @param decrypt - run the inverse cipher instead
+ *
+ * Runs in groups of 16 blocks with AVX2 or 8 blocks otherwise. The last group is padded out with zero blocks which are thrown away.
+ */
+template <uint8_t rounds>
+void aes_process_blocks_bitslice(uint32_t* blocks, size_t block_count, const uint64_t* bitsliced_round_keys, bool decrypt) {
+    const bool wide = aes_avx2_supported();
+    const size_t group = wide ? 16 : 8;
+
+    while (block_count) {
+        uint32_t buffer[16 * 4] = {};
+        size_t count = std::min(block_count, group);
+        std::memcpy(buffer, blocks, count * 16);
+
+        if (wide) {
+            aes_bitslice_process_16<rounds>(buffer, bitsliced_round_keys, decrypt);
+        }
+        else {
+            aes_bitslice_process_8<rounds>(buffer, bitsliced_round_keys, decrypt);
+        }
+
+        std::memcpy(blocks, buffer, count * 16);
+        blocks += count * 4;
+        block_count -= count;
+    }
+}
+
+/**
+ * Which implementation of the block function aes_encrypt and aes_decrypt use.
+ * The reference implementation follows the steps one at a time and reports the state after each of them to an observer, the T-table implementation is the fast portable one,
+ * the AES-NI implementation uses the AES instructions on x86 CPUs that have them, and the bitsliced implementation runs in constant time on 8 or 16 blocks at once.
+ * T-table decryption uses the equivalent inverse cipher so it runs at the same speed as encryption.
+ */
+enum aes_engine {
+    AES_ENGINE_REFERENCE,
+    AES_ENGINE_T_TABLE,
+    AES_ENGINE_AES_NI,
+    AES_ENGINE_BITSLICE,
+};
+
+/**
+ * @return the engine that is usually fastest on this CPU, going by CPUID alone. aes_select_engine measures instead of guessing.
+ */
+inline aes_engine aes_detect_engine() {
+    return aes_ni_supported() ? AES_ENGINE_AES_NI : AES_ENGINE_T_TABLE;
+}
+
+/**
+ * Exits if the engine can't be run on this CPU, in the same way an invalid key does.
+ */
+inline void aes_verify_engine(aes_engine engine) {
+    if (engine == AES_ENGINE_AES_NI && !aes_ni_supported()) {
+        std::cerr << "AES ENGINE ERROR: AES-NI is not supported on this CPU";
+        exit(6);
+    }
+}
+
+
+/**
+ * @return whether the two byte ranges are equal, taking the same time wherever they differ
+ */
+inline bool aes_constant_time_equal(const uint8_t* a, const uint8_t* b, size_t length) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++) {
+        difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+}
+
+/**
+ * Overwrites key material with zeros. Plain stores to memory that is about to be freed can be removed by the compiler, so these go through a volatile pointer.
+ */
+inline void aes_secure_zero(void* data, size_t length) {
+    volatile uint8_t* bytes = (volatile uint8_t*) data;
+    for (size_t i = 0; i < length; i++) {
+        bytes[i] = 0;
+    }
+}
+
+/**
+ * Instrumentation for seeing where the time goes without a profiler. Builds with AES_INSTRUMENT defined count the time spent in each stage of a block and keep a latency histogram
+ * of every call to the main functions. The counters belong to the thread doing the work, so the hot path never takes a lock or does an atomic read-modify-write,
+ * and aes_take_instrument_snapshot adds up every thread's counters. Without AES_INSTRUMENT the hooks are empty macros, so nothing is added to the functions at all.
+ *
+ * Time is counted in time stamp counter ticks on x86 and in steady_clock nanoseconds elsewhere. Only the reference engine does the stages one at a time,
+ * the other engines combine them, so their time only shows up in the key expansion stage and the call histograms.
+ */
+enum aes_instrument_stage {
+    AES_STAGE_KEY_EXPANSION,
+    AES_STAGE_SUB_BYTES,
+    AES_STAGE_SHIFT_ROWS,
+    AES_STAGE_MIX_COLUMNS,
+    AES_STAGE_ADD_ROUND_KEY,
+};
+
+const size_t AES_STAGE_COUNT = 5;
+const char* const aes_stage_names[AES_STAGE_COUNT] = {"key_expansion", "sub_bytes", "shift_rows", "mix_columns", "add_round_key"};
+
+/**
+ * The functions with a latency histogram. Calls nest, e.g. every aes_ecb_encrypt_process call also records the aes_encrypt_blocks calls it makes.
+ */
+enum aes_instrument_call {
+    AES_CALL_EXPAND_KEY,
+    AES_CALL_ENCRYPT_BLOCKS,
+    AES_CALL_DECRYPT_BLOCKS,
+    AES_CALL_ECB_ENCRYPT,
+    AES_CALL_ECB_DECRYPT,
+    AES_CALL_CBC_ENCRYPT,
+    AES_CALL_CBC_DECRYPT,
+    AES_CALL_CTR,
+    AES_CALL_GCM_ENCRYPT,
+    AES_CALL_GCM_DECRYPT,
+    /// One per sector.
+    AES_CALL_XTS_ENCRYPT,
+    AES_CALL_XTS_DECRYPT,
+    AES_CALL_CMAC,
+    /// One per aes_cmac_batch call, however many messages it has.
+    AES_CALL_CMAC_BATCH,
+};
+
+const size_t AES_CALL_COUNT = 14;
+const char* const aes_call_names[AES_CALL_COUNT] = {"expand_key", "encrypt_blocks", "decrypt_blocks", "ecb_encrypt", "ecb_decrypt", "cbc_encrypt", "cbc_decrypt", "ctr", "gcm_encrypt", "gcm_decrypt", "xts_encrypt", "xts_decrypt", "cmac", "cmac_batch"};
+
+/// Every power of two is split into 2^AES_HISTOGRAM_SUB_BUCKET_BITS buckets like an HDR histogram, so a value is never more than 1/16 (6.25%) away from its bucket's bounds.
+const int AES_HISTOGRAM_SUB_BUCKET_BITS = 4;
+const size_t AES_HISTOGRAM_SUB_BUCKETS = 1 << AES_HISTOGRAM_SUB_BUCKET_BITS;
+const size_t AES_HISTOGRAM_BUCKETS = (65 - AES_HISTOGRAM_SUB_BUCKET_BITS) * AES_HISTOGRAM_SUB_BUCKETS;
+
+/**
+ * @return the histogram bucket <b>value</b> goes in. Values below AES_HISTOGRAM_SUB_BUCKETS get a bucket each, above that the top bits pick the bucket.
+ */
+inline size_t aes_histogram_bucket(uint64_t value) {
+    if (value < AES_HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int shift = std::bit_width(value) - AES_HISTOGRAM_SUB_BUCKET_BITS - 1;
+    return (shift + 1) * AES_HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (AES_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * @return the smallest value in the bucket
+ */
+inline uint64_t aes_histogram_bucket_low(size_t bucket) {
+    if (bucket < AES_HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / AES_HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t) (AES_HISTOGRAM_SUB_BUCKETS + bucket % AES_HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+/**
+ * One function's calls, added up across threads.
+ */
+struct aes_histogram_snapshot {
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(AES_HISTOGRAM_BUCKETS);
+
+    /**
+     * @param quantile - e.g. 0.99
+     * @return the largest value that could be in the bucket the quantile falls in, or the max if that's smaller
+     */
+    uint64_t percentile(double quantile) const {
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(quantile * count));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < AES_HISTOGRAM_BUCKETS; bucket++) {
+            seen += buckets[bucket];
+            if (seen >= rank && seen) {
+                uint64_t high = bucket + 1 < AES_HISTOGRAM_BUCKETS ? aes_histogram_bucket_low(bucket + 1) - 1 : UINT64_MAX;
+                return std::min(high, max);
+            }
+        }
+        return max;
+    }
+};
+
+/**
+ * Everything the instrumentation counted, from aes_take_instrument_snapshot.
+ */
+struct aes_instrument_snapshot {
+    /// False in builds without AES_INSTRUMENT, then everything is zero.
+    bool enabled = false;
+    /// What the times are counted in: "cycles" (time stamp counter ticks) or "ns".
+    const char* unit = "cycles";
+    /// Total time and number of times each stage ran.
+    uint64_t stage_total[AES_STAGE_COUNT] = {};
+    uint64_t stage_count[AES_STAGE_COUNT] = {};
+    aes_histogram_snapshot calls[AES_CALL_COUNT];
+
+    void print_text(std::ostream& out) const {
+        if (!enabled) {
+            out << "instrumentation is off, build with -DAES_INSTRUMENT to turn it on\n";
+            return;
+        }
+
+        uint64_t stage_sum = 0;
+        for (size_t stage = 0; stage < AES_STAGE_COUNT; stage++) {
+            stage_sum += stage_total[stage];
+        }
+        out << "stage            count          " << unit << "        per stage    share\n";
+        for (size_t stage = 0; stage < AES_STAGE_COUNT; stage++) {
+            char line[128];
+            std::snprintf(line, sizeof(line), "%-14s %8llu %16llu %14.1f %7.1f%%\n", aes_stage_names[stage], (unsigned long long) stage_count[stage], (unsigned long long) stage_total[stage],
+                          stage_count[stage] ? (double) stage_total[stage] / stage_count[stage] : 0.0, stage_sum ? 100.0 * stage_total[stage] / stage_sum : 0.0);
+            out << line;
+        }
+
+        out << "\ncall (" << unit << ")      count         mean          p50          p90          p99        p99.9          max\n";
+        for (size_t call = 0; call < AES_CALL_COUNT; call++) {
+            const aes_histogram_snapshot& histogram = calls[call];
+            if (histogram.count == 0) {
+                continue;
+            }
+            char line[192];
+            std::snprintf(line, sizeof(line), "%-14s %8llu %12.1f %12llu %12llu %12llu %12llu %12llu\n", aes_call_names[call], (unsigned long long) histogram.count,
+                          (double) histogram.total / histogram.count, (unsigned long long) histogram.percentile(0.5), (unsigned long long) histogram.percentile(0.9),
+                          (unsigned long long) histogram.percentile(0.99), (unsigned long long) histogram.percentile(0.999), (unsigned long long) histogram.max);
+            out << line;
+        }
+    }
+
+    /**
+     * Prints the snapshot as one JSON object. Every call has its percentiles and its non-empty buckets as [smallest value, count] pairs.
+     */
+    void print_json(std::ostream& out) const {
+        out << "{\"enabled\": " << (enabled ? "true" : "false") << ", \"unit\": \"" << unit << "\", \"stages\": {";
+        for (size_t stage = 0; stage < AES_STAGE_COUNT; stage++) {
+            out << (stage ? ", " : "") << '"' << aes_stage_names[stage] << "\": {\"count\": " << stage_count[stage] << ", \"total\": " << stage_total[stage] << '}';
+        }
+        out << "}, \"calls\": {";
+        bool first = true;
+        for (size_t call = 0; call < AES_CALL_COUNT; call++) {
+            const aes_histogram_snapshot& histogram = calls[call];
+            if (histogram.count == 0) {
+                continue;
+            }
+            out << (first ? "" : ", ") << '"' << aes_call_names[call] << "\": {\"count\": " << histogram.count << ", \"total\": " << histogram.total
+                << ", \"p50\": " << histogram.percentile(0.5) << ", \"p90\": " << histogram.percentile(0.9) << ", \"p99\": " << histogram.percentile(0.99)
+                << ", \"p999\": " << histogram.percentile(0.999) << ", \"max\": " << histogram.max << ", \"buckets\": [";
+            bool first_bucket = true;
+            for (size_t bucket = 0; bucket < AES_HISTOGRAM_BUCKETS; bucket++) {
+                if (histogram.buckets[bucket]) {
+                    out << (first_bucket ? "" : ", ") << '[' << aes_histogram_bucket_low(bucket) << ", " << histogram.buckets[bucket] << ']';
+                    first_bucket = false;
+                }
+            }
+            out << "]}";
+            first = false;
+        }
+        out << "}}\n";
+    }
+};
+
+#ifdef AES_INSTRUMENT
+
+/**
+ * One thread's counters. Only the thread that owns them writes to them, with plain loads and stores, and they are atomic only so snapshots can read them at the same time.
+ */
+struct aes_instrument_counters {
+    std::atomic<uint64_t> stage_total[AES_STAGE_COUNT];
+    std::atomic<uint64_t> stage_count[AES_STAGE_COUNT];
+    struct {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[AES_HISTOGRAM_BUCKETS];
+    } calls[AES_CALL_COUNT];
+};
+
+/**
+ * Every thread's counters. They are kept after their thread exits so nothing it counted is lost.
+ */
+struct aes_instrument_threads {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<aes_instrument_counters>> counters;
+};
+
+inline aes_instrument_threads& aes_instrument_all_threads() {
+    static aes_instrument_threads threads;
+    return threads;
+}
+
+/**
+ * @return the calling thread's counters, registered the first time the thread records something
+ */
+inline aes_instrument_counters& aes_instrument_local() {
+    thread_local std::shared_ptr<aes_instrument_counters> counters = [] {
+        std::shared_ptr<aes_instrument_counters> made = std::make_shared<aes_instrument_counters>();
+        aes_instrument_threads& threads = aes_instrument_all_threads();
+        std::lock_guard<std::mutex> lock(threads.mutex);
+        threads.counters.push_back(made);
+        return made;
+    }();
+    return *counters;
+}
+
+inline uint64_t aes_instrument_ticks() {
+#ifdef AES_HAS_AES_NI
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/// Adds to a counter only this thread writes, without the locked instruction a fetch_add would be.
+inline void aes_instrument_add(std::atomic<uint64_t>& counter, uint64_t amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+inline void aes_instrument_record_stage(aes_instrument_stage stage, uint64_t ticks) {
+    aes_instrument_counters& counters = aes_instrument_local();
+    aes_instrument_add(counters.stage_total[stage], ticks);
+    aes_instrument_add(counters.stage_count[stage], 1);
+}
+
+inline void aes_instrument_record_call(aes_instrument_call call, uint64_t ticks) {
+    aes_instrument_counters& counters = aes_instrument_local();
+    auto& histogram = counters.calls[call];
+    aes_instrument_add(histogram.count, 1);
+    aes_instrument_add(histogram.total, ticks);
+    aes_instrument_add(histogram.buckets[aes_histogram_bucket(ticks)], 1);
+    if (ticks > histogram.max.load(std::memory_order_relaxed)) {
+        histogram.max.store(ticks, std::memory_order_relaxed);
+    }
+    if (call == AES_CALL_EXPAND_KEY) {
+        aes_instrument_record_stage(AES_STAGE_KEY_EXPANSION, ticks);
+    }
+}
+
+/**
+ * Times a call from its construction to the end of its scope.
+ */
+struct aes_instrument_scope {
+    explicit aes_instrument_scope(aes_instrument_call call) : call(call), start(aes_instrument_ticks()) {}
+
+    ~aes_instrument_scope() {
+        aes_instrument_record_call(call, aes_instrument_ticks() - start);
+    }
+
+    aes_instrument_scope(const aes_instrument_scope&) = delete;
+    aes_instrument_scope& operator=(const aes_instrument_scope&) = delete;
+
+    aes_instrument_call call;
+    uint64_t start;
+};
+
+#define AES_INSTRUMENT_CALL(call) aes_instrument_scope aes_instrument_call_scope(call)
+
+#else
+
+#define AES_INSTRUMENT_CALL(call)
+
+#endif
+
+/**
+ * @return the counters of every thread added up, or an empty snapshot in builds without AES_INSTRUMENT
+ */
+inline aes_instrument_snapshot aes_take_instrument_snapshot() {
+    aes_instrument_snapshot snapshot;
+#ifdef AES_INSTRUMENT
+    snapshot.enabled = true;
+#ifndef AES_HAS_AES_NI
+    snapshot.unit = "ns";
+#endif
+    aes_instrument_threads& threads = aes_instrument_all_threads();
+    std::lock_guard<std::mutex> lock(threads.mutex);
+    for (const std::shared_ptr<aes_instrument_counters>& counters : threads.counters) {
+        for (size_t stage = 0; stage < AES_STAGE_COUNT; stage++) {
+            snapshot.stage_total[stage] += counters->stage_total[stage].load(std::memory_order_relaxed);
+            snapshot.stage_count[stage] += counters->stage_count[stage].load(std::memory_order_relaxed);
+        }
+        for (size_t call = 0; call < AES_CALL_COUNT; call++) {
+            aes_histogram_snapshot& histogram = snapshot.calls[call];
+            histogram.count += counters->calls[call].count.load(std::memory_order_relaxed);
+            histogram.total += counters->calls[call].total.load(std::memory_order_relaxed);
+            histogram.max = std::max(histogram.max, counters->calls[call].max.load(std::memory_order_relaxed));
+            for (size_t bucket = 0; bucket < AES_HISTOGRAM_BUCKETS; bucket++) {
+                histogram.buckets[bucket] += counters->calls[call].buckets[bucket].load(std::memory_order_relaxed);
+            }
+        }
+    }
+#endif
+    return snapshot;
+}
+
+/**
+ * Sets every thread's counters back to zero, e.g. to leave out start up work. The counters have a single writer so this is only exact while no other thread is recording.
+ */
+inline void aes_reset_instrument() {
+#ifdef AES_INSTRUMENT
+    aes_instrument_threads& threads = aes_instrument_all_threads();
+    std::lock_guard<std::mutex> lock(threads.mutex);
+    for (const std::shared_ptr<aes_instrument_counters>& counters : threads.counters) {
+        for (size_t stage = 0; stage < AES_STAGE_COUNT; stage++) {
+            counters->stage_total[stage].store(0, std::memory_order_relaxed);
+            counters->stage_count[stage].store(0, std::memory_order_relaxed);
+        }
+        for (auto& call : counters->calls) {
+            call.count.store(0, std::memory_order_relaxed);
+            call.total.store(0, std::memory_order_relaxed);
+            call.max.store(0, std::memory_order_relaxed);
+            for (std::atomic<uint64_t>& bucket : call.buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+#endif
+}
+
+/**
+ * A key that has already been expanded for one engine. Expanding is the expensive part of using a key, so this is meant to be made once and then used for every
+ * block under that key. Everything is stored inline so copying it never allocates, and nothing modifies it after aes_expand_key so it can be shared between threads.
+ */
+struct aes_key {
+    aes_engine engine;
+    uint8_t rounds;
+    /// The first round key is the key itself.
+    std::array<uint32_t, 4 * 15> round_keys;
+    /// The round keys for the equivalent inverse cipher: in reverse order with inverse mix columns applied to all but the first and last.
+    std::array<uint32_t, 4 * 15> decryption_round_keys;
+    /// Only filled in for the bitsliced engine.
+    std::array<uint64_t, 8 * 15> bitsliced_round_keys;
+};
+
+/**
+ * @param key - the key bytes, 16, 24 or 32 of them
+ * @param engine - the engine the key will be used with
+ * @return the expanded key, ready to pass to aes_encrypt and aes_decrypt
+ *
+ * Every schedule is written straight into the aes_key, so nothing is allocated.
+ */
+inline aes_key aes_expand_key(std::span<const std::byte> key, aes_engine engine = AES_ENGINE_REFERENCE) {
+    AES_INSTRUMENT_CALL(AES_CALL_EXPAND_KEY);
+    /// Verify key length
+    if (key.size() != 16 && key.size() != 24 && key.size() != 32) {
+        std::cerr << "AES KEY ERROR: Size of " << key.size() << " is invalid supported sizes are: 16, 24, 32";
+        exit(5);
+    }
+    aes_verify_engine(engine);
+
+    const uint8_t key_len = key.size() / 4;
+    const uint8_t rounds = key_len + 6;
+
+    aes_key out = {};
+    out.engine = engine;
+    out.rounds = rounds;
+
+    const uint8_t* bytes = (const uint8_t*) key.data();
+    uint32_t key_words[8];
+    for (uint8_t word = 0; word < key_len; word++) {
+        key_words[word] = ((uint32_t) bytes[word * 4] << 24) | ((uint32_t) bytes[word * 4 + 1] << 16) | ((uint32_t) bytes[word * 4 + 2] << 8) | bytes[word * 4 + 3];
+    }
+
+    bool expanded = false;
+#ifdef AES_HAS_AES_NI
+    if (engine == AES_ENGINE_AES_NI && key.size() == 16) {
+        aes_get_round_keys_aes_ni<16>(key_words, out.round_keys.data());
+        expanded = true;
+    }
+    else if (engine == AES_ENGINE_AES_NI && key.size() == 32) {
+        aes_get_round_keys_aes_ni<32>(key_words, out.round_keys.data());
+        expanded = true;
+    }
+#endif
+    if (!expanded) {
+        aes_get_round_keys(key_len, key_words, rounds + 1, out.round_keys.data(), engine == AES_ENGINE_BITSLICE ? aes_bitslice_sub_word32 : aes_sub_word32);
+    }
+    aes_secure_zero(key_words, sizeof(key_words));
+
+    /// The bitsliced engine decrypts with the same round keys as it encrypts with, and the equivalent inverse cipher's keys go through the mix column tables, so they're left out.
+    if (engine == AES_ENGINE_BITSLICE) {
+        aes_get_bitsliced_round_keys(out.round_keys.data(), rounds, out.bitsliced_round_keys.data());
+        return out;
+    }
+
+#ifdef AES_HAS_AES_NI
+    if (engine == AES_ENGINE_AES_NI) {
+        aes_get_decryption_round_keys_aes_ni(out.round_keys.data(), rounds, out.decryption_round_keys.data());
+        return out;
+    }
+#endif
+
+    for (uint8_t round = 0; round <= rounds; round++) {
+        for (uint8_t word = 0; word < 4; word++) {
+            uint32_t round_key = out.round_keys[(rounds - round) * 4 + word];
+            out.decryption_round_keys[round * 4 + word] = (round == 0 || round == rounds) ? round_key : aes_inverse_mix_column(round_key);
+        }
+    }
+
+    return out;
+}
+
+/**
+ * @param key - the key as a string of bytes
+ * @param engine - the engine the key will be used with
+ * @return the expanded key, ready to pass to aes_encrypt and aes_decrypt
+ */
+inline aes_key aes_expand_key(const std::string& key, aes_engine engine = AES_ENGINE_REFERENCE) {
+    return aes_expand_key(std::as_bytes(std::span<const char>(key)), engine);
+}
+
+/**
+ * The steps of a block that the reference functions report to their observer.
+ */
+enum aes_step {
+    AES_STEP_INITIAL,
+    AES_STEP_ADD_ROUND_KEY,
+    AES_STEP_SUB_BYTES,
+    AES_STEP_SHIFT_ROWS,
+    AES_STEP_MIX_COLUMNS,
+    /// The same operation as AES_STEP_ADD_ROUND_KEY, reported separately so observers can tell decryption apart.
+    AES_STEP_INVERSE_ADD_ROUND_KEY,
+    AES_STEP_INVERSE_SUB_BYTES,
+    AES_STEP_INVERSE_SHIFT_ROWS,
+    AES_STEP_INVERSE_MIX_COLUMNS
+};
+
+/**
+ * The observer the reference functions use unless they are given one. Does nothing, so after inlining there is nothing left of it.
+ *
+ * An observer is anything with an observe function taking the step just done, the index of the round key it belongs to, the number of rounds and the state after the step.
+ */
+struct aes_null_observer {
+    void observe(aes_step, int, uint8_t, const aes_state&) {}
+};
+
+/**
+ * Prints the state after every step, labelled with the step and round.
+ */
+struct aes_print_observer {
+    void observe(aes_step step, int round, uint8_t rounds, const aes_state& state) {
+        /// Encryption goes from round key 0 up and decryption from the last round key down.
+        bool last = round == rounds;
+        std::string number = std::to_string(round);
+
+        switch (step) {
+            case AES_STEP_INITIAL:
+                std::cout << "Initial State:\n";
+                break;
+            case AES_STEP_ADD_ROUND_KEY:
+                std::cout << (round == 0 ? "First Round Key:\n" : last ? " Last Round key:\n" : number + " Round add round key:\n");
+                break;
+            case AES_STEP_SUB_BYTES:
+                std::cout << (last ? " Last Round S-Box:\n" : number + " Round s-box:\n");
+                break;
+            case AES_STEP_SHIFT_ROWS:
+                std::cout << (last ? " Last Round Shift Rows:\n" : number + " Round row shift:\n");
+                break;
+            case AES_STEP_MIX_COLUMNS:
+            case AES_STEP_INVERSE_MIX_COLUMNS:
+                std::cout << number << " Round mix:\n";
+                break;
+            case AES_STEP_INVERSE_ADD_ROUND_KEY:
+                std::cout << (last ? "First Round Key:\n" : round == 0 ? " Last Round key:\n" : number + " Round key:\n");
+                break;
+            case AES_STEP_INVERSE_SUB_BYTES:
+                std::cout << (last ? "First sub box:\n" : number + " Round s-box:\n");
+                break;
+            case AES_STEP_INVERSE_SHIFT_ROWS:
+                std::cout << (last ? "First row shift:\n" : number + " Round shift:\n");
+                break;
+        }
+
+        aes_print_state(state);
+    }
+};
+
+/**
+ * One step recorded by aes_recording_observer.
+ */
+struct aes_recorded_step {
+    aes_step step;
+    int round;
+    std::array<uint32_t, 4> state;
+};
+
+/**
+ * Keeps the state after every step, like the steps and substeps the visualizer in aes.ts walks through.
+ */
+struct aes_recording_observer {
+    std::vector<aes_recorded_step> steps;
+
+    void observe(aes_step step, int round, uint8_t, const aes_state& state) {
+        aes_recorded_step recorded = {step, round, {}};
+        aes_state_store(state, recorded.state.data());
+        steps.push_back(recorded);
+    }
+};
+
+#ifdef AES_INSTRUMENT
+
+/**
+ * Counts the time between one step and the next towards the step's stage. The reference functions make a new observer for every block.
+ */
+struct aes_instrument_observer {
+    void observe(aes_step step, int, uint8_t, const aes_state&) {
+        uint64_t now = aes_instrument_ticks();
+        switch (step) {
+            case AES_STEP_INITIAL:
+                break;
+            case AES_STEP_SUB_BYTES:
+            case AES_STEP_INVERSE_SUB_BYTES:
+                aes_instrument_record_stage(AES_STAGE_SUB_BYTES, now - last);
+                break;
+            case AES_STEP_SHIFT_ROWS:
+            case AES_STEP_INVERSE_SHIFT_ROWS:
+                aes_instrument_record_stage(AES_STAGE_SHIFT_ROWS, now - last);
+                break;
+            case AES_STEP_MIX_COLUMNS:
+            case AES_STEP_INVERSE_MIX_COLUMNS:
+                aes_instrument_record_stage(AES_STAGE_MIX_COLUMNS, now - last);
+                break;
+            case AES_STEP_ADD_ROUND_KEY:
+            case AES_STEP_INVERSE_ADD_ROUND_KEY:
+                aes_instrument_record_stage(AES_STAGE_ADD_ROUND_KEY, now - last);
+                break;
+        }
+        /// Read the clock again so recording isn't counted towards the next step.
+        last = aes_instrument_ticks();
+    }
+
+    uint64_t last = 0;
+};
+
+#endif
+
+/// Builds with AES_TRACE defined print every step of the reference engine, and the keys the string aes_encrypt and aes_decrypt are given, like this implementation always used to. Builds with AES_INSTRUMENT time every step instead.
+#if defined(AES_TRACE)
+using aes_default_observer = aes_print_observer;
+#elif defined(AES_INSTRUMENT)
+using aes_default_observer = aes_instrument_observer;
+#else
+using aes_default_observer = aes_null_observer;
+#endif
+
+/**
+ * @param block - four column words of a single block, replaced with the encrypted block
+ * @param round_keys - the output of aes_get_round_keys
+ * @param rounds - number of rounds (10 for 128-bit)
+ * @param observer - told about the state after every step, see aes_null_observer
+ *
+ * This is the reference implementation. It does every step on its own and shows the state after each one to <b>observer</b>, which prints it in builds with AES_TRACE.
+ *
+ * |  128 bit  |  192 bit  |  256 bit  |
+ * |  10 round |  12 round |  14 round |
+ *
+ * 16 byte key
+ *
+ * ----------------------
+ * | k0 | k4 | k8 | kc |
+ * | k1 | k5 | k9 | kd |
+ * | k2 | k6 | ka | ke |
+ * | k3 | k7 | kb | kf |
+ * ----------------------
+ *
+ * expand using to get round keys
+ *
+ * round keys are
+ * rij where i is the round and j is the byte index in hex
+ * e.g. 5th byte from 3rd round: r35
+ * e.g. 14th byte from the 12th round: rbd
+ *
+ *
+ * 16 byte message
+ *
+ * ----------------------
+ * | m0 | m4 | m8 | mc |
+ * | m1 | m5 | m9 | md |
+ * | m2 | m6 | ma | me |
+ * | m3 | m7 | mb | mf |
+ * ----------------------
+ *
+ * Xor the original key with the message
+ *
+ * ai = mi ^ ki
+ * 
+ * ----------------------
+ * | a0 | a4 | a8 | ac |
+ * | a1 | a5 | a9 | ad |
+ * | a2 | a6 | aa | ae |
+ * | a3 | a7 | ab | af |
+ * ----------------------
+ *
+ * For each round
+ *
+ * Sub-byte the state
+ *
+ * si = subbyte(ai)
+ *
+ * ----------------------
+ * | s0 | s4 | s8 | sc |
+ * | s1 | s5 | s9 | sd |
+ * | s2 | s6 | sa | se |
+ * | s3 | s7 | sb | sf |
+ * ----------------------
+ *
+ * Shift rows
+ * ----------------------
+ * | s0 | s4 | s8 | sc |
+ * | s5 | s9 | sd | s1 |
+ * | sa | se | s2 | s6 |
+ * | sf | s3 | s7 | sb |
+ * ----------------------
+ *
+ *
+ *
+ *
+ */
+template <typename observer_type = aes_null_observer>
+void aes_encrypt_block_reference(uint32_t* block, const uint32_t* round_keys, uint8_t rounds, observer_type&& observer = observer_type()) {
+    aes_state state = aes_state_load(block);
+
+    observer.observe(AES_STEP_INITIAL, 0, rounds, state);
+
+    /// Add original key to state.
+    aes_add_round_key(state, round_keys);
+    observer.observe(AES_STEP_ADD_ROUND_KEY, 0, rounds, state);
+
+    for (int round = 1; round < rounds; round++) {
+
+        /// Sub-byte the state
+        aes_sub_bytes(state);
+        observer.observe(AES_STEP_SUB_BYTES, round, rounds, state);
+
+        /// Shift Rows
+        aes_shift_rows(state);
+        observer.observe(AES_STEP_SHIFT_ROWS, round, rounds, state);
+
+        /// Mix Columns
+        aes_mix_columns(state);
+        observer.observe(AES_STEP_MIX_COLUMNS, round, rounds, state);
+
+        // Add Round Key
+        aes_add_round_key(state, round_keys + (round * 4));
+        observer.observe(AES_STEP_ADD_ROUND_KEY, round, rounds, state);
+    }
+
+
+    /// Sub-byte the state
+    aes_sub_bytes(state);
+    observer.observe(AES_STEP_SUB_BYTES, rounds, rounds, state);
+
+    /// Shift Rows
+    aes_shift_rows(state);
+    observer.observe(AES_STEP_SHIFT_ROWS, rounds, rounds, state);
+
+    // Add Round Key
+    aes_add_round_key(state, round_keys + (rounds * 4));
+    observer.observe(AES_STEP_ADD_ROUND_KEY, rounds, rounds, state);
+
+    aes_state_store(state, block);
+}
+
+/**
+ * @param block - four column words of a single encrypted block, replaced with the decrypted block
+ * @param round_keys - the output of aes_get_round_keys (not the decryption round keys, they are walked through backwards)
+ * @param rounds - number of rounds (10 for 128-bit)
+ * @param observer - told about the state after every step, see aes_null_observer
+ */
+template <typename observer_type = aes_null_observer>
+void aes_decrypt_block_reference(uint32_t* block, const uint32_t* round_keys, uint8_t rounds, observer_type&& observer = observer_type()) {
+    aes_state state = aes_state_load(block);
+
+    observer.observe(AES_STEP_INITIAL, rounds, rounds, state);
+
+    /// Add Round Key
+    aes_add_round_key(state, round_keys + (rounds * 4));
+    observer.observe(AES_STEP_INVERSE_ADD_ROUND_KEY, rounds, rounds, state);
+
+    /// Shift Rows
+    aes_reverse_shift_rows(state);
+    observer.observe(AES_STEP_INVERSE_SHIFT_ROWS, rounds, rounds, state);
+
+    /// Sub-byte the state
+    aes_inverse_sub_bytes(state);
+    observer.observe(AES_STEP_INVERSE_SUB_BYTES, rounds, rounds, state);
+
+
+    for (int round = rounds - 1; round > 0; round--) {
+        // Add Round Key
+        aes_add_round_key(state, round_keys + (round * 4));
+        observer.observe(AES_STEP_INVERSE_ADD_ROUND_KEY, round, rounds, state);
+
+        /// Mix Columns
+        aes_inverse_mix_columns(state);
+        observer.observe(AES_STEP_INVERSE_MIX_COLUMNS, round, rounds, state);
+
+        /// Shift Rows
+        aes_reverse_shift_rows(state);
+        observer.observe(AES_STEP_INVERSE_SHIFT_ROWS, round, rounds, state);
+
+        /// Sub-byte the state
+        aes_inverse_sub_bytes(state);
+        observer.observe(AES_STEP_INVERSE_SUB_BYTES, round, rounds, state);
+    }
+
+    /// Add original key to state.
+    aes_add_round_key(state, round_keys);
+    observer.observe(AES_STEP_INVERSE_ADD_ROUND_KEY, 0, rounds, state);
+
+    aes_state_store(state, block);
+}
+
+/**
+ * @tparam rounds - the number of rounds for the key's size, so the block functions are specialized for it
+ * @param key - an expanded key
+ * @param blocks - <b>block_count</b> blocks, each as four column words, replaced with the encrypted blocks
+ * @param block_count - the number of blocks
+ */
+template <uint8_t rounds>
+void aes_encrypt_blocks_sized(const aes_key& key, uint32_t* blocks, size_t block_count) {
+    switch (key.engine) {
+#ifdef AES_HAS_AES_NI
+        case AES_ENGINE_AES_NI:
+            aes_encrypt_blocks_aes_ni<rounds>(blocks, block_count, key.round_keys.data());
+            break;
+#endif
+        case AES_ENGINE_BITSLICE:
+            aes_process_blocks_bitslice<rounds>(blocks, block_count, key.bitsliced_round_keys.data(), false);
+            break;
+        case AES_ENGINE_T_TABLE:
+            for (size_t block = 0; block < block_count; block++) {
+                aes_encrypt_block_ttable<rounds>(blocks + (block * 4), key.round_keys.data());
+            }
+            break;
+        default:
+            for (size_t block = 0; block < block_count; block++) {
+                aes_encrypt_block_reference(blocks + (block * 4), key.round_keys.data(), rounds, aes_default_observer());
+            }
+            break;
+    }
+}
+
+/**
+ * @tparam rounds - the number of rounds for the key's size, so the block functions are specialized for it
+ * @param key - an expanded key
+ * @param blocks - <b>block_count</b> encrypted blocks, each as four column words, replaced with the decrypted blocks
+ * @param block_count - the number of blocks
+ */
+template <uint8_t rounds>
+void aes_decrypt_blocks_sized(const aes_key& key, uint32_t* blocks, size_t block_count) {
+    switch (key.engine) {
+#ifdef AES_HAS_AES_NI
+        case AES_ENGINE_AES_NI:
+            aes_decrypt_blocks_aes_ni<rounds>(blocks, block_count, key.decryption_round_keys.data());
+            break;
+#endif
+        case AES_ENGINE_BITSLICE:
+            aes_process_blocks_bitslice<rounds>(blocks, block_count, key.bitsliced_round_keys.data(), true);
+            break;
+        case AES_ENGINE_T_TABLE:
+            for (size_t block = 0; block < block_count; block++) {
+                aes_decrypt_block_ttable<rounds>(blocks + (block * 4), key.decryption_round_keys.data());
+            }
+            break;
+        default:
+            for (size_t block = 0; block < block_count; block++) {
+                aes_decrypt_block_reference(blocks + (block * 4), key.round_keys.data(), rounds, aes_default_observer());
+            }
+            break;
+    }
+}
+
+/**
+ * @param key - an expanded key
+ * @param blocks - <b>block_count</b> blocks, each as four column words, replaced with the encrypted blocks
+ * @param block_count - the number of blocks
+ *
+ * The key size is only looked at once here, everything below it has the number of rounds fixed when compiling.
+ */
+inline void aes_encrypt_blocks(const aes_key& key, uint32_t* blocks, size_t block_count) {
+    AES_INSTRUMENT_CALL(AES_CALL_ENCRYPT_BLOCKS);
+    switch (key.rounds) {
+        case aes_key_size<32>::rounds:
+            aes_encrypt_blocks_sized<aes_key_size<32>::rounds>(key, blocks, block_count);
+            break;
+        case aes_key_size<24>::rounds:
+            aes_encrypt_blocks_sized<aes_key_size<24>::rounds>(key, blocks, block_count);
+            break;
+        default:
+            aes_encrypt_blocks_sized<aes_key_size<16>::rounds>(key, blocks, block_count);
+            break;
+    }
+}
+
+/**
+ * @param key - an expanded key
+ * @param blocks - <b>block_count</b> encrypted blocks, each as four column words, replaced with the decrypted blocks
+ * @param block_count - the number of blocks
+ */
+inline void aes_decrypt_blocks(const aes_key& key, uint32_t* blocks, size_t block_count) {
+    AES_INSTRUMENT_CALL(AES_CALL_DECRYPT_BLOCKS);
+    switch (key.rounds) {
+        case aes_key_size<32>::rounds:
+            aes_decrypt_blocks_sized<aes_key_size<32>::rounds>(key, blocks, block_count);
+            break;
+        case aes_key_size<24>::rounds:
+            aes_decrypt_blocks_sized<aes_key_size<24>::rounds>(key, blocks, block_count);
+            break;
+        default:
+            aes_decrypt_blocks_sized<aes_key_size<16>::rounds>(key, blocks, block_count);
+            break;
+    }
+}
+
+/**
+ * @param message - the bytes to encrypt
+ * @param key - an expanded key
+ * @return the encrypted blocks as column words
+ *
+ * A final block shorter than 16 bytes is padded with 0x80 followed by zeros.
+ */
+inline std::vector<uint32_t> aes_encrypt(std::string message, const aes_key& key) {
+    if (message.empty() || message.size() % 16) {
+        message.push_back(0x80);
+
+        while (message.size() % 16) {
+            message.push_back(0);
+        }
+    }
+
+    std::vector<uint32_t> state = convert_be(message);
+    aes_encrypt_blocks(key, state.data(), state.size() / 4);
+
+    return state;
+}
+
+inline std::vector<uint32_t> aes_encrypt(const std::string& message, const std::string& key, aes_engine engine = AES_ENGINE_REFERENCE) {
+#ifdef AES_TRACE
+    std::cout << "Encrypting \"" << message << "\" with key: " << key << '\n';
+#endif
+
+    return aes_encrypt(message, aes_expand_key(key, engine));
+}
+
+/**
+ * @param data - encrypted blocks as column words
+ * @param key - an expanded key
+ * @return the decrypted blocks as column words
+ */
+inline std::vector<uint32_t> aes_decrypt(const std::vector<uint32_t>& data, const aes_key& key) {
+    std::vector<uint32_t> state = data;
+    aes_decrypt_blocks(key, state.data(), state.size() / 4);
+
+    return state;
+}
+
+inline std::vector<uint32_t> aes_decrypt(const std::vector<uint32_t>& data, const std::string& key, aes_engine engine = AES_ENGINE_REFERENCE) {
+#ifdef AES_TRACE
+    std::cout << "Decrypting with key: " << key << '\n';
+#endif
+
+    return aes_decrypt(data, aes_expand_key(key, engine));
+}
+
+/**
+ * @param bytes - whole 16 byte blocks
+ * @param words - receives the blocks as big endian column words, four per block
+ * @param block_count - the number of blocks
+ */
+inline void aes_load_blocks(const uint8_t* bytes, uint32_t* words, size_t block_count) {
+    std::memcpy(words, bytes, block_count * 16);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (size_t word = 0; word < block_count * 4; word++) {
+        words[word] = __builtin_bswap32(words[word]);
+    }
+#endif
+}
+
+/// The reverse of aes_load_blocks.
+inline void aes_store_blocks(const uint32_t* words, uint8_t* bytes, size_t block_count) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (size_t word = 0; word < block_count * 4; word++) {
+        uint32_t swapped = __builtin_bswap32(words[word]);
+        std::memcpy(bytes + word * 4, &swapped, 4);
+    }
+#else
+    std::memcpy(bytes, words, block_count * 16);
+#endif
+}
+
+/**
+ * The operations aes_backend_registry picks an engine for. They can have different winners: the bitsliced engine always does at least 8 blocks of work so it loses on a single block,
+ * and expanding bitsliced round keys costs more than the other schedules.
+ */
+enum aes_operation {
+    /// One block at a time with each depending on the last, like CBC encryption.
+    AES_OPERATION_SINGLE_BLOCK,
+    /// Many blocks through the forward cipher, which is everything but ECB and CBC decryption.
+    AES_OPERATION_BULK,
+    /// ECB and CBC decryption, the only users of the inverse cipher.
+    AES_OPERATION_BULK_DECRYPT,
+    /// For keys that only see a few blocks, where expanding them is most of the cost.
+    AES_OPERATION_KEY_EXPANSION,
+};
+
+const size_t AES_OPERATION_COUNT = 4;
+
+/**
+ * An engine as the registry sees it. Adding an engine means adding it to aes_engine, to the dispatch in aes_expand_key, aes_encrypt_blocks and aes_decrypt_blocks, and to aes_backends.
+ */
+struct aes_backend {
+    aes_engine engine;
+    /// The name the command line tools and the environment variables use.
+    const char* name;
+    /// Whether the CPU can run it.
+    bool (*supported)();
+};
+
+inline bool aes_backend_always_supported() {
+    return true;
+}
+
+const aes_backend aes_backends[] = {
+    {AES_ENGINE_AES_NI, "aesni", aes_ni_supported},
+    {AES_ENGINE_T_TABLE, "ttable", aes_backend_always_supported},
+    {AES_ENGINE_BITSLICE, "bitslice", aes_backend_always_supported},
+    {AES_ENGINE_REFERENCE, "reference", aes_backend_always_supported},
+};
+
+/**
+ * @return the backend with this name, or null
+ */
+inline const aes_backend* aes_find_backend(const std::string& name) {
+    for (const aes_backend& backend : aes_backends) {
+        if (name == backend.name) {
+            return &backend;
+        }
+    }
+    return nullptr;
+}
+
+inline const char* aes_engine_name(aes_engine engine) {
+    for (const aes_backend& backend : aes_backends) {
+        if (backend.engine == engine) {
+            return backend.name;
+        }
+    }
+    return "unknown";
+}
+
+/**
+ * Picks an engine for each aes_operation. The first time it's used it runs the FIPS-197 known answer tests on every engine the CPU supports, times the ones that pass
+ * on each operation, and keeps the fastest. It also times both mix column functions and keeps the faster one for aes_use_selected_mix_column.
+ * It only measures: nothing else changes until a caller uses what it picked.
+ *
+ * The environment can override the choice, e.g. to compare runs on the same engine: AES_ENGINE=NAME for every operation, AES_ENGINE_SINGLE_BLOCK, AES_ENGINE_BULK,
+ * AES_ENGINE_BULK_DECRYPT and AES_ENGINE_KEY_EXPANSION for one, and AES_MIX_COLUMNS=polynomial|matrix. The names are the ones in aes_backends.
+ * Nothing is timed when everything is overridden, so the choice doesn't depend on timing noise.
+ */
+struct aes_backend_registry {
+    /// @return the registry, which does the tests and timing the first time this is called
+    static const aes_backend_registry& instance() {
+        static const aes_backend_registry registry;
+        return registry;
+    }
+
+    aes_backend_registry(const aes_backend_registry&) = delete;
+    aes_backend_registry& operator=(const aes_backend_registry&) = delete;
+
+    aes_engine select(aes_operation operation) const {
+        return selected[operation];
+    }
+
+    /// @return the faster mix column function, or the one AES_MIX_COLUMNS names
+    aes_mix_column_type mix_column() const {
+        return selected_mix_column;
+    }
+
+    /// @return whether the engine is supported on this CPU and passed its known answer tests
+    bool passed(aes_engine engine) const {
+        return results[engine].passed;
+    }
+
+    /// @return nanoseconds per operation (one block, one 4 KiB buffer or one 128-bit key), or 0 if it wasn't timed
+    double time(aes_engine engine, aes_operation operation) const {
+        return results[engine].nanoseconds[operation];
+    }
+
+    /**
+     * Prints the test results, timings and choices.
+     */
+    void report(std::ostream& out) const {
+        const char* operation_names[AES_OPERATION_COUNT] = {"single block", "bulk 4 KiB", "bulk decrypt 4 KiB", "key expansion"};
+        auto column = [&](const std::string& text, size_t width) {
+            out << text << std::string(width > text.size() ? width - text.size() : 1, ' ');
+        };
+
+        column("engine", 11);
+        column("self-test", 13);
+        for (const char* name : operation_names) {
+            column(std::string(name) + " ns", 22);
+        }
+        out << '\n';
+        for (const aes_backend& backend : aes_backends) {
+            const aes_backend_result& result = results[backend.engine];
+            column(backend.name, 11);
+            column(!result.supported ? "unsupported" : !result.tested ? "skipped" : result.passed ? "passed" : "FAILED", 13);
+            for (size_t operation = 0; operation < AES_OPERATION_COUNT; operation++) {
+                column(result.nanoseconds[operation] ? std::to_string((uint64_t) result.nanoseconds[operation]) : "-", 22);
+            }
+            out << '\n';
+        }
+
+        out << "selected:";
+        for (size_t operation = 0; operation < AES_OPERATION_COUNT; operation++) {
+            out << ' ' << operation_names[operation] << " = " << aes_engine_name(selected[operation]) << (overridden[operation] ? " (environment)" : "") << ',';
+        }
+        out << " mix columns = " << (selected_mix_column == aes_mix_column_matrix ? "matrix" : "polynomial") << '\n';
+    }
+
+private:
+    struct aes_backend_result {
+        bool supported = false;
+        bool tested = false;
+        bool passed = false;
+        double nanoseconds[AES_OPERATION_COUNT] = {};
+    };
+
+    aes_backend_registry() {
+        std::string overrides[AES_OPERATION_COUNT];
+        const char* variables[AES_OPERATION_COUNT] = {"AES_ENGINE_SINGLE_BLOCK", "AES_ENGINE_BULK", "AES_ENGINE_BULK_DECRYPT", "AES_ENGINE_KEY_EXPANSION"};
+        const char* all = std::getenv("AES_ENGINE");
+        bool everything_overridden = true;
+        for (size_t operation = 0; operation < AES_OPERATION_COUNT; operation++) {
+            const char* value = std::getenv(variables[operation]);
+            overrides[operation] = value ? value : all ? all : "";
+            everything_overridden &= !overrides[operation].empty();
+        }
+        const char* mix_columns = std::getenv("AES_MIX_COLUMNS");
+        everything_overridden &= mix_columns != nullptr;
+
+#ifdef AES_TRACE
+        /// Trace builds print every step of the reference engine, which would make the timings meaningless, so they go by the order of aes_backends instead.
+        /// The known answer tests still run, without printing, see self_test.
+        const bool timed = false;
+#else
+        const bool timed = !everything_overridden;
+#endif
+
+        for (const aes_backend& backend : aes_backends) {
+            aes_backend_result& result = results[backend.engine];
+            result.supported = backend.supported();
+            result.tested = result.supported;
+            result.passed = result.supported && self_test(backend.engine);
+            if (result.supported && !result.passed) {
+                std::cerr << "AES ENGINE WARNING: The " << backend.name << " engine failed its known answer tests and won't be used\n";
+            }
+            if (result.passed && timed) {
+                time_operations(backend.engine, result);
+            }
+        }
+
+        for (size_t operation = 0; operation < AES_OPERATION_COUNT; operation++) {
+            if (!overrides[operation].empty()) {
+                selected[operation] = override_engine(overrides[operation]);
+                overridden[operation] = true;
+                continue;
+            }
+
+            /// The backends are in order of preference, which decides ties.
+            double best = std::numeric_limits<double>::infinity();
+            bool found = false;
+            for (const aes_backend& backend : aes_backends) {
+                const aes_backend_result& result = results[backend.engine];
+                if (result.passed && (!found || result.nanoseconds[operation] < best)) {
+                    selected[operation] = backend.engine;
+                    best = result.nanoseconds[operation];
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::cerr << "AES ENGINE ERROR: No engine passed its known answer tests";
+                exit(6);
+            }
+        }
+
+        if (mix_columns) {
+            if (std::string(mix_columns) != "polynomial" && std::string(mix_columns) != "matrix") {
+                std::cerr << "AES ENGINE ERROR: Unknown mix columns function " << mix_columns << " supported ones are: polynomial, matrix";
+                exit(6);
+            }
+            selected_mix_column = std::string(mix_columns) == "matrix" ? aes_mix_column_matrix : aes_mix_column_polynomial;
+        }
+        else {
+            selected_mix_column = select_mix_column(timed);
+        }
+    }
+
+    aes_engine override_engine(const std::string& name) const {
+        const aes_backend* backend = aes_find_backend(name);
+        if (!backend) {
+            std::cerr << "AES ENGINE ERROR: Unknown engine " << name << " supported ones are: aesni, ttable, bitslice, reference";
+            exit(6);
+        }
+        if (!results[backend->engine].passed) {
+            std::cerr << "AES ENGINE ERROR: The " << name << " engine " << (results[backend->engine].supported ? "failed its known answer tests" : "is not supported on this CPU");
+            exit(6);
+        }
+        return backend->engine;
+    }
+
+    /**
+     * @return whether the engine gets the FIPS-197 appendix C results for every key size, on one block and on enough blocks to go through its multi-block paths
+     *
+     * The reference engine runs through aes_null_observer rather than aes_default_observer, so trace builds test it without printing every step.
+     */
+    static bool self_test(aes_engine engine) {
+        const uint8_t plaintext[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+        const uint8_t ciphertexts[3][16] = {
+            {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a},
+            {0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91},
+            {0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89},
+        };
+        /// 1 block, then more than the 16 the widest paths do at once, with a partial group at the end.
+        const size_t block_counts[] = {1, 19};
+
+        for (size_t size = 0; size < 3; size++) {
+            std::string key;
+            for (size_t byte = 0; byte < 16 + size * 8; byte++) {
+                key.push_back((char) byte);
+            }
+            aes_key expanded = aes_expand_key(key, engine);
+            auto encrypt = [&](uint32_t* blocks, size_t block_count) {
+                if (engine != AES_ENGINE_REFERENCE) {
+                    aes_encrypt_blocks(expanded, blocks, block_count);
+                    return;
+                }
+                for (size_t block = 0; block < block_count; block++) {
+                    aes_encrypt_block_reference(blocks + (block * 4), expanded.round_keys.data(), expanded.rounds, aes_null_observer());
+                }
+            };
+            auto decrypt = [&](uint32_t* blocks, size_t block_count) {
+                if (engine != AES_ENGINE_REFERENCE) {
+                    aes_decrypt_blocks(expanded, blocks, block_count);
+                    return;
+                }
+                for (size_t block = 0; block < block_count; block++) {
+                    aes_decrypt_block_reference(blocks + (block * 4), expanded.round_keys.data(), expanded.rounds, aes_null_observer());
+                }
+            };
+
+            for (size_t block_count : block_counts) {
+                std::vector<uint8_t> bytes(block_count * 16);
+                for (size_t block = 0; block < block_count; block++) {
+                    std::memcpy(bytes.data() + block * 16, plaintext, 16);
+                }
+                std::vector<uint32_t> blocks(block_count * 4);
+                aes_load_blocks(bytes.data(), blocks.data(), block_count);
+
+                encrypt(blocks.data(), block_count);
+                aes_store_blocks(blocks.data(), bytes.data(), block_count);
+                for (size_t block = 0; block < block_count; block++) {
+                    if (std::memcmp(bytes.data() + block * 16, ciphertexts[size], 16)) {
+                        return false;
+                    }
+                }
+
+                decrypt(blocks.data(), block_count);
+                aes_store_blocks(blocks.data(), bytes.data(), block_count);
+                for (size_t block = 0; block < block_count; block++) {
+                    if (std::memcmp(bytes.data() + block * 16, plaintext, 16)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @return the best of a few runs, in nanoseconds per iteration
+     */
+    template <typename operation_type>
+    static double best_time(size_t iterations, operation_type&& operation) {
+        double best = std::numeric_limits<double>::infinity();
+        for (int run = 0; run < 5; run++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (size_t iteration = 0; iteration < iterations; iteration++) {
+                operation();
+            }
+            best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations);
+        }
+        return best;
+    }
+
+    /**
+     * Times each operation on a 128-bit key. The runs are short (a few milliseconds for all the engines together) so this can happen at startup.
+     */
+    static void time_operations(aes_engine engine, aes_backend_result& result) {
+        const std::string key(16, 'k');
+        aes_key expanded = aes_expand_key(key, engine);
+        /// 4 KiB, a page.
+        std::vector<uint32_t> blocks(256 * 4, 0x5a5a5a5a);
+        volatile uint32_t sink = 0;
+
+        result.nanoseconds[AES_OPERATION_SINGLE_BLOCK] = best_time(32, [&] {
+            aes_encrypt_blocks(expanded, blocks.data(), 1);
+        });
+        result.nanoseconds[AES_OPERATION_BULK] = best_time(2, [&] {
+            aes_encrypt_blocks(expanded, blocks.data(), 256);
+        });
+        result.nanoseconds[AES_OPERATION_BULK_DECRYPT] = best_time(2, [&] {
+            aes_decrypt_blocks(expanded, blocks.data(), 256);
+        });
+        result.nanoseconds[AES_OPERATION_KEY_EXPANSION] = best_time(16, [&] {
+            sink = sink + aes_expand_key(key, engine).round_keys[40];
+        });
+        sink = sink + blocks[0];
+    }
+
+    /**
+     * @param timed - whether to time the two functions, otherwise the polynomial one is kept once both pass their known answer tests
+     * @return the faster mix column function
+     */
+    static aes_mix_column_type select_mix_column(bool timed) {
+        uint32_t columns[256];
+        for (uint32_t index = 0; index < 256; index++) {
+            columns[index] = index * 0x01010101u + 0x00010203u;
+        }
+        volatile uint32_t sink = 0;
+
+        double times[2] = {};
+        aes_mix_column_type functions[2] = {aes_mix_column_polynomial, aes_mix_column_matrix};
+        for (size_t function = 0; function < 2; function++) {
+            /// The FIPS-197 mix columns examples.
+            if (functions[function](0xdb135345) != 0x8e4da1bc || functions[function](0xf20a225c) != 0x9fdc589d || functions[function](0xd4d4d4d5) != 0xd5d5d7d6) {
+                std::cerr << "AES ENGINE ERROR: The " << (function ? "matrix" : "polynomial") << " mix column function failed its known answer tests";
+                exit(6);
+            }
+            if (!timed) {
+                continue;
+            }
+            times[function] = best_time(4, [&] {
+                for (uint32_t& column : columns) {
+                    column = functions[function](column);
+                }
+            });
+        }
+        sink = sink + columns[0];
+
+        return times[1] < times[0] ? aes_mix_column_matrix : aes_mix_column_polynomial;
+    }
+
+    aes_backend_result results[4];
+    aes_engine selected[AES_OPERATION_COUNT] = {};
+    bool overridden[AES_OPERATION_COUNT] = {};
+    aes_mix_column_type selected_mix_column = aes_mix_column_polynomial;
+};
+
+/**
+ * @param operation - what the engine is for
+ * @return the engine aes_backend_registry picked for it. The first call runs the registry's tests and timing, which take a few milliseconds.
+ */
+inline aes_engine aes_select_engine(aes_operation operation) {
+    return aes_backend_registry::instance().select(operation);
+}
+
+/**
+ * Switches aes_mix_columns, and so the reference engine, to the mix column function aes_backend_registry picked. Like aes_select_engine it runs the registry the first time.
+ */
+inline void aes_use_selected_mix_column() {
+    aes_mix_column_function = aes_backend_registry::instance().mix_column();
+}
+
+/**
+ * The layout of a CTR mode counter block. The last <b>counter_bits</b> bits of the block are a big endian counter that goes up by one for every block,
+ * and everything before it is the nonce which never changes. When the counter wraps around it doesn't carry into the nonce.
+ */
+struct aes_ctr_counter {
+    /// The counter block for the first block of the message as column words.
+    std::array<uint32_t, 4> initial_block;
+    /// 32, 64 or 128.
+    uint8_t counter_bits;
+};
+
+/**
+ * @param initial_block - the counter block for the first block of the message (nonce followed by the starting counter)
+ * @param counter_bits - how many bits at the end of the block are the counter: 32, 64 or 128
+ * @return the counter layout for aes_ctr
+ */
+inline aes_ctr_counter aes_ctr_make_counter(std::span<const std::byte, 16> initial_block, uint8_t counter_bits = 32) {
+    if (counter_bits != 32 && counter_bits != 64 && counter_bits != 128) {
+        std::cerr << "AES CTR ERROR: Counter size of " << (int) counter_bits << " bits is invalid supported sizes are: 32, 64, 128";
+        exit(7);
+    }
+
+    aes_ctr_counter out = {};
+    aes_load_blocks((const uint8_t*) initial_block.data(), out.initial_block.data(), 1);
+    out.counter_bits = counter_bits;
+
+    return out;
+}
+
+/**
+ * @param initial_block - the 16 byte counter block for the first block of the message (nonce followed by the starting counter)
+ * @param counter_bits - how many bits at the end of the block are the counter: 32, 64 or 128
+ * @return the counter layout for aes_ctr
+ */
+inline aes_ctr_counter aes_ctr_make_counter(const std::string& initial_block, uint8_t counter_bits = 32) {
+    if (initial_block.size() != 16) {
+        std::cerr << "AES CTR ERROR: Counter block size of " << initial_block.size() << " is invalid it must be 16";
+        exit(7);
+    }
+
+    return aes_ctr_make_counter(std::span<const std::byte, 16>((const std::byte*) initial_block.data(), 16), counter_bits);
+}
+
+/**
+ * @param counter - the counter layout
+ * @param block_index - which block of the message the counter block is for
+ * @param out - receives the counter block as four column words
+ */
+inline void aes_ctr_get_counter_block(const aes_ctr_counter& counter, uint64_t block_index, uint32_t* out) {
+    uint64_t high = ((uint64_t) counter.initial_block[0] << 32) | counter.initial_block[1];
+    uint64_t low = ((uint64_t) counter.initial_block[2] << 32) | counter.initial_block[3];
+
+    if (counter.counter_bits == 32) {
+        low = (low & 0xffffffff00000000) | (uint32_t) (low + block_index);
+    }
+    else {
+        uint64_t sum = low + block_index;
+        if (counter.counter_bits == 128 && sum < low) {
+            high++;
+        }
+        low = sum;
+    }
+
+    out[0] = high >> 32;
+    out[1] = high & 0xffffffff;
+    out[2] = low >> 32;
+    out[3] = low & 0xffffffff;
+}
+
+/// How many counter blocks are encrypted together. This is enough for two groups of the multi-block AES-NI functions and one group of the AVX2 bitsliced engine.
+const size_t AES_CTR_PARALLEL_BLOCKS = 16;
+
+/**
+ * @param key - an expanded key
+ * @param counter - the counter layout
+ * @param offset - where in the key stream <b>input</b> starts, in bytes. Any part of a message can be processed on its own by passing its offset.
+ * @param input - the bytes to encrypt or decrypt
+ * @param output - receives the result, may be the same as <b>input</b>
+ * @param length - the number of bytes
+ *
+ * Encryption and decryption are the same operation in CTR mode: the key stream (the encrypted counter blocks) is xored with the data.
+ * No padding is needed since the unused part of the last key stream block is thrown away.
+ */
+inline void aes_ctr_process(const aes_key& key, const aes_ctr_counter& counter, uint64_t offset, const uint8_t* input, uint8_t* output, size_t length) {
+    AES_INSTRUMENT_CALL(AES_CALL_CTR);
+    uint64_t block_index = offset / 16;
+    size_t skip = offset % 16;
+
+    while (length) {
+        uint32_t key_stream[AES_CTR_PARALLEL_BLOCKS * 4];
+        size_t blocks = std::min(AES_CTR_PARALLEL_BLOCKS, (skip + length + 15) / 16);
+
+        for (size_t block = 0; block < blocks; block++) {
+            aes_ctr_get_counter_block(counter, block_index + block, key_stream + (block * 4));
+        }
+        aes_encrypt_blocks(key, key_stream, blocks);
+
+        /// Once the key stream is in byte order the xor doesn't care about endianness, so it can be done eight bytes at a time.
+        uint8_t key_stream_bytes[AES_CTR_PARALLEL_BLOCKS * 16];
+        aes_store_blocks(key_stream, key_stream_bytes, blocks);
+
+        size_t count = std::min(length, blocks * 16 - skip);
+        size_t index = 0;
+        for (; index + 8 <= count; index += 8) {
+            uint64_t chunk, stream;
+            std::memcpy(&chunk, input + index, 8);
+            std::memcpy(&stream, key_stream_bytes + skip + index, 8);
+            chunk ^= stream;
+            std::memcpy(output + index, &chunk, 8);
+        }
+        for (; index < count; index++) {
+            output[index] = input[index] ^ key_stream_bytes[skip + index];
+        }
+
+        input += count;
+        output += count;
+        length -= count;
+        block_index += blocks;
+        skip = 0;
+    }
+}
+
+/**
+ * @param data - the bytes to encrypt or decrypt
+ * @param key - an expanded key
+ * @param counter - the counter layout
+ * @param offset - where in the key stream <b>data</b> starts, in bytes
+ * @return the result, which is the same length as <b>data</b>
+ */
+inline std::string aes_ctr(const std::string& data, const aes_key& key, const aes_ctr_counter& counter, uint64_t offset = 0) {
+    std::string out(data.size(), 0);
+    aes_ctr_process(key, counter, offset, (const uint8_t*) data.data(), (uint8_t*) out.data(), out.size());
+
+    return out;
+}
+
+/**
+ * @param mode - the name of the mode for the error message
+ * @param length - the number of bytes given to a mode that only takes whole blocks
+ */
+inline void aes_verify_block_length(const char* mode, size_t length) {
+    if (length % 16) {
+        std::cerr << "AES " << mode << " ERROR: Data size of " << length << " is invalid it must be a multiple of 16";
+        exit(9);
+    }
+}
+
+/// How many blocks are converted and processed together by the in place ECB functions.
+const size_t AES_ECB_PARALLEL_BLOCKS = 16;
+
+/**
+ * @param key - an expanded key
+ * @param input - whole blocks to encrypt
+ * @param output - receives the ciphertext, may be the same as <b>input</b>
+ * @param length - the number of bytes, a multiple of 16
+ *
+ * The same as aes_encrypt_blocks but on bytes in message order instead of column words, without padding.
+ */
+inline void aes_ecb_encrypt_process(const aes_key& key, const uint8_t* input, uint8_t* output, size_t length) {
+    AES_INSTRUMENT_CALL(AES_CALL_ECB_ENCRYPT);
+    aes_verify_block_length("ECB", length);
+
+    while (length) {
+        size_t blocks = std::min(AES_ECB_PARALLEL_BLOCKS, length / 16);
+        uint32_t state[AES_ECB_PARALLEL_BLOCKS * 4];
+        aes_load_blocks(input, state, blocks);
+        aes_encrypt_blocks(key, state, blocks);
+        aes_store_blocks(state, output, blocks);
+
+        input += blocks * 16;
+        output += blocks * 16;
+        length -= blocks * 16;
+    }
+}
+
+/**
+ * @param key - an expanded key
+ * @param input - whole blocks to decrypt
+ * @param output - receives the plaintext, may be the same as <b>input</b>
+ * @param length - the number of bytes, a multiple of 16
+ */
+inline void aes_ecb_decrypt_process(const aes_key& key, const uint8_t* input, uint8_t* output, size_t length) {
+    AES_INSTRUMENT_CALL(AES_CALL_ECB_DECRYPT);
+    aes_verify_block_length("ECB", length);
+
+    while (length) {
+        size_t blocks = std::min(AES_ECB_PARALLEL_BLOCKS, length / 16);
+        uint32_t state[AES_ECB_PARALLEL_BLOCKS * 4];
+        aes_load_blocks(input, state, blocks);
+        aes_decrypt_blocks(key, state, blocks);
+        aes_store_blocks(state, output, blocks);
+
+        input += blocks * 16;
+        output += blocks * 16;
+        length -= blocks * 16;
+    }
+}
+
+/**
+ * @param iv - the 16 byte initialization vector
+ * @return the IV as column words, ready to be the first chaining value
+ */
+inline std::array<uint32_t, 4> aes_cbc_make_iv(const std::string& iv) {
+    if (iv.size() != 16) {
+        std::cerr << "AES CBC ERROR: IV size of " << iv.size() << " is invalid it must be 16";
+        exit(9);
+    }
+
+    std::array<uint32_t, 4> out;
+    aes_load_blocks((const uint8_t*) iv.data(), out.data(), 1);
+
+    return out;
+}
+
+/**
+ * @param key - an expanded key
+ * @param chaining - the IV for the first call, afterwards the last ciphertext block. Updated so a message can be encrypted in pieces.
+ * @param input - whole blocks to encrypt
+ * @param output - receives the ciphertext, may be the same as <b>input</b>
+ * @param length - the number of bytes, a multiple of 16
+ *
+ * Every block is xored with the previous ciphertext block before it is encrypted, so this can only go one block at a time.
+ */
+inline void aes_cbc_encrypt_process(const aes_key& key, std::array<uint32_t, 4>& chaining, const uint8_t* input, uint8_t* output, size_t length) {
+    AES_INSTRUMENT_CALL(AES_CALL_CBC_ENCRYPT);
+    aes_verify_block_length("CBC", length);
+
+    for (size_t position = 0; position < length; position += 16) {
+        uint32_t block[4];
+        aes_load_blocks(input + position, block, 1);
+        for (int word = 0; word < 4; word++) {
+            block[word] ^= chaining[word];
+        }
+
+        aes_encrypt_blocks(key, block, 1);
+
+        std::copy(block, block + 4, chaining.begin());
+        aes_store_blocks(block, output + position, 1);
+    }
+}
+
+/// How many blocks are decrypted together. Like CTR, this fills two groups of the AES-NI kernels or one pass of the AVX2 bitsliced engine.
+const size_t AES_CBC_PARALLEL_BLOCKS = 16;
+
+/**
+ * @param key - an expanded key
+ * @param chaining - the IV for the first call, afterwards the last ciphertext block. Updated so a message can be decrypted in pieces.
+ * @param input - whole blocks to decrypt
+ * @param output - receives the plaintext, may be the same as <b>input</b>
+ * @param length - the number of bytes, a multiple of 16
+ *
+ * Plaintext block i is D(K, C[i]) xor C[i - 1], which only needs ciphertext, so the block decryptions don't depend on each other and are done in batches.
+ * The ciphertext of a batch is kept aside since the blocks may be overwritten in place.
+ */
+inline void aes_cbc_decrypt_process(const aes_key& key, std::array<uint32_t, 4>& chaining, const uint8_t* input, uint8_t* output, size_t length) {
+    AES_INSTRUMENT_CALL(AES_CALL_CBC_DECRYPT);
+    aes_verify_block_length("CBC", length);
+
+    while (length) {
+        size_t blocks = std::min(AES_CBC_PARALLEL_BLOCKS, length / 16);
+
+        uint32_t ciphertext[AES_CBC_PARALLEL_BLOCKS * 4];
+        uint32_t state[AES_CBC_PARALLEL_BLOCKS * 4];
+        aes_load_blocks(input, ciphertext, blocks);
+        std::copy(ciphertext, ciphertext + blocks * 4, state);
+
+        aes_decrypt_blocks(key, state, blocks);
+
+        for (int word = 0; word < 4; word++) {
+            state[word] ^= chaining[word];
+        }
+        for (size_t word = 4; word < blocks * 4; word++) {
+            state[word] ^= ciphertext[word - 4];
+        }
+
+        std::copy(ciphertext + (blocks - 1) * 4, ciphertext + blocks * 4, chaining.begin());
+        aes_store_blocks(state, output, blocks);
+
+        input += blocks * 16;
+        output += blocks * 16;
+        length -= blocks * 16;
+    }
+}
+
+/**
+ * @param data - the message, a multiple of 16 bytes. No padding is added.
+ * @param key - an expanded key
+ * @param iv - the 16 byte initialization vector
+ * @return the ciphertext
+ */
+inline std::string aes_cbc_encrypt(const std::string& data, const aes_key& key, const std::string& iv) {
+    std::array<uint32_t, 4> chaining = aes_cbc_make_iv(iv);
+    std::string out(data.size(), 0);
+    aes_cbc_encrypt_process(key, chaining, (const uint8_t*) data.data(), (uint8_t*) out.data(), out.size());
+
+    return out;
+}
+
+/**
+ * @param data - the ciphertext, a multiple of 16 bytes
+ * @param key - an expanded key
+ * @param iv - the 16 byte initialization vector used to encrypt
+ * @return the plaintext
+ */
+inline std::string aes_cbc_decrypt(const std::string& data, const aes_key& key, const std::string& iv) {
+    std::array<uint32_t, 4> chaining = aes_cbc_make_iv(iv);
+    std::string out(data.size(), 0);
+    aes_cbc_decrypt_process(key, chaining, (const uint8_t*) data.data(), (uint8_t*) out.data(), out.size());
+
+    return out;
+}
+
+/**
+ * A GHASH field element (a polynomial over GF(2) modulo x^128 + x^7 + x^2 + x + 1) stored as two big endian halves of the block.
+ * GCM numbers the bits from the top bit of the first byte, so the x^0 coefficient is the top bit of <b>high</b> and multiplying by x is a right shift.
+ */
+struct aes_ghash_element {
+    uint64_t high;
+    uint64_t low;
+};
+
+/// x^128 reduced modulo the GCM polynomial, lined up with the high half: x^128 = 1 + x + x^2 + x^7.
+const uint64_t AES_GHASH_REDUCTION = 0xe100000000000000;
+
+inline aes_ghash_element aes_ghash_load(const uint8_t* bytes) {
+    aes_ghash_element out = {0, 0};
+    for (int i = 0; i < 8; i++) {
+        out.high = (out.high << 8) | bytes[i];
+        out.low = (out.low << 8) | bytes[i + 8];
+    }
+    return out;
+}
+
+inline void aes_ghash_store(const aes_ghash_element& element, uint8_t* bytes) {
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = element.high >> (56 - 8 * i);
+        bytes[i + 8] = element.low >> (56 - 8 * i);
+    }
+}
+
+inline aes_ghash_element aes_ghash_multiply_by_x(aes_ghash_element v) {
+    uint64_t reduce = AES_GHASH_REDUCTION & (0 - (v.low & 1));
+    v.low = (v.low >> 1) | (v.high << 63);
+    v.high = (v.high >> 1) ^ reduce;
+    return v;
+}
+
+/**
+ * Multiplies one bit at a time (algorithm 1 of SP 800-38D) with masks instead of branches, so the time taken doesn't depend on either value.
+ */
+inline aes_ghash_element aes_ghash_multiply(const aes_ghash_element& x, const aes_ghash_element& y) {
+    aes_ghash_element z = {0, 0};
+    aes_ghash_element v = y;
+
+    for (int bit = 0; bit < 128; bit++) {
+        uint64_t word = bit < 64 ? x.high : x.low;
+        uint64_t mask = 0 - ((word >> (63 - bit % 64)) & 1);
+        z.high ^= v.high & mask;
+        z.low ^= v.low & mask;
+        v = aes_ghash_multiply_by_x(v);
+    }
+
+    return z;
+}
+
+/**
+ * When a value is multiplied by x^4 the four coefficients shifted off the end (x^124 to x^127) wrap around as x^0 to x^3 times the reduction.
+ * @return what to xor into the high half for every value of those four bits
+ */
+constexpr std::array<uint64_t, 16> aes_generate_ghash_reduction_table() {
+    std::array<uint64_t, 16> out = {};
+    for (int bits = 0; bits < 16; bits++) {
+        for (int bit = 0; bit < 4; bit++) {
+            if (bits & (1 << bit)) {
+                out[bits] ^= AES_GHASH_REDUCTION >> (3 - bit);
+            }
+        }
+    }
+    return out;
+}
+
+constexpr std::array<uint64_t, 16> aes_ghash_reduction_table = aes_generate_ghash_reduction_table();
+
+static_assert(aes_ghash_reduction_table[1] == 0x1c20000000000000 && aes_ghash_reduction_table[15] == 0xb5e0000000000000, "GHASH reduction table is wrong");
+
+/**
+ * How GHASH multiplies by H.
+ * AES_GHASH_TABLE is Shoup's method with a 16 entry table of multiples of H, four bits per lookup. The lookups depend on H and the data so it isn't constant time.
+ * AES_GHASH_CLMUL uses PCLMULQDQ, four blocks at a time with one reduction. Constant time.
+ * AES_GHASH_BITWISE is aes_ghash_multiply. Constant time but slow, used with the bitsliced engine when the CPU has no PCLMULQDQ.
+ */
+enum aes_ghash_method {
+    AES_GHASH_TABLE,
+    AES_GHASH_CLMUL,
+    AES_GHASH_BITWISE
+};
+
+/**
+ * @return true if the CPU has PCLMULQDQ (and SSSE3 for the byte shuffles)
+ */
+inline bool aes_clmul_supported() {
+#ifdef AES_HAS_AES_NI
+    static const bool supported = [] {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+        return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/**
+ * An AES key with everything GHASH needs precomputed from its hash key H = E(K, 0^128).
+ */
+struct aes_gcm_key {
+    aes_key key;
+    aes_ghash_method method;
+    aes_ghash_element h;
+    /// table[i] = i * H, where the top bit of i is the x^0 coefficient.
+    std::array<aes_ghash_element, 16> table;
+    /// H, H^2, H^3, H^4 for aggregating four blocks at once.
+    std::array<aes_ghash_element, 4> h_powers;
+};
+
+/**
+ * @param key - an expanded key
+ * @return the key with the GHASH tables for it
+ *
+ * PCLMULQDQ is used when the CPU has it. Otherwise the table method is used, except with the bitsliced engine where the point is to be constant time.
+ */
+inline aes_gcm_key aes_gcm_make_key(const aes_key& key) {
+    aes_gcm_key out = {};
+    out.key = key;
+
+    uint32_t zero_block[4] = {0, 0, 0, 0};
+    aes_encrypt_blocks(key, zero_block, 1);
+    out.h.high = ((uint64_t) zero_block[0] << 32) | zero_block[1];
+    out.h.low = ((uint64_t) zero_block[2] << 32) | zero_block[3];
+
+    if (aes_clmul_supported()) {
+        out.method = AES_GHASH_CLMUL;
+    }
+    else if (key.engine == AES_ENGINE_BITSLICE) {
+        out.method = AES_GHASH_BITWISE;
+    }
+    else {
+        out.method = AES_GHASH_TABLE;
+    }
+
+    /// The single bit entries are H times x^0 to x^3 and every other entry is a sum of those.
+    aes_ghash_element power = out.h;
+    for (int bit = 8; bit; bit >>= 1) {
+        out.table[bit] = power;
+        power = aes_ghash_multiply_by_x(power);
+    }
+    for (int i = 1; i < 16; i++) {
+        int top = 8;
+        while (!(i & top)) {
+            top >>= 1;
+        }
+        if (i != top) {
+            out.table[i].high = out.table[top].high ^ out.table[i ^ top].high;
+            out.table[i].low = out.table[top].low ^ out.table[i ^ top].low;
+        }
+    }
+
+    out.h_powers[0] = out.h;
+    for (int i = 1; i < 4; i++) {
+        out.h_powers[i] = aes_ghash_multiply(out.h_powers[i - 1], out.h);
+    }
+
+    return out;
+}
+
+/**
+ * Shoup's 4-bit method: Horner's rule over the nibbles of <b>x</b> from the last one, multiplying the running value by x^4 between lookups.
+ */
+inline aes_ghash_element aes_ghash_multiply_table(const aes_gcm_key& key, const aes_ghash_element& x) {
+    uint8_t bytes[16];
+    aes_ghash_store(x, bytes);
+
+    aes_ghash_element z = {0, 0};
+    for (int byte = 15; byte >= 0; byte--) {
+        /// The low nibble holds the later coefficients so it goes first.
+        for (int shift = 0; shift <= 4; shift += 4) {
+            uint8_t index = (bytes[byte] >> shift) & 0xf;
+
+            uint8_t carry = z.low & 0xf;
+            z.low = (z.low >> 4) | (z.high << 60);
+            z.high = (z.high >> 4) ^ aes_ghash_reduction_table[carry];
+
+            z.high ^= key.table[index].high;
+            z.low ^= key.table[index].low;
+        }
+    }
+
+    return z;
+}
+
+#ifdef AES_HAS_AES_NI
+
+/**
+ * Reversing the bytes of a block turns it into a 128-bit integer whose top bit is the x^0 coefficient, which is the same as loading the two halves of an aes_ghash_element.
+ */
+inline AES_CLMUL_TARGET __m128i aes_ghash_clmul_load(const aes_ghash_element& element) {
+    return _mm_set_epi64x((long long) element.high, (long long) element.low);
+}
+
+/**
+ * Adds the unreduced 256-bit product of <b>a</b> and <b>b</b> to <b>low</b> and <b>high</b>.
+ * Reduction is linear, so products can be summed first and reduced once.
+ */
+inline AES_CLMUL_TARGET void aes_ghash_clmul_multiply(__m128i a, __m128i b, __m128i& low, __m128i& high) {
+    __m128i product_low = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i product_high = _mm_clmulepi64_si128(a, b, 0x11);
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+
+    low = _mm_xor_si128(low, _mm_xor_si128(product_low, _mm_slli_si128(middle, 8)));
+    high = _mm_xor_si128(high, _mm_xor_si128(product_high, _mm_srli_si128(middle, 8)));
+}
+
+/**
+ * Source: Intel, "Intel Carry-Less Multiplication Instruction and its Usage for Computing the GCM Mode", algorithm 5.
+ * The product of two bit reflected values is reflected one bit short, so it is shifted left by one and then reduced with shifts instead of another multiply.
+ */
+inline AES_CLMUL_TARGET __m128i aes_ghash_clmul_reduce(__m128i low, __m128i high) {
+    __m128i low_carry = _mm_srli_epi32(low, 31);
+    __m128i high_carry = _mm_srli_epi32(high, 31);
+    low = _mm_slli_epi32(low, 1);
+    high = _mm_slli_epi32(high, 1);
+    __m128i across = _mm_srli_si128(low_carry, 12);
+    high_carry = _mm_slli_si128(high_carry, 4);
+    low_carry = _mm_slli_si128(low_carry, 4);
+    low = _mm_or_si128(low, low_carry);
+    high = _mm_or_si128(_mm_or_si128(high, high_carry), across);
+
+    __m128i a = _mm_slli_epi32(low, 31);
+    __m128i b = _mm_slli_epi32(low, 30);
+    __m128i c = _mm_slli_epi32(low, 25);
+    a = _mm_xor_si128(_mm_xor_si128(a, b), c);
+    __m128i a_high = _mm_srli_si128(a, 4);
+    a = _mm_slli_si128(a, 12);
+    low = _mm_xor_si128(low, a);
+
+    __m128i d = _mm_srli_epi32(low, 1);
+    __m128i e = _mm_srli_epi32(low, 2);
+    __m128i f = _mm_srli_epi32(low, 7);
+    d = _mm_xor_si128(_mm_xor_si128(d, e), _mm_xor_si128(f, a_high));
+    low = _mm_xor_si128(low, d);
+
+    return _mm_xor_si128(high, low);
+}
+
+/**
+ * Folds four blocks per reduction: X' = (X + C1) H^4 + C2 H^3 + C3 H^2 + C4 H.
+ * The four multiplies are independent, so they overlap in the pipeline instead of each waiting for the last one's result.
+ */
+inline AES_CLMUL_TARGET void aes_ghash_blocks_clmul(const aes_gcm_key& key, aes_ghash_element& x, const uint8_t* data, size_t blocks) {
+    const __m128i byte_reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i h1 = aes_ghash_clmul_load(key.h_powers[0]);
+    const __m128i h2 = aes_ghash_clmul_load(key.h_powers[1]);
+    const __m128i h3 = aes_ghash_clmul_load(key.h_powers[2]);
+    const __m128i h4 = aes_ghash_clmul_load(key.h_powers[3]);
+    __m128i state = aes_ghash_clmul_load(x);
+
+    size_t block = 0;
+    for (; block + 4 <= blocks; block += 4) {
+        const __m128i* input = (const __m128i*) (data + block * 16);
+        __m128i c1 = _mm_xor_si128(state, _mm_shuffle_epi8(_mm_loadu_si128(input), byte_reverse));
+        __m128i c2 = _mm_shuffle_epi8(_mm_loadu_si128(input + 1), byte_reverse);
+        __m128i c3 = _mm_shuffle_epi8(_mm_loadu_si128(input + 2), byte_reverse);
+        __m128i c4 = _mm_shuffle_epi8(_mm_loadu_si128(input + 3), byte_reverse);
+
+        __m128i low = _mm_setzero_si128();
+        __m128i high = _mm_setzero_si128();
+        aes_ghash_clmul_multiply(c1, h4, low, high);
+        aes_ghash_clmul_multiply(c2, h3, low, high);
+        aes_ghash_clmul_multiply(c3, h2, low, high);
+        aes_ghash_clmul_multiply(c4, h1, low, high);
+        state = aes_ghash_clmul_reduce(low, high);
+    }
+    for (; block < blocks; block++) {
+        __m128i c = _mm_xor_si128(state, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + block * 16)), byte_reverse));
+
+        __m128i low = _mm_setzero_si128();
+        __m128i high = _mm_setzero_si128();
+        aes_ghash_clmul_multiply(c, h1, low, high);
+        state = aes_ghash_clmul_reduce(low, high);
+    }
+
+    uint64_t halves[2];
+    _mm_storeu_si128((__m128i*) halves, state);
+    x.low = halves[0];
+    x.high = halves[1];
+}
+
+#endif
+
+/**
+ * @param key - the GCM key
+ * @param x - the running GHASH value, updated in place
+ * @param data - whole 16 byte blocks
+ * @param blocks - the number of blocks
+ */
+inline void aes_ghash_blocks(const aes_gcm_key& key, aes_ghash_element& x, const uint8_t* data, size_t blocks) {
+#ifdef AES_HAS_AES_NI
+    if (key.method == AES_GHASH_CLMUL) {
+        aes_ghash_blocks_clmul(key, x, data, blocks);
+        return;
+    }
+#endif
+    for (size_t block = 0; block < blocks; block++) {
+        aes_ghash_element c = aes_ghash_load(data + block * 16);
+        x.high ^= c.high;
+        x.low ^= c.low;
+        x = key.method == AES_GHASH_TABLE ? aes_ghash_multiply_table(key, x) : aes_ghash_multiply(x, key.h);
+    }
+}
+
+/**
+ * Like aes_ghash_blocks but takes any length, padding the last block with zeros the way GCM pads the AAD and the ciphertext.
+ * Only the last call for a given input may have a length that isn't a multiple of 16.
+ */
+inline void aes_ghash_update(const aes_gcm_key& key, aes_ghash_element& x, const uint8_t* data, size_t length) {
+    aes_ghash_blocks(key, x, data, length / 16);
+
+    size_t remainder = length % 16;
+    if (remainder) {
+        uint8_t last[16] = {};
+        std::memcpy(last, data + length - remainder, remainder);
+        aes_ghash_blocks(key, x, last, 1);
+    }
+}
+
+/**
+ * Hashes the final block holding the bit lengths of the AAD and the ciphertext.
+ */
+inline void aes_ghash_lengths(const aes_gcm_key& key, aes_ghash_element& x, uint64_t first_bytes, uint64_t second_bytes) {
+    aes_ghash_element lengths = {first_bytes * 8, second_bytes * 8};
+    uint8_t block[16];
+    aes_ghash_store(lengths, block);
+    aes_ghash_blocks(key, x, block, 1);
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector. 12 bytes is the fast and recommended size, any other non-zero size goes through GHASH.
+ * @param iv_length - the size of the IV in bytes
+ * @return the pre-counter block J0 as a CTR counter with a 32 bit counter, so block 0 is J0 (used for the tag) and block 1 onwards is the key stream
+ */
+inline aes_ctr_counter aes_gcm_get_counter(const aes_gcm_key& key, const uint8_t* iv, size_t iv_length) {
+    if (iv_length == 0) {
+        std::cerr << "AES GCM ERROR: The IV can't be empty";
+        exit(8);
+    }
+
+    uint8_t j0[16] = {};
+    if (iv_length == 12) {
+        std::memcpy(j0, iv, 12);
+        j0[15] = 1;
+    }
+    else {
+        aes_ghash_element x = {0, 0};
+        aes_ghash_update(key, x, iv, iv_length);
+        aes_ghash_lengths(key, x, 0, iv_length);
+        aes_ghash_store(x, j0);
+    }
+
+    return aes_ctr_make_counter(std::as_bytes(std::span<const uint8_t, 16>(j0)), 32);
+}
+
+/// How many bytes are encrypted before they are hashed. Small enough that the ciphertext is still in L1 when GHASH reads it, and a multiple of 16 so only the last chunk needs padding.
+const size_t AES_GCM_CHUNK_BYTES = AES_CTR_PARALLEL_BLOCKS * 16;
+
+/**
+ * Writes E(K, J0) xor the GHASH value to <b>tag</b>, which is block 0 of the counter's key stream xored with the value.
+ */
+inline void aes_gcm_get_tag(const aes_gcm_key& key, const aes_ctr_counter& counter, const aes_ghash_element& x, uint8_t* tag) {
+    aes_ghash_store(x, tag);
+    aes_ctr_process(key.key, counter, 0, tag, tag, 16);
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector, which must never be reused with the same key
+ * @param iv_length - the size of the IV in bytes
+ * @param aad - additional data that is authenticated but not encrypted
+ * @param aad_length - the size of the additional data in bytes
+ * @param input - the message
+ * @param output - receives the ciphertext, may be the same as <b>input</b>
+ * @param length - the size of the message in bytes
+ * @param tag - receives the 16 byte authentication tag
+ *
+ * Encryption and hashing are done together a chunk at a time, so the message is only brought into cache once.
+ */
+inline void aes_gcm_encrypt_process(const aes_gcm_key& key, const uint8_t* iv, size_t iv_length, const uint8_t* aad, size_t aad_length, const uint8_t* input, uint8_t* output, size_t length, uint8_t* tag) {
+    AES_INSTRUMENT_CALL(AES_CALL_GCM_ENCRYPT);
+    aes_ctr_counter counter = aes_gcm_get_counter(key, iv, iv_length);
+
+    aes_ghash_element x = {0, 0};
+    aes_ghash_update(key, x, aad, aad_length);
+
+    for (size_t position = 0; position < length; position += AES_GCM_CHUNK_BYTES) {
+        size_t count = std::min(AES_GCM_CHUNK_BYTES, length - position);
+        aes_ctr_process(key.key, counter, 16 + position, input + position, output + position, count);
+        aes_ghash_update(key, x, output + position, count);
+    }
+    aes_ghash_lengths(key, x, aad_length, length);
+
+    aes_gcm_get_tag(key, counter, x, tag);
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector used to encrypt
+ * @param iv_length - the size of the IV in bytes
+ * @param aad - the additional data given when encrypting
+ * @param aad_length - the size of the additional data in bytes
+ * @param input - the ciphertext
+ * @param output - receives the message, may be the same as <b>input</b>. Zeroed if the tag doesn't match.
+ * @param length - the size of the ciphertext in bytes
+ * @param tag - the authentication tag
+ * @param tag_length - the size of the tag, which may be truncated to as few as 4 bytes
+ * @return true if the tag matches
+ *
+ * The tag is compared without an early exit so the time taken doesn't reveal how much of it was right.
+ */
+inline bool aes_gcm_decrypt_process(const aes_gcm_key& key, const uint8_t* iv, size_t iv_length, const uint8_t* aad, size_t aad_length, const uint8_t* input, uint8_t* output, size_t length, const uint8_t* tag, size_t tag_length) {
+    AES_INSTRUMENT_CALL(AES_CALL_GCM_DECRYPT);
+    if (tag_length < 4 || tag_length > 16) {
+        std::cerr << "AES GCM ERROR: Tag size of " << tag_length << " is invalid it must be between 4 and 16";
+        exit(8);
+    }
+
+    aes_ctr_counter counter = aes_gcm_get_counter(key, iv, iv_length);
+
+    aes_ghash_element x = {0, 0};
+    aes_ghash_update(key, x, aad, aad_length);
+
+    for (size_t position = 0; position < length; position += AES_GCM_CHUNK_BYTES) {
+        size_t count = std::min(AES_GCM_CHUNK_BYTES, length - position);
+        aes_ghash_update(key, x, input + position, count);
+        aes_ctr_process(key.key, counter, 16 + position, input + position, output + position, count);
+    }
+    aes_ghash_lengths(key, x, aad_length, length);
+
+    uint8_t expected[16];
+    aes_gcm_get_tag(key, counter, x, expected);
+    if (!aes_constant_time_equal(expected, tag, tag_length)) {
+        std::fill(output, output + length, 0);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector, which must never be reused with the same key
+ * @param plaintext - the message
+ * @param aad - additional data that is authenticated but not encrypted
+ * @param tag - receives the 16 byte authentication tag
+ * @return the ciphertext, which is the same length as <b>plaintext</b>
+ */
+inline std::string aes_gcm_encrypt(const aes_gcm_key& key, const std::string& iv, const std::string& plaintext, const std::string& aad, std::string& tag) {
+    std::string out(plaintext.size(), 0);
+    tag.resize(16);
+    aes_gcm_encrypt_process(key, (const uint8_t*) iv.data(), iv.size(), (const uint8_t*) aad.data(), aad.size(), (const uint8_t*) plaintext.data(), (uint8_t*) out.data(), out.size(), (uint8_t*) tag.data());
+
+    return out;
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector used to encrypt
+ * @param ciphertext - the encrypted message
+ * @param aad - the additional data given when encrypting
+ * @param tag - the authentication tag, which may be truncated to as few as 4 bytes
+ * @param plaintext - receives the message, or is cleared if the tag doesn't match
+ * @return true if the tag matches
+ */
+inline bool aes_gcm_decrypt(const aes_gcm_key& key, const std::string& iv, const std::string& ciphertext, const std::string& aad, const std::string& tag, std::string& plaintext) {
+    plaintext.assign(ciphertext.size(), 0);
+    if (!aes_gcm_decrypt_process(key, (const uint8_t*) iv.data(), iv.size(), (const uint8_t*) aad.data(), aad.size(), (const uint8_t*) ciphertext.data(), (uint8_t*) plaintext.data(), plaintext.size(), (const uint8_t*) tag.data(), tag.size())) {
+        plaintext.clear();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Checks the output span of one of the span functions below is big enough for the input.
+ */
+inline void aes_verify_output_size(size_t input_size, size_t output_size) {
+    if (output_size < input_size) {
+        std::cerr << "AES ERROR: Output size of " << output_size << " is too small for an input of " << input_size;
+        exit(10);
+    }
+}
+
+/*
+ * The functions below work on byte spans and never allocate, so they can be used where the string functions' copies would be too slow.
+ * The output can be the same span as the input to work in place, but the two mustn't otherwise overlap. Only the first input.size() bytes of the output are written.
+ */
+
+/**
+ * @param key - an expanded key
+ * @param input - whole blocks to encrypt
+ * @param output - receives the ciphertext
+ */
+inline void aes_ecb_encrypt(const aes_key& key, std::span<const std::byte> input, std::span<std::byte> output) {
+    aes_verify_output_size(input.size(), output.size());
+    aes_ecb_encrypt_process(key, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+/**
+ * @param key - an expanded key
+ * @param input - whole blocks to decrypt
+ * @param output - receives the plaintext
+ */
+inline void aes_ecb_decrypt(const aes_key& key, std::span<const std::byte> input, std::span<std::byte> output) {
+    aes_verify_output_size(input.size(), output.size());
+    aes_ecb_decrypt_process(key, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+/**
+ * @param key - an expanded key
+ * @param iv - the initialization vector
+ * @param input - whole blocks to encrypt, no padding is added
+ * @param output - receives the ciphertext
+ */
+inline void aes_cbc_encrypt(const aes_key& key, std::span<const std::byte, 16> iv, std::span<const std::byte> input, std::span<std::byte> output) {
+    aes_verify_output_size(input.size(), output.size());
+
+    std::array<uint32_t, 4> chaining;
+    aes_load_blocks((const uint8_t*) iv.data(), chaining.data(), 1);
+    aes_cbc_encrypt_process(key, chaining, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+/**
+ * @param key - an expanded key
+ * @param iv - the initialization vector used to encrypt
+ * @param input - whole blocks to decrypt
+ * @param output - receives the plaintext
+ */
+inline void aes_cbc_decrypt(const aes_key& key, std::span<const std::byte, 16> iv, std::span<const std::byte> input, std::span<std::byte> output) {
+    aes_verify_output_size(input.size(), output.size());
+
+    std::array<uint32_t, 4> chaining;
+    aes_load_blocks((const uint8_t*) iv.data(), chaining.data(), 1);
+    aes_cbc_decrypt_process(key, chaining, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+/**
+ * @param key - an expanded key
+ * @param counter - the counter layout
+ * @param input - the bytes to encrypt or decrypt
+ * @param output - receives the result
+ * @param offset - where in the key stream <b>input</b> starts, in bytes
+ */
+inline void aes_ctr(const aes_key& key, const aes_ctr_counter& counter, std::span<const std::byte> input, std::span<std::byte> output, uint64_t offset = 0) {
+    aes_verify_output_size(input.size(), output.size());
+    aes_ctr_process(key, counter, offset, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector, which must never be reused with the same key
+ * @param aad - additional data that is authenticated but not encrypted
+ * @param input - the message
+ * @param output - receives the ciphertext
+ * @param tag - receives the authentication tag
+ */
+inline void aes_gcm_encrypt(const aes_gcm_key& key, std::span<const std::byte> iv, std::span<const std::byte> aad, std::span<const std::byte> input, std::span<std::byte> output, std::span<std::byte, 16> tag) {
+    aes_verify_output_size(input.size(), output.size());
+    aes_gcm_encrypt_process(key, (const uint8_t*) iv.data(), iv.size(), (const uint8_t*) aad.data(), aad.size(), (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size(), (uint8_t*) tag.data());
+}
+
+/**
+ * @param key - the GCM key
+ * @param iv - the initialization vector used to encrypt
+ * @param aad - the additional data given when encrypting
+ * @param input - the ciphertext
+ * @param output - receives the message, zeroed if the tag doesn't match
+ * @param tag - the authentication tag, 4 to 16 bytes
+ * @return true if the tag matches
+ */
+inline bool aes_gcm_decrypt(const aes_gcm_key& key, std::span<const std::byte> iv, std::span<const std::byte> aad, std::span<const std::byte> input, std::span<std::byte> output, std::span<const std::byte> tag) {
+    aes_verify_output_size(input.size(), output.size());
+    return aes_gcm_decrypt_process(key, (const uint8_t*) iv.data(), iv.size(), (const uint8_t*) aad.data(), aad.size(), (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size(), (const uint8_t*) tag.data(), tag.size());
+}
+
+/**
+ * How the last block of a message is filled out. ISO/IEC 7816-4 adds 0x80 and then zeros, the scheme aes_encrypt and the command line tool use, and PKCS#7 adds n bytes
+ * of value n, which is what OpenSSL uses. Both always add at least one byte, so a message that already ends on a block boundary gets a whole block of padding and the padding
+ * can always be found again. AES_PADDING_NONE only takes whole blocks.
+ */
+enum aes_padding {
+    AES_PADDING_ISO_7816_4,
+    AES_PADDING_PKCS7,
+    AES_PADDING_NONE
+};
+
+/**
+ * @param padding - the padding scheme, not AES_PADDING_NONE
+ * @param block - 16 bytes of which the first <b>length</b> are the end of the message, the rest are overwritten with padding
+ * @param length - less than 16
+ */
+inline void aes_pad_block(aes_padding padding, uint8_t* block, size_t length) {
+    if (padding == AES_PADDING_PKCS7) {
+        std::fill(block + length, block + 16, (uint8_t) (16 - length));
+    }
+    else {
+        block[length] = 0x80;
+        std::fill(block + length + 1, block + 16, 0);
+    }
+}
+
+/**
+ * @param padding - the padding scheme, not AES_PADDING_NONE
+ * @param block - the decrypted last block
+ * @param length - receives how much of the block is message
+ * @return false if the padding is invalid
+ *
+ * The padding is checked without branching on the block's bytes. When a server reports bad padding any faster than other errors, the timing alone lets an attacker decrypt CBC messages.
+ */
+inline bool aes_unpad_block(aes_padding padding, const uint8_t* block, size_t& length) {
+    uint32_t valid = 0, found = 0;
+
+    if (padding == AES_PADDING_PKCS7) {
+        uint32_t count = block[15];
+        /// Between 1 and 16, with 0 wrapping around to a big number.
+        valid = (count - 1) < 16;
+        uint32_t difference = 0;
+        for (uint32_t index = 0; index < 16; index++) {
+            /// All ones for the last count bytes.
+            uint32_t in_padding = 0u - ((15 - index - count) >> 31);
+            difference |= in_padding & (block[index] ^ count);
+        }
+        valid &= ((difference + 0xff) >> 8) ^ 1;
+        found = 16 - (count & 0x1f);
+    }
+    else {
+        /// The padding ends at the last nonzero byte, which has to be 0x80.
+        uint32_t seen = 0;
+        for (int index = 15; index >= 0; index--) {
+            uint32_t byte = block[index];
+            uint32_t nonzero = (byte + 0xff) >> 8;
+            uint32_t first = nonzero & (seen ^ 1);
+            valid |= first & ((((byte ^ 0x80) + 0xff) >> 8) ^ 1);
+            found |= (0u - first) & index;
+            seen |= nonzero;
+        }
+    }
+
+    length = valid ? found : 0;
+    return valid;
+}
+
+/**
+ * The modes aes_stream_context can run.
+ */
+enum aes_stream_mode {
+    AES_STREAM_ECB,
+    AES_STREAM_CBC,
+    AES_STREAM_CTR
+};
+
+/**
+ * Encrypts or decrypts a message that arrives in pieces of any size without holding on to more than one block of it.
+ * The constructor is the init step, update takes each piece as it comes and finalize adds or removes the padding.
+ *
+ * ECB and CBC process every whole block as soon as it is complete. Decrypting with padding holds back the last whole block, since it might be the one with the padding.
+ * CTR needs no padding and passes every byte straight through, keeping the rest of the last key stream block for the next piece.
+ */
+struct aes_stream_context {
+    /**
+     * @param key - an expanded key, copied into the context
+     * @param mode - the block cipher mode
+     * @param decrypt - decrypt instead of encrypt
+     * @param iv - 16 bytes: the IV for CBC, or the initial counter block for CTR with the last 32 bits counting. Not used by ECB.
+     * @param padding - the padding for ECB and CBC. Not used by CTR.
+     */
+    aes_stream_context(const aes_key& key, aes_stream_mode mode, bool decrypt, std::span<const std::byte> iv = {}, aes_padding padding = AES_PADDING_ISO_7816_4)
+        : key(key), mode(mode), decrypt(decrypt), padding(padding) {
+        if (mode != AES_STREAM_ECB && iv.size() != 16) {
+            std::cerr << "AES STREAM ERROR: IV size of " << iv.size() << " is invalid it must be 16";
+            exit(11);
+        }
+
+        if (mode == AES_STREAM_CBC) {
+            aes_load_blocks((const uint8_t*) iv.data(), chaining.data(), 1);
+        }
+        else if (mode == AES_STREAM_CTR) {
+            counter = aes_ctr_make_counter(std::span<const std::byte, 16>(iv.data(), 16));
+        }
+    }
+
+    ~aes_stream_context() {
+        aes_secure_zero(&key, sizeof(key));
+        aes_secure_zero(buffer, sizeof(buffer));
+        aes_secure_zero(chaining.data(), sizeof(chaining));
+    }
+
+    aes_stream_context(const aes_stream_context&) = delete;
+    aes_stream_context& operator=(const aes_stream_context&) = delete;
+
+    /**
+     * @param input - the next piece of the message
+     * @param output - receives the result, which is at most input.size() + 15 bytes. It mustn't overlap <b>input</b>, except in CTR mode where it can be the same span.
+     * @return how many bytes were written to <b>output</b>
+     */
+    size_t update(std::span<const std::byte> input, std::span<std::byte> output) {
+        verify_not_finished();
+        const uint8_t* in = (const uint8_t*) input.data();
+        uint8_t* out = (uint8_t*) output.data();
+        size_t length = input.size();
+
+        if (mode == AES_STREAM_CTR) {
+            aes_verify_output_size(length, output.size());
+            update_ctr(in, out, length);
+            return length;
+        }
+
+        size_t ready = (buffered + length) / 16 * 16;
+        if (decrypt && padding != AES_PADDING_NONE && ready == buffered + length && ready) {
+            ready -= 16;
+        }
+        aes_verify_output_size(ready, output.size());
+
+        size_t written = 0;
+        if (buffered && ready) {
+            size_t take = 16 - buffered;
+            std::memcpy(buffer + buffered, in, take);
+            in += take;
+            length -= take;
+            process(buffer, out, 16);
+            buffered = 0;
+            written = 16;
+        }
+
+        process(in, out + written, ready - written);
+        in += ready - written;
+        length -= ready - written;
+
+        std::memcpy(buffer + buffered, in, length);
+        buffered += length;
+        return ready;
+    }
+
+    /**
+     * @param output - receives the end of the message: 16 bytes when encrypting with padding, at most 15 when decrypting with it, and nothing otherwise
+     * @param length - receives how many bytes were written to <b>output</b>
+     * @return false if the padding is invalid when decrypting, in which case nothing is written. The key, IV or mode is probably wrong or the message was changed.
+     *
+     * The context is finished afterwards.
+     */
+    bool finalize(std::span<std::byte> output, size_t& length) {
+        verify_not_finished();
+        finished = true;
+        length = 0;
+
+        if (mode == AES_STREAM_CTR) {
+            aes_secure_zero(key_stream, sizeof(key_stream));
+            return true;
+        }
+
+        const char* mode_name = mode == AES_STREAM_ECB ? "ECB" : "CBC";
+        if (padding == AES_PADDING_NONE) {
+            aes_verify_block_length(mode_name, buffered);
+            return true;
+        }
+
+        if (!decrypt) {
+            aes_verify_output_size(16, output.size());
+            aes_pad_block(padding, buffer, buffered);
+            process(buffer, (uint8_t*) output.data(), 16);
+            aes_secure_zero(buffer, sizeof(buffer));
+            length = 16;
+            return true;
+        }
+
+        /// Anything but one held back block means the ciphertext wasn't a whole number of blocks, or was empty.
+        if (buffered != 16) {
+            aes_secure_zero(buffer, sizeof(buffer));
+            return false;
+        }
+        process(buffer, buffer, 16);
+        size_t message_length;
+        bool valid = aes_unpad_block(padding, buffer, message_length);
+        if (valid) {
+            aes_verify_output_size(message_length, output.size());
+            std::memcpy(output.data(), buffer, message_length);
+            length = message_length;
+        }
+        aes_secure_zero(buffer, sizeof(buffer));
+        return valid;
+    }
+
+private:
+    void verify_not_finished() const {
+        if (finished) {
+            std::cerr << "AES STREAM ERROR: The context was already finalized";
+            exit(11);
+        }
+    }
+
+    /// Whole blocks through the block cipher mode.
+    void process(const uint8_t* input, uint8_t* output, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (mode == AES_STREAM_ECB) {
+            decrypt ? aes_ecb_decrypt_process(key, input, output, length) : aes_ecb_encrypt_process(key, input, output, length);
+        }
+        else {
+            decrypt ? aes_cbc_decrypt_process(key, chaining, input, output, length) : aes_cbc_encrypt_process(key, chaining, input, output, length);
+        }
+    }
+
+    void update_ctr(const uint8_t* input, uint8_t* output, size_t length) {
+        /// Finish the key stream block the last piece stopped in.
+        size_t used = std::min(length, key_stream_left);
+        for (size_t index = 0; index < used; index++) {
+            output[index] = input[index] ^ key_stream[16 - key_stream_left + index];
+        }
+        key_stream_left -= used;
+        offset += used;
+        input += used;
+        output += used;
+        length -= used;
+
+        size_t whole = length / 16 * 16;
+        aes_ctr_process(key, counter, offset, input, output, whole);
+        offset += whole;
+
+        size_t tail = length - whole;
+        if (tail) {
+            /// Keep the key stream for the rest of this block. It starts on a block boundary since the previous block was used up.
+            std::memset(key_stream, 0, 16);
+            aes_ctr_process(key, counter, offset, key_stream, key_stream, 16);
+            for (size_t index = 0; index < tail; index++) {
+                output[whole + index] = input[whole + index] ^ key_stream[index];
+            }
+            key_stream_left = 16 - tail;
+            offset += tail;
+        }
+    }
+
+    aes_key key;
+    aes_stream_mode mode;
+    bool decrypt;
+    aes_padding padding;
+    bool finished = false;
+
+    /// ECB and CBC: the part of a block that hasn't been processed yet, or the held back block.
+    uint8_t buffer[16] = {};
+    size_t buffered = 0;
+    std::array<uint32_t, 4> chaining = {};
+
+    /// CTR: the counter, where the next byte is in the key stream and what's left of the current key stream block.
+    aes_ctr_counter counter = {};
+    uint64_t offset = 0;
+    uint8_t key_stream[16] = {};
+    size_t key_stream_left = 0;
+};
+
+/**
+ * One message of a multi-key batch.
+ */
+struct aes_batch_item {
+    /// 16, 24 or 32 bytes.
+    std::span<const std::byte> key;
+    /// The 16 byte CTR counter block for the first block of the message. The last 32 bits count up, like aes_ctr_make_counter's default.
+    std::span<const std::byte> counter_block;
+    std::span<const std::byte> input;
+    /// At least as big as <b>input</b>, may be the same span.
+    std::span<std::byte> output;
+};
+
+/**
+ * One message of a batch whose key is already expanded, for callers that keep keys around (e.g. in an aes_key_cache) instead of expanding them every time.
+ */
+struct aes_expanded_batch_item {
+    /// Must stay alive until aes_ctr_batch returns.
+    const aes_key* key;
+    /// The 16 byte CTR counter block for the first block of the message, with a 32-bit counter like aes_batch_item.
+    std::span<const std::byte> counter_block;
+    std::span<const std::byte> input;
+    /// At least as big as <b>input</b>, may be the same span.
+    std::span<std::byte> output;
+};
+
+/// How many keys are expanded together and how many blocks go through the multi-key AES-NI kernel at once.
+const size_t AES_BATCH_LANES = 8;
+
+#ifdef AES_HAS_AES_NI
+
+/**
+ * One step of the 128-bit key schedule for every lane. The schedule of a single key is a chain where every step waits on AESKEYGENASSIST from the step before,
+ * so the lanes are stepped together to give the unit independent work.
+ */
+template <int round_constant>
+AES_NI_TARGET AES_ALWAYS_INLINE void aes_ni_batch_step_128(__m128i* const* round_keys, size_t lanes, int round) {
+    for (size_t lane = 0; lane < lanes; lane++) {
+        __m128i previous = round_keys[lane][round - 1];
+        round_keys[lane][round] = aes_ni_key_expansion_step(previous, _mm_aeskeygenassist_si128(previous, round_constant));
+    }
+}
+
+/**
+ * Two steps of the 256-bit key schedule for every lane: a round key with the round constant and one with just SubWord.
+ */
+template <int round_constant>
+AES_NI_TARGET AES_ALWAYS_INLINE void aes_ni_batch_step_256(__m128i* const* round_keys, size_t lanes, int round) {
+    for (size_t lane = 0; lane < lanes; lane++) {
+        __m128i* w = round_keys[lane];
+        w[round] = aes_ni_key_expansion_step(w[round - 2], _mm_aeskeygenassist_si128(w[round - 1], round_constant));
+        if (round + 1 < 15) {
+            w[round + 1] = aes_ni_key_expansion_step_sub_word(w[round - 1], _mm_aeskeygenassist_si128(w[round], 0x00));
+        }
+    }
+}
+
+/**
+ * @param keys - <b>lanes</b> keys of 16 bytes
+ * @param lanes - at most AES_BATCH_LANES
+ * @param round_keys - where to write the 11 round keys of each key, in byte order
+ */
+inline AES_NI_TARGET void aes_ni_batch_expand_128(const uint8_t* const* keys, size_t lanes, __m128i* const* round_keys) {
+    for (size_t lane = 0; lane < lanes; lane++) {
+        round_keys[lane][0] = _mm_loadu_si128((const __m128i*) keys[lane]);
+    }
+    aes_ni_batch_step_128<0x01>(round_keys, lanes, 1);
+    aes_ni_batch_step_128<0x02>(round_keys, lanes, 2);
+    aes_ni_batch_step_128<0x04>(round_keys, lanes, 3);
+    aes_ni_batch_step_128<0x08>(round_keys, lanes, 4);
+    aes_ni_batch_step_128<0x10>(round_keys, lanes, 5);
+    aes_ni_batch_step_128<0x20>(round_keys, lanes, 6);
+    aes_ni_batch_step_128<0x40>(round_keys, lanes, 7);
+    aes_ni_batch_step_128<0x80>(round_keys, lanes, 8);
+    aes_ni_batch_step_128<0x1b>(round_keys, lanes, 9);
+    aes_ni_batch_step_128<0x36>(round_keys, lanes, 10);
+}
+
+/**
+ * @param keys - <b>lanes</b> keys of 32 bytes
+ * @param lanes - at most AES_BATCH_LANES
+ * @param round_keys - where to write the 15 round keys of each key, in byte order
+ */
+inline AES_NI_TARGET void aes_ni_batch_expand_256(const uint8_t* const* keys, size_t lanes, __m128i* const* round_keys) {
+    for (size_t lane = 0; lane < lanes; lane++) {
+        round_keys[lane][0] = _mm_loadu_si128((const __m128i*) keys[lane]);
+        round_keys[lane][1] = _mm_loadu_si128((const __m128i*) (keys[lane] + 16));
+    }
+    aes_ni_batch_step_256<0x01>(round_keys, lanes, 2);
+    aes_ni_batch_step_256<0x02>(round_keys, lanes, 4);
+    aes_ni_batch_step_256<0x04>(round_keys, lanes, 6);
+    aes_ni_batch_step_256<0x08>(round_keys, lanes, 8);
+    aes_ni_batch_step_256<0x10>(round_keys, lanes, 10);
+    aes_ni_batch_step_256<0x20>(round_keys, lanes, 12);
+    aes_ni_batch_step_256<0x40>(round_keys, lanes, 14);
+}
+
+/**
+ * Encrypts AES_BATCH_LANES blocks that each have their own key, interleaved round by round like aes_encrypt_blocks_aes_ni.
+ * @param blocks - the blocks in byte order, replaced with the encrypted blocks
+ * @param round_keys - the round keys for each block, which all have <b>rounds</b> rounds
+ */
+template <uint8_t rounds>
+inline AES_NI_TARGET void aes_ni_encrypt_multi_key(__m128i* blocks, const __m128i* const* round_keys) {
+#pragma GCC unroll 8
+    for (size_t lane = 0; lane < AES_BATCH_LANES; lane++) {
+        blocks[lane] = _mm_xor_si128(blocks[lane], round_keys[lane][0]);
+    }
+#pragma GCC unroll 16
+    for (int round = 1; round < rounds; round++) {
+#pragma GCC unroll 8
+        for (size_t lane = 0; lane < AES_BATCH_LANES; lane++) {
+            blocks[lane] = _mm_aesenc_si128(blocks[lane], round_keys[lane][round]);
+        }
+    }
+#pragma GCC unroll 8
+    for (size_t lane = 0; lane < AES_BATCH_LANES; lane++) {
+        blocks[lane] = _mm_aesenclast_si128(blocks[lane], round_keys[lane][rounds]);
+    }
+}
+
+/**
+ * Blocks waiting for the multi-key kernel. Blocks are queued by key size since every lane of the kernel has to do the same number of rounds.
+ */
+struct aes_ni_batch_queue {
+    size_t count = 0;
+    __m128i blocks[AES_BATCH_LANES];
+    const __m128i* round_keys[AES_BATCH_LANES];
+    const uint8_t* input[AES_BATCH_LANES];
+    uint8_t* output[AES_BATCH_LANES];
+    size_t length[AES_BATCH_LANES];
+};
+
+/**
+ * Runs the queued counter blocks through the kernel and xors the key stream into their messages. Unused lanes repeat the first block.
+ */
+template <uint8_t rounds>
+inline AES_NI_TARGET void aes_ni_batch_flush(aes_ni_batch_queue& queue) {
+    if (queue.count == 0) {
+        return;
+    }
+    for (size_t lane = queue.count; lane < AES_BATCH_LANES; lane++) {
+        queue.blocks[lane] = queue.blocks[0];
+        queue.round_keys[lane] = queue.round_keys[0];
+    }
+
+    aes_ni_encrypt_multi_key<rounds>(queue.blocks, queue.round_keys);
+
+    for (size_t lane = 0; lane < queue.count; lane++) {
+        if (queue.length[lane] == 16) {
+            __m128i data = _mm_loadu_si128((const __m128i*) queue.input[lane]);
+            _mm_storeu_si128((__m128i*) queue.output[lane], _mm_xor_si128(data, queue.blocks[lane]));
+        }
+        else {
+            uint8_t key_stream[16];
+            _mm_storeu_si128((__m128i*) key_stream, queue.blocks[lane]);
+            for (size_t i = 0; i < queue.length[lane]; i++) {
+                queue.output[lane][i] = queue.input[lane][i] ^ key_stream[i];
+            }
+        }
+    }
+    queue.count = 0;
+}
+
+template <uint8_t rounds>
+inline AES_NI_TARGET void aes_ni_batch_push(aes_ni_batch_queue& queue, const __m128i* round_keys, const uint8_t* counter_block, uint32_t block_index, const uint8_t* input, uint8_t* output, size_t length) {
+    uint8_t counter[16];
+    std::memcpy(counter, counter_block, 16);
+    uint32_t count = (((uint32_t) counter[12] << 24) | ((uint32_t) counter[13] << 16) | ((uint32_t) counter[14] << 8) | counter[15]) + block_index;
+    counter[12] = count >> 24;
+    counter[13] = count >> 16;
+    counter[14] = count >> 8;
+    counter[15] = count;
+
+    size_t lane = queue.count++;
+    queue.blocks[lane] = _mm_loadu_si128((const __m128i*) counter);
+    queue.round_keys[lane] = round_keys;
+    queue.input[lane] = input;
+    queue.output[lane] = output;
+    queue.length[lane] = length;
+
+    if (queue.count == AES_BATCH_LANES) {
+        aes_ni_batch_flush<rounds>(queue);
+    }
+}
+
+/**
+ * Queues every block of one message. <b>queues</b> has one queue per key size, in the order 128, 192, 256.
+ */
+inline AES_NI_TARGET void aes_ni_batch_push_message(aes_ni_batch_queue* queues, const __m128i* round_keys, uint8_t rounds, std::span<const std::byte> counter_block, std::span<const std::byte> input, std::span<std::byte> output) {
+    const uint8_t* counter = (const uint8_t*) counter_block.data();
+    const uint8_t* in = (const uint8_t*) input.data();
+    uint8_t* out = (uint8_t*) output.data();
+
+    for (size_t position = 0; position < input.size(); position += 16) {
+        size_t length = std::min<size_t>(16, input.size() - position);
+        uint32_t block_index = position / 16;
+        if (rounds == aes_key_size<16>::rounds) {
+            aes_ni_batch_push<10>(queues[0], round_keys, counter, block_index, in + position, out + position, length);
+        }
+        else if (rounds == aes_key_size<24>::rounds) {
+            aes_ni_batch_push<12>(queues[1], round_keys, counter, block_index, in + position, out + position, length);
+        }
+        else {
+            aes_ni_batch_push<14>(queues[2], round_keys, counter, block_index, in + position, out + position, length);
+        }
+    }
+}
+
+inline AES_NI_TARGET void aes_ni_batch_flush_all(aes_ni_batch_queue* queues) {
+    aes_ni_batch_flush<10>(queues[0]);
+    aes_ni_batch_flush<12>(queues[1]);
+    aes_ni_batch_flush<14>(queues[2]);
+}
+
+/**
+ * The AES-NI side of aes_ctr_batch. Works through the items AES_BATCH_LANES at a time: their keys are expanded together, then all of their blocks go through the multi-key kernel,
+ * so blocks from different messages share the pipeline the same way the blocks of one long message do.
+ */
+inline AES_NI_TARGET void aes_ni_ctr_batch(std::span<const aes_batch_item> items) {
+    __m128i round_keys[AES_BATCH_LANES][15];
+    aes_ni_batch_queue queues[3];
+
+    for (size_t first = 0; first < items.size(); first += AES_BATCH_LANES) {
+        size_t lanes = std::min(AES_BATCH_LANES, items.size() - first);
+
+        /// Gather the keys of each size so each size's expansion runs in lockstep.
+        const uint8_t* keys_128[AES_BATCH_LANES];
+        const uint8_t* keys_256[AES_BATCH_LANES];
+        __m128i* round_keys_128[AES_BATCH_LANES];
+        __m128i* round_keys_256[AES_BATCH_LANES];
+        size_t lanes_128 = 0, lanes_256 = 0;
+        for (size_t lane = 0; lane < lanes; lane++) {
+            const aes_batch_item& item = items[first + lane];
+            const uint8_t* key = (const uint8_t*) item.key.data();
+            if (item.key.size() == 16) {
+                keys_128[lanes_128] = key;
+                round_keys_128[lanes_128++] = round_keys[lane];
+            }
+            else if (item.key.size() == 32) {
+                keys_256[lanes_256] = key;
+                round_keys_256[lanes_256++] = round_keys[lane];
+            }
+            else {
+                /// 192-bit keys have no AES-NI schedule here, so they use the software one on the stack.
+                uint32_t key_words[6];
+                uint32_t schedule[4 * 13];
+                for (int i = 0; i < 6; i++) {
+                    key_words[i] = ((uint32_t) key[i * 4] << 24) | ((uint32_t) key[i * 4 + 1] << 16) | ((uint32_t) key[i * 4 + 2] << 8) | key[i * 4 + 3];
+                }
+                aes_get_round_keys(6, key_words, 13, schedule);
+                for (int round = 0; round < 13; round++) {
+                    round_keys[lane][round] = aes_ni_load(schedule + round * 4);
+                }
+                aes_secure_zero(key_words, sizeof(key_words));
+                aes_secure_zero(schedule, sizeof(schedule));
+            }
+        }
+        aes_ni_batch_expand_128(keys_128, lanes_128, round_keys_128);
+        aes_ni_batch_expand_256(keys_256, lanes_256, round_keys_256);
+
+        for (size_t lane = 0; lane < lanes; lane++) {
+            const aes_batch_item& item = items[first + lane];
+            aes_ni_batch_push_message(queues, round_keys[lane], item.key.size() / 4 + 6, item.counter_block, item.input, item.output);
+        }
+
+        /// The round keys are reused by the next group of items, so nothing can be left queued.
+        aes_ni_batch_flush_all(queues);
+    }
+
+    /// The queues still hold the last key stream blocks.
+    aes_secure_zero(round_keys, sizeof(round_keys));
+    aes_secure_zero(queues, sizeof(queues));
+}
+
+/**
+ * The AES-NI side of the expanded key aes_ctr_batch, which skips the items with keys for other engines. The round keys only have to be loaded into registers,
+ * then the blocks share the pipeline like aes_ni_ctr_batch.
+ */
+inline AES_NI_TARGET void aes_ni_ctr_batch(std::span<const aes_expanded_batch_item> items) {
+    __m128i round_keys[AES_BATCH_LANES][15];
+    aes_ni_batch_queue queues[3];
+    size_t lane = 0;
+
+    for (const aes_expanded_batch_item& item : items) {
+        if (item.key->engine != AES_ENGINE_AES_NI) {
+            continue;
+        }
+        for (int round = 0; round <= item.key->rounds; round++) {
+            round_keys[lane][round] = aes_ni_load(item.key->round_keys.data() + round * 4);
+        }
+        aes_ni_batch_push_message(queues, round_keys[lane], item.key->rounds, item.counter_block, item.input, item.output);
+
+        /// The round keys are reused by the next group of items, so nothing can be left queued.
+        if (++lane == AES_BATCH_LANES) {
+            aes_ni_batch_flush_all(queues);
+            lane = 0;
+        }
+    }
+    aes_ni_batch_flush_all(queues);
+
+    aes_secure_zero(round_keys, sizeof(round_keys));
+    aes_secure_zero(queues, sizeof(queues));
+}
+
+#endif
+
+/**
+ * @param items - the messages, each with its own key and counter block
+ * @param engine - the engine to use. Every message brings a new key, so aes_select_engine(AES_OPERATION_KEY_EXPANSION) is usually the one to pass.
+ *
+ * Encrypts or decrypts many messages that each have a different key in CTR mode. With short messages the time goes on key expansion and per call overhead rather than the rounds,
+ * so with AES-NI the keys are expanded several at a time and blocks from different messages are interleaved in one pipeline.
+ * Other engines expand each key and call aes_ctr_process per message.
+ */
+inline void aes_ctr_batch(std::span<const aes_batch_item> items, aes_engine engine) {
+    for (const aes_batch_item& item : items) {
+        if (item.key.size() != 16 && item.key.size() != 24 && item.key.size() != 32) {
+            std::cerr << "AES KEY ERROR: Size of " << item.key.size() << " is invalid supported sizes are: 16, 24, 32";
+            exit(5);
+        }
+        if (item.counter_block.size() != 16) {
+            std::cerr << "AES CTR ERROR: Counter block size of " << item.counter_block.size() << " is invalid it must be 16";
+            exit(7);
+        }
+        aes_verify_output_size(item.input.size(), item.output.size());
+    }
+    aes_verify_engine(engine);
+
+#ifdef AES_HAS_AES_NI
+    if (engine == AES_ENGINE_AES_NI) {
+        aes_ni_ctr_batch(items);
+        return;
+    }
+#endif
+
+    for (const aes_batch_item& item : items) {
+        aes_key key = aes_expand_key(item.key, engine);
+        aes_ctr_counter counter = aes_ctr_make_counter(std::span<const std::byte, 16>(item.counter_block.data(), 16), 32);
+        aes_ctr_process(key, counter, 0, (const uint8_t*) item.input.data(), (uint8_t*) item.output.data(), item.input.size());
+        aes_secure_zero(&key, sizeof(key));
+    }
+}
+
+/**
+ * @param items - the messages, each with its own expanded key and counter block
+ *
+ * Like aes_ctr_batch but without the key expansion. Each message uses the engine its key was expanded for. Messages with AES-NI keys are interleaved in the multi-key kernel
+ * and the rest go through aes_ctr_process one at a time. Nothing is allocated, the items are gone through once for each kind of key instead of being sorted into lists.
+ */
+inline void aes_ctr_batch(std::span<const aes_expanded_batch_item> items) {
+    for (const aes_expanded_batch_item& item : items) {
+        if (item.counter_block.size() != 16) {
+            std::cerr << "AES CTR ERROR: Counter block size of " << item.counter_block.size() << " is invalid it must be 16";
+            exit(7);
+        }
+        aes_verify_output_size(item.input.size(), item.output.size());
+    }
+
+#ifdef AES_HAS_AES_NI
+    bool interleaved = false;
+#endif
+    for (const aes_expanded_batch_item& item : items) {
+#ifdef AES_HAS_AES_NI
+        if (item.key->engine == AES_ENGINE_AES_NI) {
+            interleaved = true;
+            continue;
+        }
+#endif
+        aes_ctr_counter counter = aes_ctr_make_counter(std::span<const std::byte, 16>(item.counter_block.data(), 16), 32);
+        aes_ctr_process(*item.key, counter, 0, (const uint8_t*) item.input.data(), (uint8_t*) item.output.data(), item.input.size());
+    }
+
+#ifdef AES_HAS_AES_NI
+    if (interleaved) {
+        aes_ni_ctr_batch(items);
+    }
+#endif
+}
+
+/**
+ * An XTS key: two AES keys of the same size, one for the data and one that only encrypts the tweak.
+ */
+struct aes_xts_key {
+    aes_key data_key;
+    aes_key tweak_key;
+};
+
+/**
+ * @param key - 32 or 64 bytes, the data key followed by the tweak key (so AES-128 or AES-256 XTS)
+ * @param engine - the engine to expand both keys for
+ * @return the expanded key pair
+ *
+ * The halves have to differ, since XTS with the same key for both loses its security proof.
+ */
+inline aes_xts_key aes_xts_make_key(const std::string& key, aes_engine engine = AES_ENGINE_REFERENCE) {
+    if (key.size() != 32 && key.size() != 64) {
+        std::cerr << "AES XTS ERROR: Key size of " << key.size() << " is invalid supported sizes are: 32, 64";
+        exit(5);
+    }
+    size_t half = key.size() / 2;
+    if (aes_constant_time_equal((const uint8_t*) key.data(), (const uint8_t*) key.data() + half, half)) {
+        std::cerr << "AES XTS ERROR: The data key and the tweak key must be different";
+        exit(5);
+    }
+
+    return {aes_expand_key(key.substr(0, half), engine), aes_expand_key(key.substr(half), engine)};
+}
+
+/// How many blocks have their tweaks worked out and go through the block function together.
+const size_t AES_XTS_PARALLEL_BLOCKS = 16;
+
+/**
+ * Multiplies the tweak by x in GF(2^128). XTS treats the tweak as a little endian number, so this is a shift left by one across the 16 bytes
+ * with 0x87 xored back into the first byte when a bit falls off the end.
+ */
+inline void aes_xts_multiply_tweak(uint64_t& low, uint64_t& high) {
+    uint64_t carry = high >> 63;
+    high = (high << 1) | (low >> 63);
+    low = (low << 1) ^ (0x87 & (0 - carry));
+}
+
+inline void aes_xts_load_tweak(const uint8_t* bytes, uint64_t& low, uint64_t& high) {
+    low = 0;
+    high = 0;
+    for (int index = 7; index >= 0; index--) {
+        low = (low << 8) | bytes[index];
+        high = (high << 8) | bytes[index + 8];
+    }
+}
+
+inline void aes_xts_store_tweak(uint64_t low, uint64_t high, uint8_t* bytes) {
+    for (int index = 0; index < 8; index++) {
+        bytes[index] = low >> (index * 8);
+        bytes[index + 8] = high >> (index * 8);
+    }
+}
+
+/**
+ * @param key - the expanded key pair
+ * @param sector - the data unit number, which becomes the tweak as a little endian 128-bit number
+ * @param tweak - receives the encrypted tweak for the first block of the sector
+ */
+inline void aes_xts_get_tweak(const aes_xts_key& key, uint64_t sector, uint8_t* tweak) {
+    uint8_t sector_bytes[16] = {};
+    aes_xts_store_tweak(sector, 0, sector_bytes);
+    aes_ecb_encrypt_process(key.tweak_key, sector_bytes, tweak, 16);
+}
+
+/**
+ * Whole blocks the portable way: the tweaks for a group of blocks are worked out first, xored in and out around the ECB function, and the group goes through the engine together.
+ * @param tweak - the tweak for the first block, advanced past the last one
+ */
+inline void aes_xts_blocks(const aes_key& key, bool decrypt, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t block_count) {
+    uint64_t low, high;
+    aes_xts_load_tweak(tweak, low, high);
+
+    for (size_t block = 0; block < block_count; block += AES_XTS_PARALLEL_BLOCKS) {
+        size_t count = std::min(AES_XTS_PARALLEL_BLOCKS, block_count - block);
+        uint8_t tweaks[AES_XTS_PARALLEL_BLOCKS * 16];
+        uint8_t buffer[AES_XTS_PARALLEL_BLOCKS * 16];
+
+        for (size_t index = 0; index < count; index++) {
+            aes_xts_store_tweak(low, high, tweaks + index * 16);
+            aes_xts_multiply_tweak(low, high);
+        }
+        for (size_t index = 0; index < count * 16; index++) {
+            buffer[index] = input[block * 16 + index] ^ tweaks[index];
+        }
+        decrypt ? aes_ecb_decrypt_process(key, buffer, buffer, count * 16) : aes_ecb_encrypt_process(key, buffer, buffer, count * 16);
+        for (size_t index = 0; index < count * 16; index++) {
+            output[block * 16 + index] = buffer[index] ^ tweaks[index];
+        }
+    }
+
+    aes_xts_store_tweak(low, high, tweak);
+}
+
+#ifdef AES_HAS_AES_NI
+
+/**
+ * The tweak multiplication on a whole register: every 32-bit lane shifts left by one and takes the bit that fell off the lane below it, and the bit that falls off the top comes back as 0x87.
+ */
+AES_NI_TARGET AES_ALWAYS_INLINE __m128i aes_ni_xts_multiply_tweak(__m128i tweak) {
+    __m128i carries = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), _MM_SHUFFLE(2, 1, 0, 3));
+    return _mm_xor_si128(_mm_slli_epi32(tweak, 1), _mm_and_si128(carries, _mm_set_epi32(1, 1, 1, 0x87)));
+}
+
+/**
+ * aes_xts_blocks with AES-NI. The blocks and tweaks stay in registers in byte order, the tweaks are doubled as they go and AES_NI_PARALLEL_BLOCKS blocks are in flight at once.
+ * @param keys - the round keys in byte order, the decryption round keys when decrypting
+ */
+template <uint8_t rounds, bool decrypt>
+AES_NI_TARGET void aes_ni_xts_blocks(const __m128i* keys, uint8_t* tweak_bytes, const uint8_t* input, uint8_t* output, size_t block_count) {
+    __m128i tweak = _mm_loadu_si128((const __m128i*) tweak_bytes);
+
+    size_t block = 0;
+    for (; block + AES_NI_PARALLEL_BLOCKS <= block_count; block += AES_NI_PARALLEL_BLOCKS) {
+        __m128i tweaks[AES_NI_PARALLEL_BLOCKS];
+        __m128i state[AES_NI_PARALLEL_BLOCKS];
+
+#pragma GCC unroll 8
+        for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+            tweaks[index] = tweak;
+            tweak = aes_ni_xts_multiply_tweak(tweak);
+            state[index] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*) (input + (block + index) * 16)), tweaks[index]), keys[0]);
+        }
+
+        for (uint8_t round = 1; round < rounds; round++) {
+#pragma GCC unroll 8
+            for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+                state[index] = decrypt ? _mm_aesdec_si128(state[index], keys[round]) : _mm_aesenc_si128(state[index], keys[round]);
+            }
+        }
+
+#pragma GCC unroll 8
+        for (size_t index = 0; index < AES_NI_PARALLEL_BLOCKS; index++) {
+            __m128i last = decrypt ? _mm_aesdeclast_si128(state[index], keys[rounds]) : _mm_aesenclast_si128(state[index], keys[rounds]);
+            _mm_storeu_si128((__m128i*) (output + (block + index) * 16), _mm_xor_si128(last, tweaks[index]));
+        }
+    }
+
+    for (; block < block_count; block++) {
+        __m128i state = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*) (input + block * 16)), tweak), keys[0]);
+        for (uint8_t round = 1; round < rounds; round++) {
+            state = decrypt ? _mm_aesdec_si128(state, keys[round]) : _mm_aesenc_si128(state, keys[round]);
+        }
+        state = decrypt ? _mm_aesdeclast_si128(state, keys[rounds]) : _mm_aesenclast_si128(state, keys[rounds]);
+        _mm_storeu_si128((__m128i*) (output + block * 16), _mm_xor_si128(state, tweak));
+        tweak = aes_ni_xts_multiply_tweak(tweak);
+    }
+
+    _mm_storeu_si128((__m128i*) tweak_bytes, tweak);
+}
+
+template <uint8_t rounds>
+AES_NI_TARGET void aes_ni_xts_blocks_sized(const aes_key& key, bool decrypt, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t block_count) {
+    const uint32_t* round_keys = decrypt ? key.decryption_round_keys.data() : key.round_keys.data();
+    __m128i keys[rounds + 1];
+    for (uint8_t round = 0; round <= rounds; round++) {
+        keys[round] = aes_ni_load(round_keys + (round * 4));
+    }
+
+    if (decrypt) {
+        aes_ni_xts_blocks<rounds, true>(keys, tweak, input, output, block_count);
+    }
+    else {
+        aes_ni_xts_blocks<rounds, false>(keys, tweak, input, output, block_count);
+    }
+}
+
+#endif
+
+/**
+ * Encrypts or decrypts whole blocks of one sector with consecutive tweaks, using the AES-NI kernel when the key is for AES-NI.
+ * @param tweak - the tweak for the first block, advanced past the last one
+ */
+inline void aes_xts_process_blocks(const aes_key& key, bool decrypt, uint8_t* tweak, const uint8_t* input, uint8_t* output, size_t block_count) {
+#ifdef AES_HAS_AES_NI
+    if (key.engine == AES_ENGINE_AES_NI) {
+        switch (key.rounds) {
+            case aes_key_size<32>::rounds:
+                aes_ni_xts_blocks_sized<aes_key_size<32>::rounds>(key, decrypt, tweak, input, output, block_count);
+                return;
+            case aes_key_size<24>::rounds:
+                aes_ni_xts_blocks_sized<aes_key_size<24>::rounds>(key, decrypt, tweak, input, output, block_count);
+                return;
+            default:
+                aes_ni_xts_blocks_sized<aes_key_size<16>::rounds>(key, decrypt, tweak, input, output, block_count);
+                return;
+        }
+    }
+#endif
+    aes_xts_blocks(key, decrypt, tweak, input, output, block_count);
+}
+
+/**
+ * One sector in either direction. A sector that isn't a whole number of blocks uses ciphertext stealing: the last whole block's output is split between
+ * the partial block at the end and the padding for it, so the ciphertext is exactly as long as the plaintext.
+ */
+inline void aes_xts_process(const aes_xts_key& key, bool decrypt, uint64_t sector, const uint8_t* input, uint8_t* output, size_t length) {
+    AES_INSTRUMENT_CALL(decrypt ? AES_CALL_XTS_DECRYPT : AES_CALL_XTS_ENCRYPT);
+    if (length < 16) {
+        std::cerr << "AES XTS ERROR: Sector size of " << length << " is invalid it must be at least 16";
+        exit(12);
+    }
+
+    uint8_t tweak[16];
+    aes_xts_get_tweak(key, sector, tweak);
+
+    size_t block_count = length / 16;
+    size_t tail = length % 16;
+    /// With stealing the last whole block is handled along with the tail.
+    size_t plain_blocks = tail ? block_count - 1 : block_count;
+    aes_xts_process_blocks(key.data_key, decrypt, tweak, input, output, plain_blocks);
+    if (tail == 0) {
+        return;
+    }
+
+    const uint8_t* last_input = input + plain_blocks * 16;
+    uint8_t* last_output = output + plain_blocks * 16;
+    uint8_t last_tweak[16];
+    std::memcpy(last_tweak, tweak, 16);
+    uint64_t low, high;
+    aes_xts_load_tweak(tweak, low, high);
+    aes_xts_multiply_tweak(low, high);
+    uint8_t next_tweak[16];
+    aes_xts_store_tweak(low, high, next_tweak);
+
+    /// Encryption uses the tweaks in order. Decryption has to undo the second block first, so it swaps them.
+    uint8_t block[16];
+    aes_xts_process_blocks(key.data_key, decrypt, decrypt ? next_tweak : last_tweak, last_input, block, 1);
+
+    uint8_t stolen[16];
+    std::memcpy(stolen, last_input + 16, tail);
+    std::memcpy(stolen + tail, block + tail, 16 - tail);
+    std::memcpy(last_output + 16, block, tail);
+    aes_xts_process_blocks(key.data_key, decrypt, decrypt ? last_tweak : next_tweak, stolen, last_output, 1);
+}
+
+/**
+ * @param key - the expanded key pair
+ * @param sector - the sector number
+ * @param input - the sector's plaintext, at least 16 bytes
+ * @param output - receives the ciphertext, may be the same as <b>input</b>
+ * @param length - the sector size in bytes
+ */
+inline void aes_xts_encrypt_process(const aes_xts_key& key, uint64_t sector, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_xts_process(key, false, sector, input, output, length);
+}
+
+/// The reverse of aes_xts_encrypt_process.
+inline void aes_xts_decrypt_process(const aes_xts_key& key, uint64_t sector, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_xts_process(key, true, sector, input, output, length);
+}
+
+inline void aes_xts_verify_sectors(size_t sector_size, size_t length) {
+    if (sector_size < 16 || length % sector_size) {
+        std::cerr << "AES XTS ERROR: Data size of " << length << " is invalid it must be a multiple of the sector size " << sector_size << " which must be at least 16";
+        exit(12);
+    }
+}
+
+/**
+ * @param key - the expanded key pair
+ * @param first_sector - the number of the first sector, the ones after it are numbered in order
+ * @param sector_size - the size of every sector, at least 16 bytes
+ * @param input - consecutive sectors
+ * @param output - receives the ciphertext, may be the same as <b>input</b>
+ * @param length - a multiple of <b>sector_size</b>
+ */
+inline void aes_xts_encrypt_sectors(const aes_xts_key& key, uint64_t first_sector, size_t sector_size, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_xts_verify_sectors(sector_size, length);
+    for (size_t position = 0; position < length; position += sector_size) {
+        aes_xts_encrypt_process(key, first_sector + position / sector_size, input + position, output + position, sector_size);
+    }
+}
+
+/// The reverse of aes_xts_encrypt_sectors.
+inline void aes_xts_decrypt_sectors(const aes_xts_key& key, uint64_t first_sector, size_t sector_size, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_xts_verify_sectors(sector_size, length);
+    for (size_t position = 0; position < length; position += sector_size) {
+        aes_xts_decrypt_process(key, first_sector + position / sector_size, input + position, output + position, sector_size);
+    }
+}
+
+/**
+ * @param key - the expanded key pair
+ * @param sector - the sector number
+ * @param input - the sector
+ * @param output - receives the result, at least as big as <b>input</b>
+ */
+inline void aes_xts_encrypt(const aes_xts_key& key, uint64_t sector, std::span<const std::byte> input, std::span<std::byte> output) {
+    aes_verify_output_size(input.size(), output.size());
+    aes_xts_encrypt_process(key, sector, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+inline void aes_xts_decrypt(const aes_xts_key& key, uint64_t sector, std::span<const std::byte> input, std::span<std::byte> output) {
+    aes_verify_output_size(input.size(), output.size());
+    aes_xts_decrypt_process(key, sector, (const uint8_t*) input.data(), (uint8_t*) output.data(), input.size());
+}
+
+/**
+ * An AES key with the two CMAC subkeys derived from L = E(K, 0^128): K1 = L * x and K2 = L * x^2 in GF(2^128).
+ */
+struct aes_cmac_key {
+    aes_key key;
+    /// Xored into the last block when it is complete, as column words like the blocks.
+    std::array<uint32_t, 4> k1;
+    /// Xored into the last block when it had to be padded.
+    std::array<uint32_t, 4> k2;
+};
+
+/**
+ * @param key - an expanded key
+ * @return the key with its CMAC subkeys
+ *
+ * CMAC's doubling is the same multiplication by x as the XTS tweak's, only on the block read as one big endian number instead of a little endian one,
+ * so the carry out of the first byte comes back as 0x87 in the last byte.
+ */
+inline aes_cmac_key aes_cmac_make_key(const aes_key& key) {
+    aes_cmac_key out = {};
+    out.key = key;
+
+    uint32_t zero_block[4] = {0, 0, 0, 0};
+    aes_encrypt_blocks(key, zero_block, 1);
+    uint64_t high = ((uint64_t) zero_block[0] << 32) | zero_block[1];
+    uint64_t low = ((uint64_t) zero_block[2] << 32) | zero_block[3];
+
+    for (std::array<uint32_t, 4>* subkey : {&out.k1, &out.k2}) {
+        aes_xts_multiply_tweak(low, high);
+        *subkey = {(uint32_t) (high >> 32), (uint32_t) high, (uint32_t) (low >> 32), (uint32_t) low};
+    }
+
+    aes_secure_zero(zero_block, sizeof(zero_block));
+    aes_secure_zero(&high, sizeof(high));
+    aes_secure_zero(&low, sizeof(low));
+    return out;
+}
+
+/// @return how many blocks the CMAC of <b>length</b> bytes encrypts, an empty message still has one padded block
+inline size_t aes_cmac_block_count(size_t length) {
+    return length == 0 ? 1 : (length + 15) / 16;
+}
+
+/**
+ * @param key - the CMAC key
+ * @param message - the message
+ * @param length - the size of the message in bytes
+ * @param block - which block, less than aes_cmac_block_count(<b>length</b>)
+ * @param words - receives the block as column words
+ *
+ * The last block is xored with K1 when it is complete. Otherwise it is padded with 0x80 and then zeros, the same as AES_PADDING_ISO_7816_4, and xored with K2.
+ */
+inline void aes_cmac_get_block(const aes_cmac_key& key, const uint8_t* message, size_t length, size_t block, uint32_t* words) {
+    size_t position = block * 16;
+    if (position + 16 < length) {
+        aes_load_blocks(message + position, words, 1);
+        return;
+    }
+
+    const std::array<uint32_t, 4>* subkey = &key.k1;
+    if (position + 16 == length) {
+        aes_load_blocks(message + position, words, 1);
+    }
+    else {
+        uint8_t last[16];
+        std::copy(message + position, message + length, last);
+        aes_pad_block(AES_PADDING_ISO_7816_4, last, length - position);
+        aes_load_blocks(last, words, 1);
+        subkey = &key.k2;
+    }
+    for (int word = 0; word < 4; word++) {
+        words[word] ^= (*subkey)[word];
+    }
+}
+
+/**
+ * @param key - the CMAC key
+ * @param message - the message
+ * @param length - the size of the message in bytes
+ * @param tag - receives the 16 byte tag
+ *
+ * Every block is xored with the previous block's output before it is encrypted, like CBC encryption, so a single message can only go one block at a time.
+ * aes_cmac_batch gets around that by interleaving the chains of many messages.
+ */
+inline void aes_cmac_process(const aes_cmac_key& key, const uint8_t* message, size_t length, uint8_t* tag) {
+    AES_INSTRUMENT_CALL(AES_CALL_CMAC);
+    uint32_t state[4] = {0, 0, 0, 0};
+    size_t block_count = aes_cmac_block_count(length);
+
+    for (size_t block = 0; block < block_count; block++) {
+        uint32_t words[4];
+        aes_cmac_get_block(key, message, length, block, words);
+        for (int word = 0; word < 4; word++) {
+            state[word] ^= words[word];
+        }
+        aes_encrypt_blocks(key.key, state, 1);
+    }
+
+    aes_store_blocks(state, tag, 1);
+}
+
+inline void aes_cmac_verify_tag_length(size_t tag_length) {
+    if (tag_length < 4 || tag_length > 16) {
+        std::cerr << "AES CMAC ERROR: Tag size of " << tag_length << " is invalid it must be between 4 and 16";
+        exit(13);
+    }
+}
+
+/**
+ * @param key - the CMAC key
+ * @param message - the message
+ * @param length - the size of the message in bytes
+ * @param tag - the tag to check
+ * @param tag_length - the size of the tag, which may be truncated to as few as 4 bytes
+ * @return true if the tag matches
+ *
+ * The tag is compared without an early exit so the time taken doesn't reveal how much of it was right.
+ */
+inline bool aes_cmac_verify_process(const aes_cmac_key& key, const uint8_t* message, size_t length, const uint8_t* tag, size_t tag_length) {
+    aes_cmac_verify_tag_length(tag_length);
+
+    uint8_t expected[16];
+    aes_cmac_process(key, message, length, expected);
+    return aes_constant_time_equal(expected, tag, tag_length);
+}
+
+/**
+ * @param key - the CMAC key
+ * @param message - the message
+ * @return the 16 byte tag
+ */
+inline std::string aes_cmac(const aes_cmac_key& key, const std::string& message) {
+    std::string tag(16, 0);
+    aes_cmac_process(key, (const uint8_t*) message.data(), message.size(), (uint8_t*) tag.data());
+    return tag;
+}
+
+/**
+ * @param key - the CMAC key
+ * @param message - the message
+ * @param tag - the tag, 4 to 16 bytes
+ * @return true if the tag matches
+ */
+inline bool aes_cmac_verify(const aes_cmac_key& key, const std::string& message, const std::string& tag) {
+    return aes_cmac_verify_process(key, (const uint8_t*) message.data(), message.size(), (const uint8_t*) tag.data(), tag.size());
+}
+
+/**
+ * One message of a CMAC batch.
+ */
+struct aes_cmac_batch_item {
+    /// Must stay alive until aes_cmac_batch returns. Items may share a key.
+    const aes_cmac_key* key;
+    std::span<const std::byte> message;
+    /// Receives the tag, truncated to the size of the span which must be 4 to 16 bytes. Mustn't overlap any message in the batch.
+    std::span<std::byte> tag;
+};
+
+/// How many chains a software engine steps together, so each aes_encrypt_blocks call has as many blocks as one pass of CTR.
+const size_t AES_CMAC_BATCH_LANES = AES_CTR_PARALLEL_BLOCKS;
+
+/**
+ * The software side of aes_cmac_batch, for items that all use <b>key</b>. Up to AES_CMAC_BATCH_LANES chains are stepped together, each step encrypting the next block
+ * of every chain in one aes_encrypt_blocks call. When a chain finishes the next item takes its lane, and once there are none left the last lane moves into the gap
+ * so the calls never have idle blocks.
+ */
+inline void aes_cmac_batch_lanes(const aes_cmac_key& key, const aes_cmac_batch_item* const* items, size_t count) {
+    const aes_cmac_batch_item* lane_item[AES_CMAC_BATCH_LANES];
+    size_t lane_block[AES_CMAC_BATCH_LANES];
+    size_t lane_block_count[AES_CMAC_BATCH_LANES];
+    /// The chaining value of each lane, which is also where its next block is encrypted.
+    uint32_t state[AES_CMAC_BATCH_LANES * 4];
+    size_t lanes = 0, next = 0;
+
+    auto start_lane = [&](size_t lane) {
+        lane_item[lane] = items[next++];
+        lane_block[lane] = 0;
+        lane_block_count[lane] = aes_cmac_block_count(lane_item[lane]->message.size());
+        std::fill(state + lane * 4, state + lane * 4 + 4, 0);
+    };
+    while (lanes < AES_CMAC_BATCH_LANES && next < count) {
+        start_lane(lanes++);
+    }
+
+    while (lanes) {
+        for (size_t lane = 0; lane < lanes; lane++) {
+            const aes_cmac_batch_item& item = *lane_item[lane];
+            uint32_t words[4];
+            aes_cmac_get_block(key, (const uint8_t*) item.message.data(), item.message.size(), lane_block[lane]++, words);
+            for (int word = 0; word < 4; word++) {
+                state[lane * 4 + word] ^= words[word];
+            }
+        }
+
+        aes_encrypt_blocks(key.key, state, lanes);
+
+        for (size_t lane = 0; lane < lanes;) {
+            if (lane_block[lane] < lane_block_count[lane]) {
+                lane++;
+                continue;
+            }
+
+            uint8_t tag[16];
+            aes_store_blocks(state + lane * 4, tag, 1);
+            std::copy(tag, tag + lane_item[lane]->tag.size(), (uint8_t*) lane_item[lane]->tag.data());
+
+            if (next < count) {
+                start_lane(lane++);
+            }
+            else {
+                /// The moved lane hasn't been checked yet, so this lane is looked at again.
+                lanes--;
+                lane_item[lane] = lane_item[lanes];
+                lane_block[lane] = lane_block[lanes];
+                lane_block_count[lane] = lane_block_count[lanes];
+                std::copy(state + lanes * 4, state + lanes * 4 + 4, state + lane * 4);
+            }
+        }
+    }
+
+    aes_secure_zero(state, sizeof(state));
+}
+
+#ifdef AES_HAS_AES_NI
+
+/**
+ * Puts the next item in a lane of aes_ni_cmac_batch: loads its round keys, unless the lane already has them from an item with the same key, and starts its chain from zero.
+ */
+inline AES_NI_TARGET void aes_ni_cmac_start_lane(const aes_cmac_batch_item* item, __m128i* round_keys, uint8_t rounds, const aes_cmac_key*& loaded_key, __m128i& state, size_t& block, size_t& block_count) {
+    if (loaded_key != item->key) {
+        for (int round = 0; round <= rounds; round++) {
+            round_keys[round] = aes_ni_load(item->key->key.round_keys.data() + round * 4);
+        }
+        loaded_key = item->key;
+    }
+    state = _mm_setzero_si128();
+    block = 0;
+    block_count = aes_cmac_block_count(item->message.size());
+}
+
+/**
+ * The AES-NI side of aes_cmac_batch, for items whose keys all have <b>rounds</b> rounds. Each lane of the multi-key kernel runs one message's chain with that message's key,
+ * so the kernel does a block of eight independent chains per call instead of waiting out the latency of one. Finished lanes take the next item, and lanes with nothing left
+ * to do repeat lane 0 until the rest finish.
+ */
+template <uint8_t rounds>
+inline AES_NI_TARGET void aes_ni_cmac_batch(const aes_cmac_batch_item* const* items, size_t count) {
+    __m128i round_keys[AES_BATCH_LANES][rounds + 1];
+    const __m128i* lane_keys[AES_BATCH_LANES];
+    __m128i state[AES_BATCH_LANES];
+    __m128i blocks[AES_BATCH_LANES];
+    const aes_cmac_batch_item* lane_item[AES_BATCH_LANES] = {};
+    size_t lane_block[AES_BATCH_LANES] = {};
+    size_t lane_block_count[AES_BATCH_LANES] = {};
+    const aes_cmac_key* loaded_key[AES_BATCH_LANES] = {};
+    size_t active = 0, next = 0;
+
+    for (size_t lane = 0; lane < AES_BATCH_LANES && next < count; lane++, active++) {
+        lane_item[lane] = items[next++];
+        aes_ni_cmac_start_lane(lane_item[lane], round_keys[lane], rounds, loaded_key[lane], state[lane], lane_block[lane], lane_block_count[lane]);
+    }
+
+    while (active) {
+        size_t first_active = 0;
+        while (!lane_item[first_active]) {
+            first_active++;
+        }
+
+        for (size_t lane = 0; lane < AES_BATCH_LANES; lane++) {
+            const aes_cmac_batch_item* item = lane_item[lane];
+            if (!item) {
+                continue;
+            }
+
+            const uint8_t* message = (const uint8_t*) item->message.data();
+            size_t block = lane_block[lane]++;
+            __m128i data;
+            if (block + 1 < lane_block_count[lane]) {
+                data = _mm_loadu_si128((const __m128i*) (message + block * 16));
+            }
+            else if (block * 16 + 16 == item->message.size()) {
+                data = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (message + block * 16)), aes_ni_load(item->key->k1.data()));
+            }
+            else {
+                uint32_t words[4];
+                aes_cmac_get_block(*item->key, message, item->message.size(), block, words);
+                data = aes_ni_load(words);
+            }
+            blocks[lane] = _mm_xor_si128(state[lane], data);
+            lane_keys[lane] = round_keys[lane];
+        }
+        for (size_t lane = 0; lane < AES_BATCH_LANES; lane++) {
+            if (!lane_item[lane]) {
+                blocks[lane] = blocks[first_active];
+                lane_keys[lane] = round_keys[first_active];
+            }
+        }
+
+        aes_ni_encrypt_multi_key<rounds>(blocks, lane_keys);
+
+        for (size_t lane = 0; lane < AES_BATCH_LANES; lane++) {
+            if (!lane_item[lane]) {
+                continue;
+            }
+            state[lane] = blocks[lane];
+            if (lane_block[lane] < lane_block_count[lane]) {
+                continue;
+            }
+
+            uint8_t tag[16];
+            _mm_storeu_si128((__m128i*) tag, state[lane]);
+            std::copy(tag, tag + lane_item[lane]->tag.size(), (uint8_t*) lane_item[lane]->tag.data());
+
+            if (next < count) {
+                lane_item[lane] = items[next++];
+                aes_ni_cmac_start_lane(lane_item[lane], round_keys[lane], rounds, loaded_key[lane], state[lane], lane_block[lane], lane_block_count[lane]);
+            }
+            else {
+                lane_item[lane] = nullptr;
+                active--;
+            }
+        }
+    }
+
+    aes_secure_zero(round_keys, sizeof(round_keys));
+    aes_secure_zero(state, sizeof(state));
+    aes_secure_zero(blocks, sizeof(blocks));
+}
+
+#endif
+
+/// How many messages aes_cmac_batch buckets at a time. The buckets are arrays of pointers on the stack, and this many keeps every lane busy for most of a group.
+const size_t AES_CMAC_BATCH_GROUP = 256;
+
+/**
+ * @param items - the messages, each with its own CMAC key and tag
+ *
+ * Computes the CMACs of many independent messages. One CMAC is a chain where every block waits on the one before it, which leaves the AES-NI pipeline and the
+ * bitsliced engine's width mostly idle, so the chains of different messages are interleaved instead: with AES-NI keys up to AES_BATCH_LANES messages run in the lanes
+ * of the multi-key kernel whatever their keys are, and with other engines the messages that share a key are stepped together a block each per aes_encrypt_blocks call.
+ * The items are bucketed AES_CMAC_BATCH_GROUP at a time, so nothing is allocated. Gives the same tags as calling aes_cmac_process on each message.
+ */
+inline void aes_cmac_batch(std::span<const aes_cmac_batch_item> items) {
+    AES_INSTRUMENT_CALL(AES_CALL_CMAC_BATCH);
+    for (const aes_cmac_batch_item& item : items) {
+        aes_cmac_verify_tag_length(item.tag.size());
+    }
+
+    for (size_t first = 0; first < items.size(); first += AES_CMAC_BATCH_GROUP) {
+        std::span<const aes_cmac_batch_item> group = items.subspan(first, std::min(AES_CMAC_BATCH_GROUP, items.size() - first));
+
+        /// Pointers, so the items themselves stay where the caller put them.
+        const aes_cmac_batch_item* software[AES_CMAC_BATCH_GROUP];
+        size_t software_count = 0;
+#ifdef AES_HAS_AES_NI
+        const aes_cmac_batch_item* interleaved[3][AES_CMAC_BATCH_GROUP];
+        size_t interleaved_count[3] = {};
+#endif
+        for (const aes_cmac_batch_item& item : group) {
+#ifdef AES_HAS_AES_NI
+            if (item.key->key.engine == AES_ENGINE_AES_NI) {
+                size_t size = (item.key->key.rounds - aes_key_size<16>::rounds) / 2;
+                interleaved[size][interleaved_count[size]++] = &item;
+                continue;
+            }
+#endif
+            software[software_count++] = &item;
+        }
+
+#ifdef AES_HAS_AES_NI
+        aes_ni_cmac_batch<10>(interleaved[0], interleaved_count[0]);
+        aes_ni_cmac_batch<12>(interleaved[1], interleaved_count[1]);
+        aes_ni_cmac_batch<14>(interleaved[2], interleaved_count[2]);
+#endif
+
+        /// Each software call shares one key, so the items with the key of the first one left are swapped to the front and done together.
+        for (size_t done = 0; done < software_count;) {
+            const aes_cmac_key* key = software[done]->key;
+            size_t end = done + 1;
+            for (size_t index = end; index < software_count; index++) {
+                if (software[index]->key == key) {
+                    std::swap(software[index], software[end++]);
+                }
+            }
+            aes_cmac_batch_lanes(*key, software + done, end - done);
+            done = end;
+        }
+    }
+}
+
+/**
+ * A fixed set of threads that run a task over a range of chunk indexes.
+ * Every thread starts with an equal share of the range and takes chunks from the front of it. When a thread runs out, it steals the back half of another thread's remaining share,
+ * so threads that get descheduled or land on slower cores don't hold up the rest.
+ * The thread calling run is one of the workers. Only one run can be going at a time.
+ */
+struct aes_thread_pool {
+    /// @param thread_count - how many threads work on each run including the caller, 0 for one per hardware thread
+    explicit aes_thread_pool(size_t thread_count = 0) {
+        if (thread_count == 0) {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        worker_count = thread_count;
+        queues.reset(new aes_thread_pool_queue[worker_count]);
+        for (size_t worker = 1; worker < worker_count; worker++) {
+            threads.emplace_back(&aes_thread_pool::worker_main, this, worker);
+        }
+    }
+
+    ~aes_thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        start.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    aes_thread_pool(const aes_thread_pool&) = delete;
+    aes_thread_pool& operator=(const aes_thread_pool&) = delete;
+
+    size_t thread_count() const {
+        return worker_count;
+    }
+
+    /**
+     * @param chunk_count - the number of chunks
+     * @param chunk_task - called once for every chunk index in [0, chunk_count), from any of the threads
+     *
+     * Returns once every chunk is done. Chunks should write to separate memory, then the result doesn't depend on which thread did what.
+     * If <b>chunk_task</b> throws, the thread it threw on stops taking chunks and the others finish the rest. Once they all have, the first exception is rethrown here.
+     */
+    void run(size_t chunk_count, const std::function<void(size_t)>& chunk_task) {
+        if (worker_count == 1 || chunk_count <= 1) {
+            for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+                chunk_task(chunk);
+            }
+            return;
+        }
+
+        for (size_t worker = 0; worker < worker_count; worker++) {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            queues[worker].begin = chunk_count * worker / worker_count;
+            queues[worker].end = chunk_count * (worker + 1) / worker_count;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &chunk_task;
+            busy = worker_count - 1;
+            generation++;
+        }
+        start.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+        task = nullptr;
+        if (failure) {
+            std::exception_ptr error = failure;
+            failure = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct aes_thread_pool_queue {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    /// @return false once there are no chunks left anywhere
+    bool take(size_t worker, size_t& chunk) {
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            if (queues[worker].begin < queues[worker].end) {
+                chunk = queues[worker].begin++;
+                return true;
+            }
+        }
+
+        for (size_t offset = 1; offset < worker_count; offset++) {
+            aes_thread_pool_queue& victim = queues[(worker + offset) % worker_count];
+            size_t stolen_begin, stolen_end;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.begin == victim.end) {
+                    continue;
+                }
+                stolen_end = victim.end;
+                stolen_begin = victim.end - (victim.end - victim.begin + 1) / 2;
+                victim.end = stolen_begin;
+            }
+
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            queues[worker].begin = stolen_begin + 1;
+            queues[worker].end = stolen_end;
+            chunk = stolen_begin;
+            return true;
+        }
+
+        return false;
+    }
+
+    void work(size_t worker) {
+        try {
+            size_t chunk;
+            while (take(worker, chunk)) {
+                (*task)(chunk);
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!failure) {
+                failure = std::current_exception();
+            }
+        }
+    }
+
+    void worker_main(size_t worker) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+
+            work(worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0) {
+                done.notify_all();
+            }
+        }
+    }
+
+    size_t worker_count;
+    std::unique_ptr<aes_thread_pool_queue[]> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    const std::function<void(size_t)>* task = nullptr;
+    /// The first exception thrown by the task in this run, see run.
+    std::exception_ptr failure;
+    uint64_t generation = 0;
+    size_t busy = 0;
+    bool stopping = false;
+};
+
+/// How much data each chunk of a parallel operation covers. Large enough that taking a chunk costs nothing next to processing it, and small enough to stay in L2 and leave plenty of chunks to steal.
+const size_t AES_PARALLEL_CHUNK_BYTES = 64 * 1024;
+
+/// @return how many chunks <b>length</b> bytes split into
+inline size_t aes_parallel_chunk_count(size_t length) {
+    return (length + AES_PARALLEL_CHUNK_BYTES - 1) / AES_PARALLEL_CHUNK_BYTES;
+}
+
+/**
+ * ECB encryption of <b>block_count</b> blocks split across the pool. Gives the same result as aes_encrypt_blocks.
+ */
+inline void aes_parallel_encrypt_blocks(aes_thread_pool& pool, const aes_key& key, uint32_t* blocks, size_t block_count) {
+    const size_t chunk_blocks = AES_PARALLEL_CHUNK_BYTES / 16;
+    pool.run(aes_parallel_chunk_count(block_count * 16), [&](size_t chunk) {
+        size_t first = chunk * chunk_blocks;
+        aes_encrypt_blocks(key, blocks + first * 4, std::min(chunk_blocks, block_count - first));
+    });
+}
+
+/**
+ * ECB decryption of <b>block_count</b> blocks split across the pool. Gives the same result as aes_decrypt_blocks.
+ */
+inline void aes_parallel_decrypt_blocks(aes_thread_pool& pool, const aes_key& key, uint32_t* blocks, size_t block_count) {
+    const size_t chunk_blocks = AES_PARALLEL_CHUNK_BYTES / 16;
+    pool.run(aes_parallel_chunk_count(block_count * 16), [&](size_t chunk) {
+        size_t first = chunk * chunk_blocks;
+        aes_decrypt_blocks(key, blocks + first * 4, std::min(chunk_blocks, block_count - first));
+    });
+}
+
+/**
+ * aes_ecb_encrypt_process split across the pool.
+ */
+inline void aes_parallel_ecb_encrypt_process(aes_thread_pool& pool, const aes_key& key, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_verify_block_length("ECB", length);
+
+    pool.run(aes_parallel_chunk_count(length), [&](size_t chunk) {
+        size_t position = chunk * AES_PARALLEL_CHUNK_BYTES;
+        aes_ecb_encrypt_process(key, input + position, output + position, std::min(AES_PARALLEL_CHUNK_BYTES, length - position));
+    });
+}
+
+/**
+ * aes_ecb_decrypt_process split across the pool.
+ */
+inline void aes_parallel_ecb_decrypt_process(aes_thread_pool& pool, const aes_key& key, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_verify_block_length("ECB", length);
+
+    pool.run(aes_parallel_chunk_count(length), [&](size_t chunk) {
+        size_t position = chunk * AES_PARALLEL_CHUNK_BYTES;
+        aes_ecb_decrypt_process(key, input + position, output + position, std::min(AES_PARALLEL_CHUNK_BYTES, length - position));
+    });
+}
+
+/**
+ * aes_ctr_process split across the pool. Every chunk works out its own counter from its offset, so there is nothing to hand between chunks.
+ */
+inline void aes_parallel_ctr_process(aes_thread_pool& pool, const aes_key& key, const aes_ctr_counter& counter, uint64_t offset, const uint8_t* input, uint8_t* output, size_t length) {
+    pool.run(aes_parallel_chunk_count(length), [&](size_t chunk) {
+        size_t position = chunk * AES_PARALLEL_CHUNK_BYTES;
+        aes_ctr_process(key, counter, offset + position, input + position, output + position, std::min(AES_PARALLEL_CHUNK_BYTES, length - position));
+    });
+}
+
+/**
+ * aes_cbc_decrypt_process split across the pool.
+ * The first block of each chunk is chained to the last ciphertext block of the chunk before it, which another thread may already have decrypted when working in place,
+ * so those blocks are copied out before any chunk starts.
+ */
+inline void aes_parallel_cbc_decrypt_process(aes_thread_pool& pool, const aes_key& key, std::array<uint32_t, 4>& chaining, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_verify_block_length("CBC", length);
+
+    size_t chunk_count = aes_parallel_chunk_count(length);
+    if (chunk_count == 0) {
+        return;
+    }
+
+    std::vector<std::array<uint32_t, 4>> chunk_chaining(chunk_count);
+    chunk_chaining[0] = chaining;
+    for (size_t chunk = 1; chunk < chunk_count; chunk++) {
+        aes_load_blocks(input + chunk * AES_PARALLEL_CHUNK_BYTES - 16, chunk_chaining[chunk].data(), 1);
+    }
+    std::array<uint32_t, 4> last;
+    aes_load_blocks(input + length - 16, last.data(), 1);
+
+    pool.run(chunk_count, [&](size_t chunk) {
+        size_t position = chunk * AES_PARALLEL_CHUNK_BYTES;
+        aes_cbc_decrypt_process(key, chunk_chaining[chunk], input + position, output + position, std::min(AES_PARALLEL_CHUNK_BYTES, length - position));
+    });
+
+    chaining = last;
+}
+
+/**
+ * @return how many whole sectors go in each chunk, enough to make the chunk about AES_PARALLEL_CHUNK_BYTES
+ */
+inline size_t aes_parallel_xts_sectors_per_chunk(size_t sector_size) {
+    return std::max<size_t>(1, AES_PARALLEL_CHUNK_BYTES / sector_size);
+}
+
+/**
+ * aes_xts_encrypt_sectors split across the pool. Every sector has its own tweak, so chunks of whole sectors are independent.
+ */
+inline void aes_parallel_xts_encrypt_sectors(aes_thread_pool& pool, const aes_xts_key& key, uint64_t first_sector, size_t sector_size, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_xts_verify_sectors(sector_size, length);
+    size_t chunk_sectors = aes_parallel_xts_sectors_per_chunk(sector_size);
+    size_t sector_count = length / sector_size;
+
+    pool.run((sector_count + chunk_sectors - 1) / chunk_sectors, [&](size_t chunk) {
+        size_t sector = chunk * chunk_sectors;
+        size_t count = std::min(chunk_sectors, sector_count - sector);
+        aes_xts_encrypt_sectors(key, first_sector + sector, sector_size, input + sector * sector_size, output + sector * sector_size, count * sector_size);
+    });
+}
+
+/// The reverse of aes_parallel_xts_encrypt_sectors.
+inline void aes_parallel_xts_decrypt_sectors(aes_thread_pool& pool, const aes_xts_key& key, uint64_t first_sector, size_t sector_size, const uint8_t* input, uint8_t* output, size_t length) {
+    aes_xts_verify_sectors(sector_size, length);
+    size_t chunk_sectors = aes_parallel_xts_sectors_per_chunk(sector_size);
+    size_t sector_count = length / sector_size;
+
+    pool.run((sector_count + chunk_sectors - 1) / chunk_sectors, [&](size_t chunk) {
+        size_t sector = chunk * chunk_sectors;
+        size_t count = std::min(chunk_sectors, sector_count - sector);
+        aes_xts_decrypt_sectors(key, first_sector + sector, sector_size, input + sector * sector_size, output + sector * sector_size, count * sector_size);
+    });
+}
+
+/// How many messages each chunk of aes_parallel_cmac_batch takes. Enough that every chunk keeps all the lanes busy for most of its run.
+const size_t AES_PARALLEL_CMAC_ITEMS = 1024;
+
+/**
+ * aes_cmac_batch split across the pool. The messages are independent so each chunk is a batch of its own.
+ */
+inline void aes_parallel_cmac_batch(aes_thread_pool& pool, std::span<const aes_cmac_batch_item> items) {
+    pool.run((items.size() + AES_PARALLEL_CMAC_ITEMS - 1) / AES_PARALLEL_CMAC_ITEMS, [&](size_t chunk) {
+        size_t first = chunk * AES_PARALLEL_CMAC_ITEMS;
+        aes_cmac_batch(items.subspan(first, std::min(AES_PARALLEL_CMAC_ITEMS, items.size() - first)));
+    });
+}
+
+/// The default byte budget of an aes_key_cache, which is a few thousand keys.
+const size_t AES_KEY_CACHE_DEFAULT_BYTES = 8 * 1024 * 1024;
+
+/**
+ * A thread-safe cache of expanded keys with a byte budget, for when the same keys come back across many requests and expanding them every time would be most of the work.
+ * Entries are found by a seeded hash of the key bytes and then compared to the key in constant time. Once the cache goes over its budget the least recently used entries
+ * are evicted and their key bytes zeroed. The expanded keys it hands out stay valid for as long as the caller holds them and are zeroed when the last holder lets go.
+ */
+struct aes_key_cache {
+    /// @param byte_budget - roughly how much memory the cached entries may use
+    explicit aes_key_cache(size_t byte_budget = AES_KEY_CACHE_DEFAULT_BYTES) : byte_budget(byte_budget) {
+        std::random_device random;
+        seed = ((uint64_t) random() << 32) | random();
+    }
+
+    ~aes_key_cache() {
+        clear();
+    }
+
+    aes_key_cache(const aes_key_cache&) = delete;
+    aes_key_cache& operator=(const aes_key_cache&) = delete;
+
+    /**
+     * @param key - the key bytes, 16, 24 or 32 of them
+     * @param engine - the engine to expand the key for. Cached keys are expanded once and used many times, so aes_select_engine(AES_OPERATION_BULK) is usually the one to pass.
+     * @return the expanded key, from the cache if it was there
+     */
+    std::shared_ptr<const aes_key> get(std::span<const std::byte> key, aes_engine engine) {
+        if (key.size() != 16 && key.size() != 24 && key.size() != 32) {
+            std::cerr << "AES KEY ERROR: Size of " << key.size() << " is invalid supported sizes are: 16, 24, 32";
+            exit(5);
+        }
+        const uint8_t* key_bytes = (const uint8_t*) key.data();
+        uint64_t hash = hash_key(key_bytes, key.size(), engine);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (std::shared_ptr<const aes_key> cached = find(hash, key_bytes, key.size(), engine)) {
+                hit_count++;
+                return cached;
+            }
+            miss_count++;
+        }
+
+        /// Expanding takes far longer than a lookup, so other threads can use the cache in the meantime.
+        std::shared_ptr<const aes_key> expanded(new aes_key(aes_expand_key(key, engine)), [](aes_key* expanded_key) {
+            aes_secure_zero(expanded_key, sizeof(aes_key));
+            delete expanded_key;
+        });
+
+        std::lock_guard<std::mutex> lock(mutex);
+        /// Another thread may have missed on the same key and inserted it first.
+        if (std::shared_ptr<const aes_key> cached = find(hash, key_bytes, key.size(), engine)) {
+            return cached;
+        }
+
+        aes_key_cache_entry entry = {hash, engine, (uint8_t) key.size(), {}, expanded};
+        std::memcpy(entry.key_bytes.data(), key_bytes, key.size());
+        entries.push_front(entry);
+        aes_secure_zero(entry.key_bytes.data(), entry.key_bytes.size());
+        index.emplace(hash, entries.begin());
+        byte_count += AES_KEY_CACHE_ENTRY_BYTES;
+
+        while (byte_count > byte_budget && !entries.empty()) {
+            evict(std::prev(entries.end()));
+            eviction_count++;
+        }
+        return expanded;
+    }
+
+    std::shared_ptr<const aes_key> get(const std::string& key, aes_engine engine) {
+        return get(std::as_bytes(std::span<const char>(key)), engine);
+    }
+
+    /**
+     * Evicts every entry. Doesn't count towards evictions().
+     */
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!entries.empty()) {
+            evict(entries.begin());
+        }
+    }
+
+    uint64_t hits() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hit_count;
+    }
+
+    uint64_t misses() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return miss_count;
+    }
+
+    /// @return how many entries were evicted to stay within the budget
+    uint64_t evictions() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return eviction_count;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    /// @return the bytes counted against the budget
+    size_t bytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return byte_count;
+    }
+
+private:
+    struct aes_key_cache_entry {
+        uint64_t hash;
+        aes_engine engine;
+        uint8_t key_size;
+        std::array<uint8_t, 32> key_bytes;
+        std::shared_ptr<const aes_key> key;
+    };
+
+    using aes_key_cache_list = std::list<aes_key_cache_entry>;
+
+    /// What one entry costs: the expanded key, the entry, its list node and its index node.
+    static constexpr size_t AES_KEY_CACHE_ENTRY_BYTES = sizeof(aes_key) + sizeof(aes_key_cache_entry) + 2 * sizeof(void*) + sizeof(std::pair<uint64_t, aes_key_cache_list::iterator>) + 2 * sizeof(void*);
+
+    /**
+     * Spreads keys over the index. The seed is picked per cache so nobody sending keys can pick ones that all land in the same bucket.
+     */
+    uint64_t hash_key(const uint8_t* key, size_t key_size, aes_engine engine) const {
+        uint64_t hash = seed ^ ((uint64_t) engine << 8) ^ key_size;
+        for (size_t i = 0; i < key_size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, key + i, 8);
+            hash = (hash ^ word) * 0xff51afd7ed558ccd;
+            hash ^= hash >> 32;
+        }
+        return hash;
+    }
+
+    /// Called with the mutex held. Moves the entry to the front of the list when it finds one.
+    std::shared_ptr<const aes_key> find(uint64_t hash, const uint8_t* key, size_t key_size, aes_engine engine) {
+        auto [begin, end] = index.equal_range(hash);
+        for (auto it = begin; it != end; it++) {
+            aes_key_cache_entry& entry = *it->second;
+            if (entry.engine == engine && entry.key_size == key_size && aes_constant_time_equal(entry.key_bytes.data(), key, key_size)) {
+                entries.splice(entries.begin(), entries, it->second);
+                return entry.key;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Called with the mutex held.
+    void evict(aes_key_cache_list::iterator entry) {
+        auto [begin, end] = index.equal_range(entry->hash);
+        for (auto it = begin; it != end; it++) {
+            if (it->second == entry) {
+                index.erase(it);
+                break;
+            }
+        }
+        aes_secure_zero(entry->key_bytes.data(), entry->key_bytes.size());
+        entries.erase(entry);
+        byte_count -= AES_KEY_CACHE_ENTRY_BYTES;
+    }
+
+    mutable std::mutex mutex;
+    /// Most recently used first.
+    aes_key_cache_list entries;
+    std::unordered_multimap<uint64_t, aes_key_cache_list::iterator> index;
+    size_t byte_budget;
+    size_t byte_count = 0;
+    uint64_t seed;
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+    uint64_t eviction_count = 0;
+};
+
+#endif
@@ -0,0 +1,626 @@
+#include "daemon.h"
+
+#include <atomic>
+#include <csignal>
+#include <deque>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+/**
+ * aesd: a long running encryption service. Short lived processes would otherwise pay for startup and key expansion on every call,
+ * so the daemon keeps expanded keys in an aes_key_cache and answers requests over a Unix socket (the protocol is described in daemon.h).
+ *
+ * One thread runs an epoll loop that accepts connections, reads and checks requests and queues them. Worker threads take everything that's queued at once (up to --max-batch)
+ * and handle it together: small CTR requests from any connection go through one multi-key aes_ctr_batch call, so many clients sending a few blocks each share the AES pipeline.
+ * Requests aren't held back to wait for a batch to fill, batches form on their own whenever requests arrive faster than a worker takes them.
+ */
+
+struct aesd_options {
+    std::string socket_path = AESD_DEFAULT_SOCKET;
+    size_t threads = 0;
+    aes_engine engine = AES_ENGINE_REFERENCE;
+    size_t max_batch = 256;
+    size_t cache_bytes = AES_KEY_CACHE_DEFAULT_BYTES;
+};
+
+/// CTR requests up to this size are batched. Longer ones already fill the pipeline with their own blocks and go through aes_ctr_process.
+const size_t AESD_CTR_BATCH_MAX_BYTES = 4096;
+/// Stop reading from a connection while this much of its output is waiting to be sent, so a client that doesn't read its responses can't use up memory.
+const size_t AESD_MAX_PENDING_OUTPUT = 64 * 1024 * 1024;
+const size_t AESD_MAX_KEYS_PER_CONNECTION = 4096;
+const size_t AESD_READ_BYTES = 256 * 1024;
+/// How long a shutdown waits for clients to take the responses that are still queued before closing their connections anyway.
+const std::chrono::seconds AESD_SHUTDOWN_FLUSH_TIME(5);
+
+void aesd_usage() {
+    std::cerr << "usage: aesd [-s SOCKET] [-t THREADS] [-e auto|aesni|ttable|bitslice] [--max-batch REQUESTS] [--cache-bytes BYTES]\n"
+                 "  -s SOCKET          socket path, " << AESD_DEFAULT_SOCKET << " by default\n"
+                 "  -t THREADS         worker threads, 0 (the default) for one per hardware thread\n"
+                 "  -e ENGINE          block function for expanded keys, auto (the default) picks the fastest one that passes its self-test\n"
+                 "  --max-batch N      most requests a worker takes at once, 256 by default\n"
+                 "  --cache-bytes N    size of the expanded key cache, 8 MiB by default\n";
+    exit(1);
+}
+
+void aesd_error(const std::string& message) {
+    std::cerr << "AESD ERROR: " << message << '\n';
+    exit(1);
+}
+
+size_t aesd_count_option(const std::string& arg, const std::string& value) {
+    size_t count = 0;
+    if (!aesd_parse_count(value, count)) {
+        aesd_error(arg + " needs a number, not " + value);
+    }
+    return count;
+}
+
+aesd_options aesd_parse_options(int argc, char** argv) {
+    aesd_options options;
+    bool engine_given = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help" || i + 1 == argc) {
+            aesd_usage();
+        }
+
+        std::string value = argv[++i];
+        if (arg == "-s") {
+            options.socket_path = value;
+        }
+        else if (arg == "-t") {
+            options.threads = aesd_count_option(arg, value);
+        }
+        else if (arg == "-e") {
+            const aes_backend* backend = aes_find_backend(value);
+            if (backend && backend->engine != AES_ENGINE_REFERENCE) {
+                options.engine = backend->engine;
+                engine_given = true;
+            }
+            else if (value != "auto") {
+                aesd_error("Unknown engine " + value);
+            }
+        }
+        else if (arg == "--max-batch") {
+            options.max_batch = std::max<size_t>(1, aesd_count_option(arg, value));
+        }
+        else if (arg == "--cache-bytes") {
+            options.cache_bytes = aesd_count_option(arg, value);
+        }
+        else {
+            aesd_usage();
+        }
+    }
+
+    if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (!engine_given) {
+        options.engine = aes_select_engine(AES_OPERATION_BULK);
+    }
+    else if (options.engine == AES_ENGINE_AES_NI && !aes_ni_supported()) {
+        aesd_error("This CPU doesn't support AES-NI");
+    }
+
+    return options;
+}
+
+/**
+ * A key loaded on a connection. AESD_OP_LOAD_KEY only copies it here, and the first worker to handle a request with it expands it through the key cache,
+ * so a miss in the cache never holds up the event loop.
+ */
+struct aesd_loaded_key {
+    std::once_flag expand_once;
+    /// Zeroed once expanded.
+    uint8_t bytes[32] = {};
+    size_t size = 0;
+    std::shared_ptr<const aes_key> expanded;
+
+    ~aesd_loaded_key() {
+        aes_secure_zero(bytes, sizeof(bytes));
+    }
+};
+
+/**
+ * A client connection. The input buffer and keys belong to the event loop thread, the output is shared with the workers that send responses.
+ */
+struct aesd_connection {
+    int fd;
+    std::vector<uint8_t> input;
+    std::vector<std::shared_ptr<aesd_loaded_key>> keys;
+
+    std::mutex mutex;
+    std::vector<uint8_t> output;
+    size_t output_sent = 0;
+    /// The epoll events currently asked for.
+    uint32_t events = EPOLLIN;
+    /// Set while shutting down, when only the output is waited for.
+    bool draining = false;
+    bool closed = false;
+};
+
+/**
+ * An encrypt or decrypt request that passed the checks and is waiting for a worker.
+ */
+struct aesd_job {
+    std::shared_ptr<aesd_connection> connection;
+    std::shared_ptr<aesd_loaded_key> key;
+    aesd_request_header header;
+    /// The whole response frame. The request payload is copied to where the response payload goes and processed in place.
+    std::vector<uint8_t> frame;
+
+    std::span<uint8_t> payload() {
+        return std::span<uint8_t>(frame).subspan(4 + AESD_RESPONSE_HEADER_BYTES);
+    }
+};
+
+struct aesd_server {
+    explicit aesd_server(const aesd_options& options) : options(options), cache(options.cache_bytes) {}
+
+    aesd_server(const aesd_server&) = delete;
+    aesd_server& operator=(const aesd_server&) = delete;
+
+    /**
+     * Listens on the socket and serves requests until SIGINT or SIGTERM. Requests already read when the signal comes are still answered.
+     */
+    void run() {
+        listen_socket();
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            aesd_error(std::string("epoll_create1 failed: ") + std::strerror(errno));
+        }
+
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigprocmask(SIG_BLOCK, &signals, nullptr);
+        signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = listen_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+        event.data.fd = signal_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+        /// The workers start after the signals are blocked so the signals only ever go to the signalfd.
+        for (size_t worker = 0; worker < options.threads; worker++) {
+            workers.emplace_back(&aesd_server::worker_main, this);
+        }
+
+        std::cerr << "aesd: listening on " << options.socket_path << " with " << options.threads << " worker threads and the " << aes_engine_name(options.engine) << " engine\n";
+        event_loop();
+
+        /// The workers finish everything in the queue before they stop, then the responses they queued are sent before the connections close.
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        flush_before_closing();
+
+        for (auto& [fd, connection] : connections) {
+            close_connection(connection);
+        }
+        close(listen_fd);
+        close(signal_fd);
+        close(epoll_fd);
+        unlink(options.socket_path.c_str());
+
+        std::cerr << "aesd: " << requests << " requests, " << batched << " batched CTR requests in " << batches << " batches, "
+                  << cache.hits() << " key cache hits, " << cache.misses() << " misses\n";
+    }
+
+private:
+    void listen_socket() {
+        sockaddr_un socket_address;
+        if (!aesd_make_address(options.socket_path, socket_address)) {
+            aesd_error("The socket path " + options.socket_path + " is too long");
+        }
+
+        /// A socket file nobody is listening on is left over from a daemon that didn't shut down cleanly. One that answers belongs to a running daemon.
+        int existing = aesd_connect(options.socket_path);
+        if (existing >= 0) {
+            close(existing);
+            aesd_error("Another daemon is already listening on " + options.socket_path);
+        }
+        unlink(options.socket_path.c_str());
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            aesd_error(std::string("socket failed: ") + std::strerror(errno));
+        }
+        /// Keys are sent over the socket, so only the user running the daemon may connect.
+        mode_t old_mask = umask(0077);
+        int bound = bind(listen_fd, (const sockaddr*) &socket_address, sizeof(socket_address));
+        umask(old_mask);
+        if (bound < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+            aesd_error("Can't listen on " + options.socket_path + ": " + std::strerror(errno));
+        }
+    }
+
+    void event_loop() {
+        epoll_event events[64];
+        std::vector<aesd_job> jobs;
+        bool signalled = false;
+
+        while (!signalled) {
+            int count = epoll_wait(epoll_fd, events, 64, -1);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                aesd_error(std::string("epoll_wait failed: ") + std::strerror(errno));
+            }
+
+            for (int index = 0; index < count; index++) {
+                int fd = events[index].data.fd;
+                /// The rest of the events are still handled, so requests already read get queued and answered.
+                if (fd == signal_fd) {
+                    signalled = true;
+                    continue;
+                }
+                if (fd == listen_fd) {
+                    accept_connections();
+                    continue;
+                }
+
+                auto found = connections.find(fd);
+                if (found == connections.end()) {
+                    continue;
+                }
+                std::shared_ptr<aesd_connection> connection = found->second;
+                if (events[index].events & EPOLLOUT) {
+                    std::lock_guard<std::mutex> lock(connection->mutex);
+                    flush(*connection);
+                }
+                if (events[index].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    if (!read_requests(connection, jobs)) {
+                        close_connection(connection);
+                        connections.erase(fd);
+                    }
+                }
+            }
+
+            /// Everything read in this pass is queued at once so a worker can take it as one batch.
+            if (!jobs.empty()) {
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    for (aesd_job& job : jobs) {
+                        queue.push_back(std::move(job));
+                    }
+                }
+                queue_ready.notify_one();
+                jobs.clear();
+            }
+        }
+    }
+
+    void accept_connections() {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+
+            std::shared_ptr<aesd_connection> connection = std::make_shared<aesd_connection>();
+            connection->fd = fd;
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            connections[fd] = connection;
+        }
+    }
+
+    /**
+     * Waits up to AESD_SHUTDOWN_FLUSH_TIME for every connection to take its queued responses. Connections stop being read from first, so only the output is left.
+     */
+    void flush_before_closing() {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, signal_fd, nullptr);
+
+        auto deadline = std::chrono::steady_clock::now() + AESD_SHUTDOWN_FLUSH_TIME;
+        epoll_event events[64];
+        while (true) {
+            size_t waiting = 0;
+            for (auto& [fd, connection] : connections) {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                connection->draining = true;
+                flush(*connection);
+                waiting += connection->output_sent < connection->output.size();
+            }
+
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (waiting == 0 || left.count() <= 0) {
+                return;
+            }
+
+            int count = epoll_wait(epoll_fd, events, 64, left.count());
+            for (int index = 0; index < count; index++) {
+                auto found = connections.find(events[index].data.fd);
+                if (found != connections.end() && (events[index].events & (EPOLLHUP | EPOLLERR))) {
+                    close_connection(found->second);
+                    connections.erase(found);
+                }
+            }
+        }
+    }
+
+    void close_connection(const std::shared_ptr<aesd_connection>& connection) {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        if (connection->closed) {
+            return;
+        }
+        connection->closed = true;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+        close(connection->fd);
+        aes_secure_zero(connection->input.data(), connection->input.size());
+    }
+
+    /**
+     * Reads what's available and turns every complete frame into a job or an immediate response.
+     * @return false if the connection should be closed: the client hung up, or sent something that isn't a frame
+     */
+    bool read_requests(const std::shared_ptr<aesd_connection>& connection, std::vector<aesd_job>& jobs) {
+        std::vector<uint8_t>& input = connection->input;
+        size_t used = input.size();
+        input.resize(used + AESD_READ_BYTES);
+        ssize_t received = read(connection->fd, input.data() + used, AESD_READ_BYTES);
+        input.resize(used + std::max<ssize_t>(received, 0));
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR)) {
+            return false;
+        }
+
+        size_t position = 0;
+        bool valid = true;
+        while (input.size() - position >= 4) {
+            size_t length = aesd_get_u32(input.data() + position);
+            if (length < AESD_REQUEST_HEADER_BYTES || length - AESD_REQUEST_HEADER_BYTES > AESD_MAX_PAYLOAD_BYTES) {
+                valid = false;
+                break;
+            }
+            if (input.size() - position - 4 < length) {
+                break;
+            }
+
+            const uint8_t* frame = input.data() + position + 4;
+            handle_request(connection, aesd_decode_request(frame), frame + AESD_REQUEST_HEADER_BYTES, length - AESD_REQUEST_HEADER_BYTES, jobs);
+            /// The payload may be a key.
+            aes_secure_zero(input.data() + position, length + 4);
+            position += length + 4;
+        }
+        input.erase(input.begin(), input.begin() + position);
+        if (input.capacity() > 2 * (AESD_MAX_PAYLOAD_BYTES + AESD_READ_BYTES) && input.size() < AESD_READ_BYTES) {
+            input.shrink_to_fit();
+        }
+
+        return valid;
+    }
+
+    void handle_request(const std::shared_ptr<aesd_connection>& connection, const aesd_request_header& header, const uint8_t* payload, size_t length, std::vector<aesd_job>& jobs) {
+        requests++;
+
+        if (header.op == AESD_OP_LOAD_KEY) {
+            if (length != 16 && length != 24 && length != 32) {
+                respond_error(connection, header, AESD_STATUS_BAD_REQUEST, "Keys must be 16, 24 or 32 bytes");
+                return;
+            }
+            if (connection->keys.size() == AESD_MAX_KEYS_PER_CONNECTION) {
+                respond_error(connection, header, AESD_STATUS_BAD_REQUEST, "Too many keys on one connection");
+                return;
+            }
+
+            /// Expanding it is left to the workers, see aesd_loaded_key.
+            std::shared_ptr<aesd_loaded_key> key = std::make_shared<aesd_loaded_key>();
+            std::memcpy(key->bytes, payload, length);
+            key->size = length;
+            connection->keys.push_back(std::move(key));
+            uint8_t key_id[4];
+            aesd_put_u32(key_id, connection->keys.size() - 1);
+            respond(connection, {header.id, AESD_STATUS_OK}, key_id, 4);
+            return;
+        }
+
+        if ((header.op != AESD_OP_ENCRYPT && header.op != AESD_OP_DECRYPT) || header.mode > AESD_MODE_CTR) {
+            respond_error(connection, header, AESD_STATUS_BAD_REQUEST, "Unknown op or mode");
+            return;
+        }
+        if (header.key_id >= connection->keys.size()) {
+            respond_error(connection, header, AESD_STATUS_UNKNOWN_KEY, "Unknown key id");
+            return;
+        }
+        if (header.mode != AESD_MODE_CTR && length % 16) {
+            respond_error(connection, header, AESD_STATUS_BAD_LENGTH, "ECB and CBC need a multiple of 16 bytes");
+            return;
+        }
+
+        aesd_job job;
+        job.connection = connection;
+        job.key = connection->keys[header.key_id];
+        job.header = header;
+        job.frame.resize(4 + AESD_RESPONSE_HEADER_BYTES + length);
+        std::memcpy(job.payload().data(), payload, length);
+        jobs.push_back(std::move(job));
+    }
+
+    void respond(const std::shared_ptr<aesd_connection>& connection, const aesd_response_header& header, const uint8_t* payload, size_t length) {
+        std::vector<uint8_t> frame(4 + AESD_RESPONSE_HEADER_BYTES + length);
+        aesd_encode_response_header(frame.data(), header, length);
+        if (length) {
+            std::memcpy(frame.data() + 4 + AESD_RESPONSE_HEADER_BYTES, payload, length);
+        }
+        send(*connection, frame);
+    }
+
+    void respond_error(const std::shared_ptr<aesd_connection>& connection, const aesd_request_header& header, aesd_status status, const std::string& message) {
+        respond(connection, {header.id, status}, (const uint8_t*) message.data(), message.size());
+    }
+
+    /**
+     * Queues a response frame and sends as much as the socket takes. Called from the loop and from the workers.
+     */
+    void send(aesd_connection& connection, const std::vector<uint8_t>& frame) {
+        std::lock_guard<std::mutex> lock(connection.mutex);
+        if (connection.closed) {
+            return;
+        }
+        connection.output.insert(connection.output.end(), frame.begin(), frame.end());
+        flush(connection);
+    }
+
+    /**
+     * Writes pending output until the socket is full, then asks epoll for the events that fit what's left. Needs the connection's mutex.
+     */
+    void flush(aesd_connection& connection) {
+        if (connection.closed) {
+            return;
+        }
+
+        while (connection.output_sent < connection.output.size()) {
+            ssize_t written = ::send(connection.fd, connection.output.data() + connection.output_sent, connection.output.size() - connection.output_sent, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN) {
+                    /// The loop sees the hang up and closes the connection.
+                    connection.output.clear();
+                    connection.output_sent = 0;
+                }
+                break;
+            }
+            connection.output_sent += written;
+        }
+
+        size_t pending = connection.output.size() - connection.output_sent;
+        if (pending == 0) {
+            connection.output.clear();
+            connection.output_sent = 0;
+        }
+
+        uint32_t events = (pending < AESD_MAX_PENDING_OUTPUT && !connection.draining ? (uint32_t) EPOLLIN : 0) | (pending ? (uint32_t) EPOLLOUT : 0);
+        if (events != connection.events) {
+            connection.events = events;
+            epoll_event event = {};
+            event.events = events;
+            event.data.fd = connection.fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+        }
+    }
+
+    void worker_main() {
+        std::vector<aesd_job> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                /// Only stop once the queue is empty, so every request that was accepted gets its response.
+                if (queue.empty()) {
+                    return;
+                }
+
+                size_t count = std::min(options.max_batch, queue.size());
+                for (size_t index = 0; index < count; index++) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+                if (!queue.empty()) {
+                    queue_ready.notify_one();
+                }
+            }
+
+            process_batch(batch);
+            batch.clear();
+        }
+    }
+
+    /// @return <b>key</b> expanded, by this call if it's the first to need it
+    const aes_key& expand(aesd_loaded_key& key) {
+        std::call_once(key.expand_once, [&] {
+            key.expanded = cache.get(std::span<const std::byte>((const std::byte*) key.bytes, key.size), options.engine);
+            aes_secure_zero(key.bytes, sizeof(key.bytes));
+        });
+        return *key.expanded;
+    }
+
+    void process_batch(std::vector<aesd_job>& batch) {
+        std::vector<aes_expanded_batch_item> ctr_items;
+        for (aesd_job& job : batch) {
+            std::span<uint8_t> payload = job.payload();
+            const aesd_request_header& header = job.header;
+            const aes_key& key = expand(*job.key);
+
+            if (header.mode == AESD_MODE_CTR && payload.size() <= AESD_CTR_BATCH_MAX_BYTES) {
+                std::span<std::byte> data = std::as_writable_bytes(payload);
+                ctr_items.push_back({&key, std::as_bytes(std::span<const uint8_t>(header.iv)), data, data});
+                continue;
+            }
+
+            if (header.mode == AESD_MODE_CTR) {
+                aes_ctr_counter counter = aes_ctr_make_counter(std::as_bytes(std::span<const uint8_t, 16>(header.iv)));
+                aes_ctr_process(key, counter, 0, payload.data(), payload.data(), payload.size());
+            }
+            else if (header.mode == AESD_MODE_CBC) {
+                std::array<uint32_t, 4> chaining;
+                aes_load_blocks(header.iv, chaining.data(), 1);
+                if (header.op == AESD_OP_ENCRYPT) {
+                    aes_cbc_encrypt_process(key, chaining, payload.data(), payload.data(), payload.size());
+                }
+                else {
+                    aes_cbc_decrypt_process(key, chaining, payload.data(), payload.data(), payload.size());
+                }
+            }
+            else if (header.op == AESD_OP_ENCRYPT) {
+                aes_ecb_encrypt_process(key, payload.data(), payload.data(), payload.size());
+            }
+            else {
+                aes_ecb_decrypt_process(key, payload.data(), payload.data(), payload.size());
+            }
+        }
+
+        if (!ctr_items.empty()) {
+            aes_ctr_batch(std::span<const aes_expanded_batch_item>(ctr_items));
+            batches++;
+            batched += ctr_items.size();
+        }
+
+        for (aesd_job& job : batch) {
+            aesd_encode_response_header(job.frame.data(), {job.header.id, AESD_STATUS_OK}, job.payload().size());
+            send(*job.connection, job.frame);
+        }
+    }
+
+    aesd_options options;
+    aes_key_cache cache;
+
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int signal_fd = -1;
+    /// Only used by the loop thread.
+    std::unordered_map<int, std::shared_ptr<aesd_connection>> connections;
+
+    std::vector<std::thread> workers;
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<aesd_job> queue;
+    bool stopping = false;
+
+    std::atomic<uint64_t> requests = 0;
+    std::atomic<uint64_t> batches = 0;
+    std::atomic<uint64_t> batched = 0;
+};
+
+int main(int argc, char** argv) {
+    aesd_options options = aesd_parse_options(argc, argv);
+    aesd_server server(options);
+    server.run();
+    return 0;
+}
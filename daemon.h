@@ -0,0 +1,205 @@
+#ifndef AES_DAEMON_H
+#define AES_DAEMON_H
+
+#include "aes.h"
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * The protocol between aesd (daemon.cpp) and its clients, over a Unix domain stream socket.
+ *
+ * Every message is a frame: a 4 byte length followed by that many bytes. All integers are little endian.
+ * A request frame is a 28 byte header then the payload:
+ *   id (4)     - chosen by the client and copied into the response, responses can come back in any order
+ *   op (1)     - an aesd_op
+ *   mode (1)   - an aesd_mode, ignored by AESD_OP_LOAD_KEY
+ *   unused (2) - zero
+ *   key id (4) - from an earlier AESD_OP_LOAD_KEY on the same connection
+ *   iv (16)    - the CBC IV or the initial CTR counter block (with a 32-bit counter), ignored by ECB
+ * A response frame is an 8 byte header then the payload:
+ *   id (4)     - the request's id
+ *   status (1) - an aesd_status
+ *   unused (3) - zero
+ *
+ * AESD_OP_LOAD_KEY takes the 16, 24 or 32 byte key as its payload and responds with a 4 byte key id. Keys are expanded once, by the first request that uses them,
+ * and stay expanded until the connection closes.
+ * Encrypt and decrypt respond with the processed payload, which is the same size. ECB and CBC payloads must be a multiple of 16 bytes, there is no padding.
+ * Errors respond with a message as the payload.
+ */
+
+const char* const AESD_DEFAULT_SOCKET = "/tmp/aesd.sock";
+
+const size_t AESD_REQUEST_HEADER_BYTES = 28;
+const size_t AESD_RESPONSE_HEADER_BYTES = 8;
+/// The biggest payload the daemon accepts. A bigger frame is a protocol error and closes the connection.
+const size_t AESD_MAX_PAYLOAD_BYTES = 16 * 1024 * 1024;
+
+enum aesd_op : uint8_t {
+    AESD_OP_LOAD_KEY = 1,
+    AESD_OP_ENCRYPT = 2,
+    AESD_OP_DECRYPT = 3
+};
+
+enum aesd_mode : uint8_t {
+    AESD_MODE_ECB = 0,
+    AESD_MODE_CBC = 1,
+    AESD_MODE_CTR = 2
+};
+
+enum aesd_status : uint8_t {
+    AESD_STATUS_OK = 0,
+    /// Unknown op or mode, or a payload that doesn't fit the op (e.g. a key of the wrong size).
+    AESD_STATUS_BAD_REQUEST = 1,
+    AESD_STATUS_UNKNOWN_KEY = 2,
+    /// An ECB or CBC payload that isn't a multiple of 16 bytes.
+    AESD_STATUS_BAD_LENGTH = 3
+};
+
+struct aesd_request_header {
+    uint32_t id = 0;
+    aesd_op op = AESD_OP_ENCRYPT;
+    aesd_mode mode = AESD_MODE_CTR;
+    uint32_t key_id = 0;
+    uint8_t iv[16] = {};
+};
+
+struct aesd_response_header {
+    uint32_t id = 0;
+    aesd_status status = AESD_STATUS_OK;
+};
+
+inline void aesd_put_u32(uint8_t* out, uint32_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+inline uint32_t aesd_get_u32(const uint8_t* in) {
+    return in[0] | ((uint32_t) in[1] << 8) | ((uint32_t) in[2] << 16) | ((uint32_t) in[3] << 24);
+}
+
+/**
+ * For the numeric command line options of aesd and aesd_load.
+ * @param value - the option's value
+ * @param count - receives the value
+ * @return false unless <b>value</b> is all digits and fits in a size_t
+ */
+inline bool aesd_parse_count(const std::string& value, size_t& count) {
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    try {
+        count = std::stoull(value);
+    }
+    catch (const std::out_of_range&) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @param out - the frame is appended to this
+ * @param header - the request header
+ * @param payload - the payload, may be null if <b>length</b> is 0
+ * @param length - the payload size
+ */
+inline void aesd_encode_request(std::vector<uint8_t>& out, const aesd_request_header& header, const uint8_t* payload, size_t length) {
+    size_t start = out.size();
+    out.resize(start + 4 + AESD_REQUEST_HEADER_BYTES + length);
+    uint8_t* frame = out.data() + start;
+
+    aesd_put_u32(frame, AESD_REQUEST_HEADER_BYTES + length);
+    aesd_put_u32(frame + 4, header.id);
+    frame[8] = header.op;
+    frame[9] = header.mode;
+    frame[10] = 0;
+    frame[11] = 0;
+    aesd_put_u32(frame + 12, header.key_id);
+    std::memcpy(frame + 16, header.iv, 16);
+    if (length) {
+        std::memcpy(frame + 4 + AESD_REQUEST_HEADER_BYTES, payload, length);
+    }
+}
+
+/**
+ * @param frame - the frame after its length, at least AESD_REQUEST_HEADER_BYTES long
+ * @return the header, op and mode aren't checked
+ */
+inline aesd_request_header aesd_decode_request(const uint8_t* frame) {
+    aesd_request_header header;
+    header.id = aesd_get_u32(frame);
+    header.op = (aesd_op) frame[4];
+    header.mode = (aesd_mode) frame[5];
+    header.key_id = aesd_get_u32(frame + 8);
+    std::memcpy(header.iv, frame + 12, 16);
+    return header;
+}
+
+/**
+ * @param frame - where the frame goes, 4 + AESD_RESPONSE_HEADER_BYTES + <b>length</b> bytes. The payload can already be in place, then it isn't touched.
+ * @param header - the response header
+ * @param length - the payload size
+ */
+inline void aesd_encode_response_header(uint8_t* frame, const aesd_response_header& header, size_t length) {
+    aesd_put_u32(frame, AESD_RESPONSE_HEADER_BYTES + length);
+    aesd_put_u32(frame + 4, header.id);
+    frame[8] = header.status;
+    frame[9] = 0;
+    frame[10] = 0;
+    frame[11] = 0;
+}
+
+/**
+ * @param frame - the frame after its length, at least AESD_RESPONSE_HEADER_BYTES long
+ */
+inline aesd_response_header aesd_decode_response(const uint8_t* frame) {
+    aesd_response_header header;
+    header.id = aesd_get_u32(frame);
+    header.status = (aesd_status) frame[4];
+    return header;
+}
+
+/**
+ * @param path - the socket path
+ * @param socket_address - filled in with the address
+ * @return false if the path is too long for a Unix socket address
+ */
+inline bool aesd_make_address(const std::string& path, sockaddr_un& socket_address) {
+    socket_address = {};
+    socket_address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(socket_address.sun_path)) {
+        return false;
+    }
+    std::memcpy(socket_address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/**
+ * @param path - the daemon's socket path
+ * @return a blocking socket connected to the daemon, or -1 with errno set
+ */
+inline int aesd_connect(const std::string& path) {
+    sockaddr_un socket_address;
+    if (!aesd_make_address(path, socket_address)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const sockaddr*) &socket_address, sizeof(socket_address)) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+#endif
@@ -0,0 +1,357 @@
+#include "daemon.h"
+
+#include <chrono>
+#include <iomanip>
+
+/**
+ * aesd_load: a load generator for aesd. Every connection runs on its own thread, loads its keys, then keeps --depth requests in flight
+ * and times each one from being written to its response being read. At the end it prints the throughput and the latency percentiles across all connections.
+ */
+
+struct aesd_load_options {
+    std::string socket_path = AESD_DEFAULT_SOCKET;
+    size_t connections = 4;
+    size_t depth = 16;
+    size_t requests = 100000;
+    size_t size = 64;
+    aesd_mode mode = AESD_MODE_CTR;
+    size_t key_size = 16;
+    size_t keys = 1;
+    bool verify = false;
+    std::string format = "text";
+};
+
+void aesd_load_usage() {
+    std::cerr << "usage: aesd_load [-s SOCKET] [-c CONNECTIONS] [-d DEPTH] [-n REQUESTS] [--size BYTES] [-m ecb|cbc|ctr] [--key-size 16|24|32] [--keys KEYS] [--verify] [--format text|json]\n"
+                 "  -s SOCKET        the daemon's socket, " << AESD_DEFAULT_SOCKET << " by default\n"
+                 "  -c CONNECTIONS   concurrent connections, each on its own thread, 4 by default\n"
+                 "  -d DEPTH         requests in flight on each connection, 16 by default\n"
+                 "  -n REQUESTS      requests per connection, 100000 by default\n"
+                 "  --size BYTES     payload of each request, 64 by default\n"
+                 "  -m MODE          ctr (the default), ecb or cbc\n"
+                 "  --key-size BYTES 16 (the default), 24 or 32\n"
+                 "  --keys KEYS      keys per connection, requests take turns using them, 1 by default\n"
+                 "  --verify         check every response against the library\n"
+                 "  --format FORMAT  text (the default) or json\n";
+    exit(1);
+}
+
+void aesd_load_error(const std::string& message) {
+    std::cerr << "AESD LOAD ERROR: " << message << '\n';
+    exit(1);
+}
+
+size_t aesd_load_count_option(const std::string& arg, const std::string& value) {
+    size_t count = 0;
+    if (!aesd_parse_count(value, count)) {
+        aesd_load_error(arg + " needs a number, not " + value);
+    }
+    return count;
+}
+
+aesd_load_options aesd_load_parse_options(int argc, char** argv) {
+    aesd_load_options options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--verify") {
+            options.verify = true;
+            continue;
+        }
+        if (arg == "-h" || arg == "--help" || i + 1 == argc) {
+            aesd_load_usage();
+        }
+
+        std::string value = argv[++i];
+        if (arg == "-s") {
+            options.socket_path = value;
+        }
+        else if (arg == "-c") {
+            options.connections = std::max<size_t>(1, aesd_load_count_option(arg, value));
+        }
+        else if (arg == "-d") {
+            options.depth = std::max<size_t>(1, aesd_load_count_option(arg, value));
+        }
+        else if (arg == "-n") {
+            options.requests = aesd_load_count_option(arg, value);
+        }
+        else if (arg == "--size") {
+            options.size = aesd_load_count_option(arg, value);
+        }
+        else if (arg == "-m") {
+            if (value == "ecb") {
+                options.mode = AESD_MODE_ECB;
+            }
+            else if (value == "cbc") {
+                options.mode = AESD_MODE_CBC;
+            }
+            else if (value == "ctr") {
+                options.mode = AESD_MODE_CTR;
+            }
+            else {
+                aesd_load_error("Unknown mode " + value);
+            }
+        }
+        else if (arg == "--key-size") {
+            options.key_size = aesd_load_count_option(arg, value);
+        }
+        else if (arg == "--keys") {
+            options.keys = std::max<size_t>(1, aesd_load_count_option(arg, value));
+        }
+        else if (arg == "--format") {
+            options.format = value;
+        }
+        else {
+            aesd_load_usage();
+        }
+    }
+
+    if (options.key_size != 16 && options.key_size != 24 && options.key_size != 32) {
+        aesd_load_error("The key size must be 16, 24 or 32");
+    }
+    if (options.mode != AESD_MODE_CTR && options.size % 16) {
+        aesd_load_error("ECB and CBC need a multiple of 16 bytes");
+    }
+    if (options.size > AESD_MAX_PAYLOAD_BYTES) {
+        aesd_load_error("The size is bigger than the daemon accepts");
+    }
+    if (options.format != "text" && options.format != "json") {
+        aesd_load_error("Unknown format " + options.format);
+    }
+
+    return options;
+}
+
+void aesd_load_write(int fd, const std::vector<uint8_t>& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t count = write(fd, data.data() + written, data.size() - written);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            aesd_load_error(std::string("Write to the daemon failed: ") + std::strerror(errno));
+        }
+        written += count;
+    }
+}
+
+/**
+ * Reads response frames off a connection, buffering whatever comes after the frame that was asked for.
+ */
+struct aesd_load_reader {
+    explicit aesd_load_reader(int fd) : fd(fd) {}
+
+    /**
+     * @param payload - receives the response payload
+     * @return the response header
+     */
+    aesd_response_header next(std::vector<uint8_t>& payload) {
+        fill(4);
+        size_t length = aesd_get_u32(buffer.data() + position);
+        if (length < AESD_RESPONSE_HEADER_BYTES) {
+            aesd_load_error("The daemon sent a frame that's too short");
+        }
+        fill(4 + length);
+
+        const uint8_t* frame = buffer.data() + position + 4;
+        aesd_response_header header = aesd_decode_response(frame);
+        payload.assign(frame + AESD_RESPONSE_HEADER_BYTES, frame + length);
+        position += 4 + length;
+        return header;
+    }
+
+private:
+    void fill(size_t needed) {
+        if (position && buffer.size() - position < needed) {
+            buffer.erase(buffer.begin(), buffer.begin() + position);
+            position = 0;
+        }
+        while (buffer.size() - position < needed) {
+            size_t used = buffer.size();
+            buffer.resize(used + std::max<size_t>(needed, 64 * 1024));
+            ssize_t count = read(fd, buffer.data() + used, buffer.size() - used);
+            buffer.resize(used + std::max<ssize_t>(count, 0));
+            if (count == 0) {
+                aesd_load_error("The daemon closed the connection");
+            }
+            if (count < 0 && errno != EINTR) {
+                aesd_load_error(std::string("Read from the daemon failed: ") + std::strerror(errno));
+            }
+        }
+    }
+
+    int fd;
+    std::vector<uint8_t> buffer;
+    size_t position = 0;
+};
+
+struct aesd_load_result {
+    /// Nanoseconds from writing each request to reading its response.
+    std::vector<double> latencies;
+    size_t mismatches = 0;
+};
+
+/**
+ * Runs one connection's share of the load.
+ */
+void aesd_load_connection(const aesd_load_options& options, size_t connection_index, aesd_load_result& result) {
+    int fd = aesd_connect(options.socket_path);
+    if (fd < 0) {
+        aesd_load_error("Can't connect to " + options.socket_path + ": " + std::strerror(errno));
+    }
+    aesd_load_reader reader(fd);
+    std::mt19937_64 random(connection_index + 1);
+    std::vector<uint8_t> frames;
+    std::vector<uint8_t> payload;
+
+    /// Load the keys one at a time, the ids come back in the responses.
+    std::vector<std::string> keys(options.keys);
+    std::vector<uint32_t> key_ids(options.keys);
+    std::vector<aes_key> expanded_keys;
+    for (size_t key = 0; key < options.keys; key++) {
+        keys[key].resize(options.key_size);
+        for (char& byte : keys[key]) {
+            byte = (char) random();
+        }
+        if (options.verify) {
+            expanded_keys.push_back(aes_expand_key(keys[key], aes_select_engine(AES_OPERATION_KEY_EXPANSION)));
+        }
+
+        aesd_request_header header;
+        header.id = key;
+        header.op = AESD_OP_LOAD_KEY;
+        frames.clear();
+        aesd_encode_request(frames, header, (const uint8_t*) keys[key].data(), keys[key].size());
+        aesd_load_write(fd, frames);
+        if (reader.next(payload).status != AESD_STATUS_OK || payload.size() != 4) {
+            aesd_load_error("The daemon didn't load a key");
+        }
+        key_ids[key] = aesd_get_u32(payload.data());
+    }
+
+    std::vector<uint8_t> message(options.size);
+    for (uint8_t& byte : message) {
+        byte = random();
+    }
+
+    /// The IV of each request is derived from its id, so a response can be checked without remembering the request.
+    auto make_header = [&](uint32_t id) {
+        aesd_request_header header;
+        header.id = id;
+        header.op = AESD_OP_ENCRYPT;
+        header.mode = options.mode;
+        header.key_id = key_ids[id % options.keys];
+        aesd_put_u32(header.iv, id);
+        aesd_put_u32(header.iv + 4, connection_index);
+        return header;
+    };
+
+    std::vector<std::chrono::steady_clock::time_point> sent(options.requests);
+    result.latencies.reserve(options.requests);
+    size_t next = 0;
+    size_t received = 0;
+    while (received < options.requests) {
+        /// Top up to the full depth with one write.
+        frames.clear();
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while (next < options.requests && next - received < options.depth) {
+            aesd_encode_request(frames, make_header(next), message.data(), message.size());
+            sent[next++] = now;
+        }
+        if (!frames.empty()) {
+            aesd_load_write(fd, frames);
+        }
+
+        aesd_response_header response = reader.next(payload);
+        std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+        if (response.status != AESD_STATUS_OK || response.id >= next) {
+            aesd_load_error("The daemon failed a request: " + std::string(payload.begin(), payload.end()));
+        }
+        result.latencies.push_back(std::chrono::duration<double, std::nano>(done - sent[response.id]).count());
+        received++;
+
+        if (options.verify) {
+            aesd_request_header header = make_header(response.id);
+            const aes_key& key = expanded_keys[response.id % options.keys];
+            std::vector<uint8_t> expected = message;
+            if (options.mode == AESD_MODE_CTR) {
+                aes_ctr_process(key, aes_ctr_make_counter(std::as_bytes(std::span<const uint8_t, 16>(header.iv))), 0, expected.data(), expected.data(), expected.size());
+            }
+            else if (options.mode == AESD_MODE_CBC) {
+                std::array<uint32_t, 4> chaining;
+                aes_load_blocks(header.iv, chaining.data(), 1);
+                aes_cbc_encrypt_process(key, chaining, expected.data(), expected.data(), expected.size());
+            }
+            else {
+                aes_ecb_encrypt_process(key, expected.data(), expected.data(), expected.size());
+            }
+            result.mismatches += payload != expected;
+        }
+    }
+
+    close(fd);
+}
+
+double aesd_load_percentile(const std::vector<double>& sorted, double quantile) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t) (quantile * sorted.size()))];
+}
+
+int main(int argc, char** argv) {
+    aesd_load_options options = aesd_load_parse_options(argc, argv);
+
+    std::vector<aesd_load_result> results(options.connections);
+    std::vector<std::thread> threads;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t connection = 0; connection < options.connections; connection++) {
+        threads.emplace_back(aesd_load_connection, std::cref(options), connection, std::ref(results[connection]));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> latencies;
+    size_t mismatches = 0;
+    for (const aesd_load_result& result : results) {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        mismatches += result.mismatches;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double requests_per_second = latencies.size() / seconds;
+    double megabytes_per_second = latencies.size() * options.size / seconds / 1e6;
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    const char* quantile_names[] = {"p50", "p90", "p99", "p999"};
+
+    if (options.format == "json") {
+        std::cout << "{\"requests\": " << latencies.size() << ", \"seconds\": " << seconds << ", \"requests_per_second\": " << requests_per_second
+                  << ", \"megabytes_per_second\": " << megabytes_per_second;
+        for (size_t index = 0; index < 4; index++) {
+            std::cout << ", \"" << quantile_names[index] << "_us\": " << aesd_load_percentile(latencies, quantiles[index]) / 1000;
+        }
+        std::cout << ", \"max_us\": " << (latencies.empty() ? 0 : latencies.back() / 1000);
+        if (options.verify) {
+            std::cout << ", \"mismatches\": " << mismatches;
+        }
+        std::cout << "}\n";
+    }
+    else {
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << latencies.size() << " requests of " << options.size << " bytes in " << seconds << " s: " << requests_per_second << " requests/s, "
+                  << megabytes_per_second << " MB/s\n";
+        std::cout << "latency us:";
+        for (size_t index = 0; index < 4; index++) {
+            std::cout << ' ' << quantile_names[index] << ' ' << aesd_load_percentile(latencies, quantiles[index]) / 1000;
+        }
+        std::cout << " max " << (latencies.empty() ? 0 : latencies.back() / 1000) << '\n';
+        if (options.verify) {
+            std::cout << mismatches << " responses didn't match\n";
+        }
+    }
+
+    return mismatches ? 2 : 0;
+}
@@ -1,806 +1,575 @@
-#include <iostream>
-#include <climits>
-#include <vector>
-#include <bitset>
-
-/// Source: https://en.wikipedia.org/wiki/Circular_shift#Implementing_circular_shifts
-uint32_t rotateleft (uint32_t value, unsigned int count) {
-    const unsigned int mask = CHAR_BIT * sizeof(value) - 1;
-     count &= mask;
-    return (value << count) | (value >> (-count & mask));
-}
-
-std::vector<uint32_t> convert_be(const std::string& data) {
-    int bits = 0;
-
-    std::vector<uint32_t> out;
-
-    for (char ch : data) {
-        if (bits % 32 == 0) {
-            out.push_back(0);
-        }
-
-        out[bits / 32] |= ((ch << (24 - (bits % 32))) & (0xFF << (24 - (bits % 32))));
-
-        bits += 8;
-    }
-
-    return out;
-}
-
-void aes_get_round_constants(uint8_t rounds, uint32_t* output) {
-
-    uint8_t rc[rounds + 1];
-
-    for (int round = 1; round <= rounds; round++) {
-        if (round == 1) {
-            rc[round] = 1;
-        } else if (rc[round - 1] < 0x80) {
-            rc[round] = 2 * rc[round - 1];
-        } else {
-            rc[round] = (2 * rc[round - 1]) ^ 0x11b;
-        }
-    }
-
-    for (int round = 1; round <= rounds; round++) {
-        output[round] = (rc[round] << 24);
-    }
-}
-
-
-uint32_t aes_rot_word(uint32_t word) {
-    return rotateleft(word, 8);
-}
-
-std::vector<std::vector<uint8_t>> sbox_matrix = {{1, 0, 0, 0, 1, 1, 1, 1},
-                                                {1, 1, 0, 0, 0, 1, 1, 1},
-                                                {1, 1, 1, 0, 0, 0, 1, 1},
-                                                {1, 1, 1, 1, 0, 0, 0, 1},
-                                                {1, 1, 1, 1, 1, 0, 0, 0},
-                                                {0, 1, 1, 1, 1, 1, 0, 0},
-                                                {0, 0, 1, 1, 1, 1, 1, 0},
-                                                {0, 0, 0, 1, 1, 1, 1, 1}};
-
-uint8_t sbox_vector[] = {1, 1, 0, 0, 0, 1, 1, 0};
-
-uint8_t* sbox = nullptr;
-uint8_t* inverse_sbox = nullptr;
-
-const uint16_t AES_IRREDUCIBLE_POLYNOMIAL = 0b100011011;
-
-//const uint8_t sbox_const[] = {0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
-//           0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
-//           0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
-//           0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
-//           0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
-//           0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
-//           0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
-//           0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
-//           0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
-//           0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
-//           0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
-//           0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
-//           0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
-//           0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
-//           0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
-//           0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
-
-
-
-uint8_t gf2_8_reduce_product(uint16_t value, uint16_t polynomial) {
-    uint8_t polynomial_degree = 0; uint16_t polynomial_copy = polynomial, polynomial_leading_coefficient;
-    for (; polynomial_copy >> (++polynomial_degree + 1););
-    polynomial_leading_coefficient = 1 << polynomial_degree;
-
-    while (value >= polynomial_leading_coefficient) {
-        uint8_t output_degree = 0;
-        uint16_t output_copy = value; polynomial_copy = polynomial;
-        for (; output_copy >> (++output_degree + 1););
+#include "aes.h"
 
-        uint8_t degree_difference = output_degree - polynomial_degree;
-
-        uint8_t output_bits[16];
-
-        for (int bit = 0; bit < 16; bit++) {
-            output_bits[bit] = (value >> bit) & (0b1);
-        }
-
-        polynomial_copy = polynomial_copy << degree_difference;
-
-        value ^= polynomial_copy;
-    }
-
-    return value;
-}
-
-uint8_t gf2_8_multiplication(uint8_t a, uint8_t b, uint16_t polynomial) {
-    uint8_t polynomial_degree = 0; uint16_t polynomial_copy = polynomial, polynomial_leading_coefficient;
-    for (; polynomial_copy >> (++polynomial_degree + 1););
-    polynomial_leading_coefficient = 1 << polynomial_degree;
-
-
-    uint16_t output = 0;
-    uint16_t b_copy = b;
-
-    for (int bit = 0; bit < 8; bit++) {
-        if ((a >> bit) & (0b1)) {
-            output ^= b_copy << bit;
-        }
-    }
-
-    if (output < polynomial_leading_coefficient)
-        return output;
-
-    return gf2_8_reduce_product(output, polynomial);
-}
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
- *
- * @param a
- * @param b
- * @return A 16-bit value which is comprised of the quotient in the first 8-bits and the remainder in the last 8-bits
+ * The modes the command line tool can use. ECB and CBC pad the input the same way aes_encrypt does (0x80 then zeros) by default, or with PKCS#7 like OpenSSL,
+ * except that the padding is always added so it can be taken off again after decryption.
  */
-uint16_t gf2_8_division(uint16_t a, uint16_t b) {
-    if (b == 0) {
-        std::cerr << "DIV ERROR: Divide by zero\n";
-        exit(1);
-    }
-
-    uint8_t b_degree = 0; uint16_t b_copy = b, b_leading_coefficient;
-    for (; b_copy >> (b_degree + 1); b_degree++);
-    b_leading_coefficient = 1 << b_degree;
-
-    uint8_t quotient = 0;
-
-    while (a >= b_leading_coefficient) {
-        uint8_t a_degree = 0;
-        b_degree = 0;
-        uint16_t a_copy = a;
-        b_copy = b;
-        for (; a_copy >> (a_degree + 1); a_degree++);
-        for (; b_copy >> (b_degree + 1); b_degree++);
-
-        uint8_t degree_difference = a_degree - b_degree;
-
-        b_copy = b_copy << degree_difference;
-
-        quotient |=  0b1 << degree_difference;
-
-        a ^= b_copy;
-    }
-
-    return ((quotient << 8) | a);
+enum aes_cli_mode {
+    AES_CLI_ECB,
+    AES_CLI_CBC,
+    AES_CLI_CTR
+};
+
+struct aes_cli_options {
+    aes_cli_mode mode = AES_CLI_CTR;
+    aes_padding padding = AES_PADDING_ISO_7816_4;
+    bool decrypt = false;
+    std::string key;
+    std::string iv;
+    aes_engine engine = AES_ENGINE_REFERENCE;
+    bool engine_given = false;
+    size_t threads = 0;
+    std::string input = "-";
+    std::string output = "-";
+    /// Empty, text or json.
+    std::string stats;
+};
+
+/// Size of each I/O buffer. A multiple of the parallel chunk size so a full buffer splits into whole chunks.
+const size_t AES_CLI_BUFFER_BYTES = 16 * AES_PARALLEL_CHUNK_BYTES;
+
+void aes_cli_usage() {
+    std::cerr << "usage: aes [-d] [-m ecb|cbc|ctr] [-p iso|pkcs7] -k KEY [--iv IV] [-e auto|aesni|ttable|bitslice|reference] [-t THREADS] [-i INPUT] [-o OUTPUT] [--stats text|json]\n"
+                 "       aes --engines\n"
+                 "  -d         decrypt instead of encrypt\n"
+                 "  -m MODE    block cipher mode, ctr by default\n"
+                 "  -p PADDING padding for ecb and cbc, iso (0x80 then zeros) by default or pkcs7\n"
+                 "  -k KEY     16, 24 or 32 byte key in hex\n"
+                 "  --iv IV    16 byte IV in hex, the initial counter block for ctr (needed for cbc and ctr)\n"
+                 "  -e ENGINE  block function, auto (the default) picks the fastest one that passes its self-test, or AES_ENGINE from the environment\n"
+                 "  -t THREADS threads for the parallel modes, 0 (the default) for one per hardware thread\n"
+                 "  -i INPUT   input file, - (the default) for stdin\n"
+                 "  -o OUTPUT  output file, - (the default) for stdout\n"
+                 "  --engines  print the engine self-tests, timings and choices and exit\n"
+                 "  --stats F  print the time spent in each stage and call to stderr at the end, text or json (needs a build with -DAES_INSTRUMENT)\n";
+    exit(1);
+}
+
+void aes_cli_error(const std::string& message) {
+    std::cerr << "AES CLI ERROR: " << message << '\n';
+    exit(1);
 }
 
-
 /**
- *
- * @param value - Any value on the fininte field GF(2^8)
- * @param polynomial - any irreducible polynomial in binary (AES uses x^8 + x^4 + x^3 + x + 1 or 0b100011011)
- * @return The <b>value</b>'s inverse
- *
- * Uses the Extended Euclidean algorithm to find the inverse of the given value in GF(2^8).
+ * An error while the reader, writer and processing threads of aes_cli_pipeline are running. It's thrown instead of calling aes_cli_error straight away
+ * so the pipeline can stop and join its threads first, and the main thread reports it once nothing else is using the buffers or the mapping.
  */
-uint8_t gf_2_8_get_value_inverse(const uint8_t value, uint16_t polynomial) {
-
-    std::vector<uint16_t> remainders = {polynomial, value};
-    std::vector<uint16_t> quotients = {0};
-
-    uint16_t first_result = gf2_8_division(polynomial, value);
-
-    quotients.push_back((first_result >> 8) & 0xff);
-    remainders.push_back(first_result & 0xff);
+struct aes_cli_failure {
+    std::string message;
+};
 
-    for (int n = 2; remainders.back(); n++) {
-        uint16_t result = gf2_8_division(remainders[n - 1], remainders[n]);
+[[noreturn]] void aes_cli_fail(const std::string& message) {
+    throw aes_cli_failure{message};
+}
 
-        quotients.push_back((result >> 8) & 0xff);
-        remainders.push_back(result & 0xff);
+std::string aes_cli_parse_hex(const std::string& hex, const char* what) {
+    if (hex.size() % 2) {
+        aes_cli_error(std::string(what) + " must have an even number of hex digits");
     }
 
-    uint8_t aux[quotients.size() + 1];
-
-    aux[0] = 0; aux[1] = 1;
-
-    for (int n = 2; n < quotients.size() + 1; n++) {
-        aux[n] = aux[n - 2] ^ gf2_8_multiplication(quotients[n - 1], aux[n - 1], polynomial);
+    std::string out;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int value = 0;
+        for (size_t digit = i; digit < i + 2; digit++) {
+            char ch = hex[digit];
+            int nibble = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+            if (nibble < 0) {
+                aes_cli_error(std::string(what) + " isn't valid hex");
+            }
+            value = (value << 4) | nibble;
+        }
+        out.push_back((char) value);
     }
 
-    return aux[quotients.size() - 1];
+    return out;
 }
 
-uint8_t aes_generate_sbox_value(uint8_t value) {
-    uint8_t inverse = 0;
-    if (value != 0) {
-        inverse = gf_2_8_get_value_inverse(value, AES_IRREDUCIBLE_POLYNOMIAL);
+/// @return <b>value</b> as a count, which must be all digits
+size_t aes_cli_parse_count(const std::string& value, const char* what) {
+    size_t count = 0;
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+        aes_cli_error(std::string(what) + " must be a number");
     }
-    uint8_t result = 0;
-
-    uint8_t current_bit;
-
-    for (int bit = 0; bit < 8; bit++) {
-        current_bit = ((sbox_matrix[bit][0] * (inverse & 0b00000001)) ^
-                       (sbox_matrix[bit][1] * ((inverse & 0b00000010) >> 1)) ^
-                       (sbox_matrix[bit][2] * ((inverse & 0b00000100) >> 2)) ^
-                       (sbox_matrix[bit][3] * ((inverse & 0b00001000) >> 3)) ^
-                       (sbox_matrix[bit][4] * ((inverse & 0b00010000) >> 4)) ^
-                       (sbox_matrix[bit][5] * ((inverse & 0b00100000) >> 5)) ^
-                       (sbox_matrix[bit][6] * ((inverse & 0b01000000) >> 6)) ^
-                       (sbox_matrix[bit][7] * ((inverse & 0b10000000) >> 7))) ^
-                      sbox_vector[bit];
-
-        result |= current_bit << bit;
+    try {
+        count = std::stoull(value);
     }
-
-    return result;
+    catch (const std::out_of_range&) {
+        aes_cli_error(std::string(what) + " is too big");
+    }
+    return count;
 }
 
+aes_cli_options aes_cli_parse_options(int argc, char** argv) {
+    aes_cli_options options;
 
-void aes_generate_sbox() {
-    delete[] sbox;
-    sbox = new uint8_t[256];
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-d") {
+            options.decrypt = true;
+            continue;
+        }
+        if (arg == "--engines") {
+            aes_backend_registry::instance().report(std::cout);
+            exit(0);
+        }
+        if (arg == "-h" || arg == "--help" || i + 1 == argc) {
+            aes_cli_usage();
+        }
 
-    for (int value = 0; value < 256; value++) {
-        sbox[value] = aes_generate_sbox_value(value);
+        std::string value = argv[++i];
+        if (arg == "-m") {
+            if (value == "ecb") {
+                options.mode = AES_CLI_ECB;
+            }
+            else if (value == "cbc") {
+                options.mode = AES_CLI_CBC;
+            }
+            else if (value == "ctr") {
+                options.mode = AES_CLI_CTR;
+            }
+            else {
+                aes_cli_error("Unknown mode " + value);
+            }
+        }
+        else if (arg == "-p") {
+            if (value == "iso") {
+                options.padding = AES_PADDING_ISO_7816_4;
+            }
+            else if (value == "pkcs7") {
+                options.padding = AES_PADDING_PKCS7;
+            }
+            else {
+                aes_cli_error("Unknown padding " + value);
+            }
+        }
+        else if (arg == "-k") {
+            options.key = aes_cli_parse_hex(value, "The key");
+        }
+        else if (arg == "--iv") {
+            options.iv = aes_cli_parse_hex(value, "The IV");
+        }
+        else if (arg == "-e") {
+            options.engine_given = value != "auto";
+            const aes_backend* backend = aes_find_backend(value);
+            if (backend) {
+                options.engine = backend->engine;
+            }
+            else if (value != "auto") {
+                aes_cli_error("Unknown engine " + value);
+            }
+        }
+        else if (arg == "-t") {
+            options.threads = aes_cli_parse_count(value, "The thread count");
+        }
+        else if (arg == "-i") {
+            options.input = value;
+        }
+        else if (arg == "-o") {
+            options.output = value;
+        }
+        else if (arg == "--stats") {
+            if (value != "text" && value != "json") {
+                aes_cli_error("Unknown stats format " + value);
+            }
+            options.stats = value;
+        }
+        else {
+            aes_cli_usage();
+        }
     }
-}
-
-void aes_generate_inverse_sbox() {
-    delete[] inverse_sbox;
-    inverse_sbox = new uint8_t[256];
 
-    for (int index = 0; index < 256; index++) {
-        inverse_sbox[sbox[index]] = index;
+    if (options.key.empty()) {
+        aes_cli_usage();
     }
-}
-
-uint8_t aes_sub_word8(uint8_t word) {
-    if (!sbox) {
-        aes_generate_sbox();
+    if (options.mode != AES_CLI_ECB && options.iv.size() != 16) {
+        aes_cli_error("CBC and CTR need a 16 byte IV");
     }
-
-    return sbox[word];
-}
-
-uint32_t aes_sub_word32(uint32_t word) {
-    uint32_t out = 0;
-
-    out |= aes_sub_word8((word >> 24) & 0xff) << 24;
-    out |= aes_sub_word8((word >> 16) & 0xff) << 16;
-    out |= aes_sub_word8((word >> 8) & 0xff) << 8;
-    out |= aes_sub_word8(word & 0xff);
-
-    return out;
-}
-
-
-uint8_t aes_inverse_sub_word8(uint8_t word) {
-    if (!inverse_sbox) {
-        aes_generate_inverse_sbox();
+    if (!options.engine_given) {
+        /// CTR decryption is the same as encryption, only ECB and CBC decryption run the inverse cipher. CBC encryption chains every block to the one before, so it goes one block at a time.
+        if (options.decrypt && options.mode != AES_CLI_CTR) {
+            options.engine = aes_select_engine(AES_OPERATION_BULK_DECRYPT);
+        }
+        else if (options.mode == AES_CLI_CBC) {
+            options.engine = aes_select_engine(AES_OPERATION_SINGLE_BLOCK);
+        }
+        else {
+            options.engine = aes_select_engine(AES_OPERATION_BULK);
+        }
+        aes_use_selected_mix_column();
     }
 
-    return inverse_sbox[word];
+    return options;
 }
 
-uint32_t aes_inverse_sub_word32(uint32_t word) {
-    uint32_t out = 0;
-
-    out |= aes_inverse_sub_word8((word >> 24) & 0xff) << 24;
-    out |= aes_inverse_sub_word8((word >> 16) & 0xff) << 16;
-    out |= aes_inverse_sub_word8((word >> 8) & 0xff) << 8;
-    out |= aes_inverse_sub_word8(word & 0xff);
-
-    return out;
+/// Throws aes_cli_failure if it can't, since it runs on aes_cli_pipeline's writer thread.
+void aes_cli_write(int fd, const uint8_t* data, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            aes_cli_fail(std::string("Write failed: ") + strerror(errno));
+        }
+        data += written;
+        length -= written;
+    }
 }
 
-/**
- *
- * @param n - length of key (4 for 128-bit)
- * @param key - key as a vector of uint32_t
- * @param r - number of rounds (11 for 128-bit)
- * @return a vector of round keys
- */
-std::vector<uint32_t> aes_get_round_keys(uint8_t n, std::vector<uint32_t> key, uint8_t r) {
-    std::vector<uint32_t> w(4 * r);
-    uint32_t rc[r];
-    aes_get_round_constants(r, rc);
-
-
-    for (int round = 0; round <= n * r; round++) {
-        if (round < n) {
-            w[round] = key[round];
+/// @return the number of bytes read, less than <b>length</b> only at the end of the input. Throws aes_cli_failure if it can't, like aes_cli_write.
+size_t aes_cli_read_full(int fd, uint8_t* data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t count = read(fd, data + total, length - total);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            aes_cli_fail(std::string("Read failed: ") + strerror(errno));
         }
-        else if ((round % n) == 0) {
-            w[round] = (w[round - n] ^ (aes_sub_word32(aes_rot_word(w[round - 1])))) ^ rc[round / n];
-        }
-        else if (n > 6 && (round % n) == 4) {
-            w[round] = w[round - n] ^ aes_sub_word32(w[round - 1]);
-        }
-        else {
-            w[round] = w[round - n] ^ w[round - 1];
+        if (count == 0) {
+            break;
         }
+        total += count;
     }
-
-    return w;
+    return total;
 }
 
+/// How many buffers go around between reading, processing and writing, one for each so all three can happen at once.
+const size_t AES_CLI_BUFFER_COUNT = 3;
 
-void aes_add_round_key(std::vector<uint32_t>& state, std::vector<uint32_t>::iterator round_key) {
-    for (uint8_t byte_index = 0; byte_index < 4; byte_index++) {
-        state[byte_index] ^= round_key[byte_index];
-    }
-}
+/// Where a buffer is in the pipeline. Each step waits for the buffer it wants next to reach its state.
+enum aes_cli_buffer_state {
+    AES_CLI_BUFFER_FREE,
+    AES_CLI_BUFFER_READ,
+    AES_CLI_BUFFER_PROCESSED
+};
 
 /**
- * @param state
- * @param row_index
- * @return the row in the state at row_index
- *
- * Since the state is stored rotated from how AES operates we need to go through all the columns in the state and grab one byte of the row from each.
+ * Takes each buffer of input and where to put its result and returns the bytes to write. See aes_cli_pipeline.
  */
-uint32_t aes_extract_row(const std::vector<uint32_t>& state, uint8_t row_index) {
-    uint32_t row = 0;
-    for (uint8_t col = 0; col < 4; col++) {
-        row |= ((state[col] >> (24 - (row_index * 8))) & 0xff) << (24 - (8 * col));
-    }
-    return row;
-}
+typedef std::function<std::span<const uint8_t>(const uint8_t* input, uint8_t* output, size_t length, bool last)> aes_cli_consumer;
 
 /**
- * @param state
- * @param row
- * @param row_index
+ * @param input - the input file
+ * @param output - the output file
+ * @param consume - called on this thread with each buffer of input in order. Every buffer is AES_CLI_BUFFER_BYTES long except the last one, which may be empty.
+ * The output has 16 bytes of room before it and 16 after it for held back blocks and padding, and may be the same as the input. The bytes it returns are written out
+ * and must be inside that room.
  *
- * Since the state is stored rotated from how AES operates we need to go through all the columns in the state and put one byte of the row into each.
+ * Reading the next buffer, processing this one and writing the one before all overlap: a writer thread writes buffers once they are processed, and the buffers go
+ * around a ring of AES_CLI_BUFFER_COUNT so memory doesn't grow with the input.
+ * Regular files are mapped and processed straight from the mapping into the buffers, and pages are dropped from the mapping once they are used.
+ * Anything else (pipes, terminals, sockets) is read by a reader thread into the buffers, which are then processed in place.
+ * If any step throws aes_cli_failure the others stop at their next buffer, and once they're joined the first error is reported with aes_cli_error.
  */
-void aes_emplace_row(std::vector<uint32_t>& state, uint32_t row, uint8_t row_index) {
-    for (uint8_t col = 0; col < 4; col++) {
-        state[col] &= ~(0xff << (24 - (row_index * 8)));
-        state[col] |= (((row >> (24 - (col * 8))) & 0xff) << (24 - (row_index * 8)));
+void aes_cli_pipeline(int input, int output, const aes_cli_consumer& consume) {
+    struct aes_cli_buffer {
+        std::vector<uint32_t> storage = std::vector<uint32_t>((16 + AES_CLI_BUFFER_BYTES + 16) / 4);
+        aes_cli_buffer_state state = AES_CLI_BUFFER_FREE;
+        size_t length = 0;
+        bool last = false;
+        std::span<const uint8_t> result;
+
+        uint8_t* data() {
+            return (uint8_t*) storage.data() + 16;
+        }
+    };
+    aes_cli_buffer buffers[AES_CLI_BUFFER_COUNT];
+    std::mutex mutex;
+    std::condition_variable changed;
+    /// Set with the first failure, after which every step stops instead of waiting for its next buffer.
+    bool stopping = false;
+    std::string failure;
+
+    /// @return false if the pipeline is stopping because of a failure
+    auto wait_for = [&](aes_cli_buffer& buffer, aes_cli_buffer_state state) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return stopping || buffer.state == state; });
+        return !stopping;
+    };
+    auto set_state = [&](aes_cli_buffer& buffer, aes_cli_buffer_state state) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer.state = state;
+        changed.notify_all();
+    };
+    auto fail = [&](const aes_cli_failure& error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!stopping) {
+            stopping = true;
+            failure = error.message;
+        }
+        changed.notify_all();
+    };
+
+    std::thread writer([&] {
+        try {
+            for (size_t index = 0;; index = (index + 1) % AES_CLI_BUFFER_COUNT) {
+                aes_cli_buffer& buffer = buffers[index];
+                if (!wait_for(buffer, AES_CLI_BUFFER_PROCESSED)) {
+                    return;
+                }
+
+                aes_cli_write(output, buffer.result.data(), buffer.result.size());
+
+                bool last = buffer.last;
+                set_state(buffer, AES_CLI_BUFFER_FREE);
+                if (last) {
+                    return;
+                }
+            }
+        }
+        catch (const aes_cli_failure& error) {
+            fail(error);
+        }
+    });
+
+    const uint8_t* mapped = nullptr;
+    size_t size = 0;
+    struct stat info;
+    if (fstat(input, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, input, 0);
+        if (mapping != MAP_FAILED) {
+            mapped = (const uint8_t*) mapping;
+            size = info.st_size;
+            madvise(mapping, size, MADV_SEQUENTIAL);
+        }
     }
-}
 
-void aes_print_state(const std::vector<uint32_t>& state) {
-    for (uint8_t row_index = 0; row_index < 4; row_index++) {
-        uint32_t row = aes_extract_row(state, row_index);
-        for (int column_index = 0; column_index < 4; column_index++) {
-            std::cout << std::hex << ((row >> (24 - (column_index * 8))) & 0xff) << ' ';
+    std::thread reader;
+    if (!mapped) {
+        reader = std::thread([&] {
+            try {
+                for (size_t index = 0;; index = (index + 1) % AES_CLI_BUFFER_COUNT) {
+                    aes_cli_buffer& buffer = buffers[index];
+                    if (!wait_for(buffer, AES_CLI_BUFFER_FREE)) {
+                        return;
+                    }
+
+                    buffer.length = aes_cli_read_full(input, buffer.data(), AES_CLI_BUFFER_BYTES);
+                    buffer.last = buffer.length < AES_CLI_BUFFER_BYTES;
+
+                    bool last = buffer.last;
+                    set_state(buffer, AES_CLI_BUFFER_READ);
+                    if (last) {
+                        return;
+                    }
+                }
+            }
+            catch (const aes_cli_failure& error) {
+                fail(error);
+            }
+        });
+    }
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t position = 0;
+    try {
+        for (size_t index = 0;; index = (index + 1) % AES_CLI_BUFFER_COUNT) {
+            aes_cli_buffer& buffer = buffers[index];
+            const uint8_t* data;
+            if (mapped) {
+                if (!wait_for(buffer, AES_CLI_BUFFER_FREE)) {
+                    break;
+                }
+                buffer.length = std::min(AES_CLI_BUFFER_BYTES, size - position);
+                buffer.last = position + buffer.length == size;
+                data = mapped + position;
+            }
+            else {
+                if (!wait_for(buffer, AES_CLI_BUFFER_READ)) {
+                    break;
+                }
+                data = buffer.data();
+            }
+
+            buffer.result = consume(data, buffer.data(), buffer.length, buffer.last);
+
+            if (mapped) {
+                position += buffer.length;
+                madvise((void*) mapped, position / page_size * page_size, MADV_DONTNEED);
+            }
+            bool last = buffer.last;
+            set_state(buffer, AES_CLI_BUFFER_PROCESSED);
+            if (last) {
+                break;
+            }
         }
-        std::cout << '\n';
     }
-    std::cout << '\n' << std::dec;
-}
-
-
-void aes_shift_rows(std::vector<uint32_t>& state) {
-    std::vector<uint32_t> tmp(4);
-
-    for (uint8_t row_index = 0; row_index < 4; row_index++) {
-        uint32_t row = aes_extract_row(state, row_index);
-
-        tmp[row_index] = row << (row_index * 8);
-        tmp[row_index] |= row >> (32 - (row_index * 8));
+    catch (const aes_cli_failure& error) {
+        fail(error);
     }
 
-    for (uint8_t row_index = 0; row_index < 4; row_index++) {
-        aes_emplace_row(state, tmp[row_index], row_index);
+    if (reader.joinable()) {
+        reader.join();
     }
-}
-
-void aes_reverse_shift_rows(std::vector<uint32_t>& state) {
-    std::vector<uint32_t> tmp(4);
-
-    for (uint8_t row_index = 0; row_index < 4; row_index++) {
-        uint32_t row = aes_extract_row(state, row_index);
-
-        tmp[row_index] = row >> (row_index * 8);
-        tmp[row_index] |= row << (32 - (row_index * 8));
+    writer.join();
+    if (mapped) {
+        munmap((void*) mapped, size);
     }
-
-    for (uint8_t row_index = 0; row_index < 4; row_index++) {
-        aes_emplace_row(state, tmp[row_index], row_index);
+    if (stopping) {
+        aes_cli_error(failure);
     }
 }
 
-uint8_t aes_mix_column_multiply(uint8_t a, uint8_t b) {
-    return gf2_8_multiplication(a, b, AES_IRREDUCIBLE_POLYNOMIAL);
-}
 /**
- *
- * @param value - a column from the state
- * @return the column after applying the mix to it
- *
- *  This is one implementation of the mix column function that uses matrix multiplication. I prefer the polynomial multiplication for its understandability but this also a correct implementation.
+ * Everything that carries over from one buffer to the next.
  */
-uint32_t aes_mix_column_matrix(uint32_t value) {
-    uint16_t b[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
-                    (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
-
-    uint8_t d[] = {(uint8_t)(aes_mix_column_multiply(2, b[0]) ^ aes_mix_column_multiply(3, b[1]) ^ b[2] ^ b[3]),
-                   (uint8_t)(aes_mix_column_multiply(2, b[1]) ^ aes_mix_column_multiply(3, b[2]) ^ b[3] ^ b[0]),
-                   (uint8_t)(aes_mix_column_multiply(2, b[2]) ^ aes_mix_column_multiply(3, b[3]) ^ b[0] ^ b[1]),
-                   (uint8_t)(aes_mix_column_multiply(2, b[3]) ^ aes_mix_column_multiply(3, b[0]) ^ b[1] ^ b[2])};
-
-    return (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+struct aes_cli_stream {
+    const aes_cli_options& options;
+    aes_key key;
+    aes_thread_pool& pool;
+    int output;
+    aes_ctr_counter counter = {};
+    std::array<uint32_t, 4> chaining = {};
+    uint64_t offset = 0;
+    /// When decrypting with padding the last block of each buffer is held back, since it might be the one with the padding.
+    uint8_t held[16] = {};
+    bool holding = false;
+};
+
+/// @return the length of <b>block</b> without its padding
+size_t aes_cli_unpad(aes_padding padding, const uint8_t* block) {
+    size_t length;
+    if (!aes_unpad_block(padding, block, length)) {
+        aes_cli_fail("The padding is invalid, the key, IV, mode or padding is probably wrong");
+    }
+    return length;
 }
 
 /**
- * @param value - a column from the state
- * @return the column after applying the mix to it
- *
- * This is my preferred implementation of the mix column function that uses polynomial multiplication. I prefer it because it uses the math that the matrix multiplication is derived from. This implementation doesn't use magical constants, and so I have an easier time understanding it.
+ * Processes one buffer of aes_cli_pipeline.
+ * @return the bytes to write
  */
-uint32_t aes_mix_column_polynomial(uint32_t value) {
-    uint8_t a[] = {2, 1, 1, 3};
-    uint16_t b[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
-                   (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
-    uint8_t c[] = {aes_mix_column_multiply(a[0], b[0]),
-                   (uint8_t)((aes_mix_column_multiply(a[1], b[0]) ^ aes_mix_column_multiply(a[0], b[1]))),
-                   (uint8_t)((aes_mix_column_multiply(a[2], b[0]) ^ aes_mix_column_multiply(a[1], b[1])) ^ aes_mix_column_multiply(a[0], b[2])),
-                   (uint8_t)((aes_mix_column_multiply(a[3], b[0]) ^ aes_mix_column_multiply(a[2], b[1])) ^ aes_mix_column_multiply(a[1], b[2]) ^ aes_mix_column_multiply(a[0], b[3])),
-                   (uint8_t)((aes_mix_column_multiply(a[3], b[1]) ^ aes_mix_column_multiply(a[2], b[2])) ^ aes_mix_column_multiply(a[1], b[3])),
-                   (uint8_t)((aes_mix_column_multiply(a[3], b[2]) ^ aes_mix_column_multiply(a[2], b[3]))),
-                   aes_mix_column_multiply(a[3], b[3])};
-
-    return ((c[0] ^ c[4]) << 24) | ((c[1] ^ c[5]) << 16) | ((c[2] ^ c[6]) << 8) | c[3];
-}
+std::span<const uint8_t> aes_cli_consume(aes_cli_stream& stream, const uint8_t* input, uint8_t* output, size_t length, bool last) {
+    const aes_cli_options& options = stream.options;
 
-// This is an alternative inverse which is harder to understand in my opinion, but I left it in in case it help someone understand.
-//uint32_t aes_inverse_mix_column(uint32_t value) {
-//    uint16_t d[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
-//                    (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
-//
-//    uint8_t b[] = {(uint8_t)(aes_mix_column_multiply(14, b[0]) ^ aes_mix_column_multiply(11, b[1]) ^ aes_mix_column_multiply(13, b[2]) ^ aes_mix_column_multiply(9, b[3])),
-//                   (uint8_t)(aes_mix_column_multiply(9, b[0]) ^ aes_mix_column_multiply(14, b[1]) ^ aes_mix_column_multiply(11, b[2]) ^ aes_mix_column_multiply(13, b[3])),
-//                   (uint8_t)(aes_mix_column_multiply(13, b[0]) ^ aes_mix_column_multiply(9, b[1]) ^ aes_mix_column_multiply(14, b[2]) ^ aes_mix_column_multiply(11, b[3])),
-//                   (uint8_t)(aes_mix_column_multiply(11, b[0]) ^ aes_mix_column_multiply(13, b[1]) ^ aes_mix_column_multiply(9, b[2]) ^ aes_mix_column_multiply(14, b[3]))};
-//
-//    return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
-//}
-
-uint32_t aes_inverse_mix_column(uint32_t value) {
-    uint16_t polynomial = 0b00011011;
-    uint8_t a[] = {2, 1, 1, 3};
-    uint16_t d[] = {(uint8_t)((value >> 24) & 0xff), (uint8_t)((value >> 16) & 0xff),
-                    (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff)};
-
-
-    // 14 11 13 9
-    // 9 14 11 13
-    // 13 9 14 11
-    // 11 13 9 14
-    uint8_t m[4] = {14, 11, 13, 9};
-
-    uint8_t b[4];
-
-
-    for (int column_index = 0; column_index < 4; column_index++) {
-        b[column_index] = aes_mix_column_multiply(m[0], d[0]) ^
-                        aes_mix_column_multiply(m[1], d[1]) ^
-                        aes_mix_column_multiply(m[2], d[2]) ^
-                        aes_mix_column_multiply(m[3], d[3]);
-
-        uint8_t tmp = m[3];
-        m[3] = m[2];
-        m[2] = m[1];
-        m[1] = m[0];
-        m[0] = tmp;
-    }
-
-    return (b[3]) | (b[2] << 8) | (b[1] << 16) | (b[0] << 24);
-}
-
-/**
- * @param state
- * @param column_index
- * @return The column of the state at the given index.
- *
- * This takes the column by simply indexing the array because the state is actually rotated 90 degrees from the way it's stored. This is quirk of AES.
- */
-uint32_t aes_extract_column(const std::vector<uint32_t>& state, uint8_t column_index) {
-    return state[column_index];
-}
-
-/**
- * @param state
- * @param column
- * @param column_index
- *
- * This places the column into the state based on the column index. It indexes the array directly to place the column because the state is actually rotated 90 degrees from the way it's stored. This is quirk of AES.
- */
-void aes_emplace_column(std::vector<uint32_t>& state, uint32_t column, uint8_t column_index) {
-    state[column_index] = column;
-}
-
-//uint32_t aes_extract_column(const std::vector<uint32_t>& state, uint8_t column_index) {
-//    uint32_t column = 0;
-//    for (uint8_t row = 0; row < 4; row++) {
-//        column |= ((state[row] >> (24 - (column_index * 8))) & 0xff) << (24 - (8 * row));
-//    }
-//    return column;
-//}
-//
-//void aes_emplace_column(std::vector<uint32_t>& state, uint32_t column, uint8_t column_index) {
-//    for (uint8_t row = 0; row < 4; row++) {
-//        state[row] &= ~(0xff << (24 - (column_index * 8)));
-//        state[row] |= (((column >> (24 - (row * 8))) & 0xff) << (24 - (column_index * 8)));
-//    }
-//}
-
-
-void aes_mix_columns(std::vector<uint32_t>& state) {
-
-    for (uint8_t column_index = 0; column_index < 4; column_index++) {
-
-        uint32_t column = aes_extract_column(state, column_index);
-
-        column = aes_mix_column_polynomial(column);
-
-        aes_emplace_column(state, column, column_index);
+    if (options.mode == AES_CLI_CTR) {
+        aes_parallel_ctr_process(stream.pool, stream.key, stream.counter, stream.offset, input, output, length);
+        stream.offset += length;
+        return {output, length};
     }
-}
 
-void aes_inverse_mix_columns(std::vector<uint32_t>& state) {
-
-    for (uint8_t column_index = 0; column_index < 4; column_index++) {
-
-        uint32_t column = aes_extract_column(state, column_index);
-
-        column = aes_inverse_mix_column(column);
+    if (!options.decrypt) {
+        size_t whole = length - length % 16;
+        if (options.mode == AES_CLI_ECB) {
+            aes_parallel_ecb_encrypt_process(stream.pool, stream.key, input, output, whole);
+        }
+        else {
+            aes_cbc_encrypt_process(stream.key, stream.chaining, input, output, whole);
+        }
 
-        aes_emplace_column(state, column, column_index);
+        /// The padded block goes in the room after the output, so the input is never written to.
+        if (last) {
+            uint8_t* block = output + whole;
+            std::memmove(block, input + whole, length - whole);
+            aes_pad_block(options.padding, block, length - whole);
+            if (options.mode == AES_CLI_ECB) {
+                aes_ecb_encrypt_process(stream.key, block, block, 16);
+            }
+            else {
+                aes_cbc_encrypt_process(stream.key, stream.chaining, block, block, 16);
+            }
+            whole += 16;
+        }
+        return {output, whole};
     }
-}
 
+    if (length % 16) {
+        aes_cli_fail("The input isn't a whole number of blocks");
+    }
 
-/**
- *
- *
- * |  128 bit  |  192 bit  |  256 bit  |
- * |  10 round |  12 round |  14 round |
- *
- * 16 byte key
- *
- * ----------------------
- * | k0 | k4 | k8 | kc |
- * | k1 | k5 | k9 | kd |
- * | k2 | k6 | ka | ke |
- * | k3 | k7 | kb | kf |
- * ----------------------
- *
- * expand using to get round keys
- *
- * round keys are
- * rij where i is the round and j is the byte index in hex
- * e.g. 5th byte from 3rd round: r35
- * e.g. 14th byte from the 12th round: rbd
- *
- *
- * 16 byte message
- *
- * ----------------------
- * | m0 | m4 | m8 | mc |
- * | m1 | m5 | m9 | md |
- * | m2 | m6 | ma | me |
- * | m3 | m7 | mb | mf |
- * ----------------------
- *
- * Xor the original key with the message
- *
- * ai = mi ^ ki
- * 
- * ----------------------
- * | a0 | a4 | a8 | ac |
- * | a1 | a5 | a9 | ad |
- * | a2 | a6 | aa | ae |
- * | a3 | a7 | ab | af |
- * ----------------------
- *
- * For each round
- *
- * Sub-byte the state
- *
- * si = subbyte(ai)
- *
- * ----------------------
- * | s0 | s4 | s8 | sc |
- * | s1 | s5 | s9 | sd |
- * | s2 | s6 | sa | se |
- * | s3 | s7 | sb | sf |
- * ----------------------
- *
- * Shift rows
- * ----------------------
- * | s0 | s4 | s8 | sc |
- * | s5 | s9 | sd | s1 |
- * | sa | se | s2 | s6 |
- * | sf | s3 | s7 | sb |
- * ----------------------
- *
- *
- *
- *
- */
-std::vector<uint32_t> aes_encrypt(std::string message, const std::string& key) {
-    const uint8_t rounds = 10;
-    const uint8_t key_len = 4;
-
-
-    std::cout << "Encrypting \"" << message << "\" with key: " << key << '\n';
-
-    /// Verify key length
-    if (key.size() != 16) {
-        std::cerr << "AES KEY ERROR: Size of " << key.size() << " is invalid supported sizes are: 16";
-        exit(5);
+    if (options.mode == AES_CLI_ECB) {
+        aes_parallel_ecb_decrypt_process(stream.pool, stream.key, input, output, length);
     }
-    /// Split into 16 byte chunks
-    if (message.size() > 16) {
-        std::vector<uint32_t> out;
-        for (uint16_t chunk_index = 0; (chunk_index * 16) < message.size(); chunk_index++) {
-            std::vector<uint32_t> sub_result = aes_encrypt(message.substr(chunk_index * 16, 16), key);
-            out.insert(out.end(), sub_result.begin(), sub_result.end());
-        }
-        return out;
+    else {
+        aes_parallel_cbc_decrypt_process(stream.pool, stream.key, stream.chaining, input, output, length);
     }
-    else if (message.size() != 16) {
-        message.push_back(0x80);
 
-        while (message.size() != 16) {
-            message.push_back(0);
-        }
+    /// The block held back from the last buffer goes in the room before the output, so everything to write is in one piece.
+    uint8_t* start = output;
+    size_t count = length;
+    if (stream.holding) {
+        start -= 16;
+        std::memcpy(start, stream.held, 16);
+        count += 16;
     }
 
-
-    std::vector<uint32_t> key_uint = convert_be(key);
-    /// Create round keys
-    std::vector<uint32_t> round_keys = aes_get_round_keys(key_len, key_uint, rounds + 1);
-
-    /// Rotate the state
-    std::vector<uint32_t> state = convert_be(message);
-    std::cout << "Initial State:\n";
-    aes_print_state(state);
-
-    /// Add original key to state.
-    aes_add_round_key(state, key_uint.begin());
-    std::cout << "First Round Key:\n";
-    aes_print_state(state);
-
-    for (int round = 1; round < rounds; round++) {
-
-        /// Sub-byte the state
-        for (auto& uint : state) {
-            uint = aes_sub_word32(uint);
+    if (last) {
+        if (count == 0) {
+            aes_cli_fail("The input is empty but should have at least one block of padding");
         }
-        std::cout << round << " Round s-box:\n";
-        aes_print_state(state);
-
-        /// Shift Rows
-        aes_shift_rows(state);
-        std::cout << round << " Round row shift:\n";
-        aes_print_state(state);
-
-        /// Mix Columns
-        aes_mix_columns(state);
-        std::cout << round << " Round mix:\n";
-        aes_print_state(state);
-
-        // Add Round Key
-        aes_add_round_key(state, round_keys.begin() + (round * 4));
-        std::cout << round << " Round add round key:\n";
-        aes_print_state(state);
+        count -= 16 - aes_cli_unpad(options.padding, start + count - 16);
     }
-
-
-    /// Sub-byte the state
-    for (auto& uint : state) {
-        uint = aes_sub_word32(uint);
+    else {
+        stream.holding = count > 0;
+        if (stream.holding) {
+            count -= 16;
+            std::memcpy(stream.held, start + count, 16);
+        }
     }
-    std::cout << " Last Round S-Box:\n";
-    aes_print_state(state);
-
-    /// Shift Rows
-    aes_shift_rows(state);
-    std::cout << " Last Round Shift Rows:\n";
-    aes_print_state(state);
-
-    // Add Round Key
-    aes_add_round_key(state, round_keys.begin() + (10 * 4));
-    std::cout << " Last Round key:\n";
-    aes_print_state(state);
-
-    return state;
+    return {start, count};
 }
 
-
-std::vector<uint32_t> aes_decrypt(const std::vector<uint32_t>& data, const std::string& key) {
-    const uint8_t rounds = 10;
-    const uint8_t key_len = 4;
-
-    std::cout << "Decrypting with key: " << key << '\n';
-
-    /// Verify key length
-    if (key.size() != 16) {
-        std::cerr << "AES KEY ERROR: Size of " << key.size() << " is invalid supported sizes are: 16";
-        exit(5);
+/**
+ * Encrypts or decrypts the input to the output a buffer at a time, so memory use is the same whatever the size of the input.
+ */
+void aes_cli_run(const aes_cli_options& options) {
+    int input = STDIN_FILENO;
+    if (options.input != "-") {
+        input = open(options.input.c_str(), O_RDONLY);
+        if (input < 0) {
+            aes_cli_error("Can't open " + options.input + ": " + strerror(errno));
+        }
     }
-
-    /// Split into 16 byte chunks
-    if (data.size() > 4) {
-        std::vector<uint32_t> out;
-        for (uint16_t chunk_index = 0; (chunk_index * 4) < data.size(); chunk_index++) {
-            std::vector<uint32_t> sub_result = aes_decrypt(std::vector<uint32_t>(data.begin() + chunk_index * 4, data.begin() + ((chunk_index + 1) * 4)), key);
-            out.insert(out.end(), sub_result.begin(), sub_result.end());
+    int output = STDOUT_FILENO;
+    if (options.output != "-") {
+        output = open(options.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output < 0) {
+            aes_cli_error("Can't open " + options.output + ": " + strerror(errno));
         }
-        return out;
     }
 
-    std::vector<uint32_t> key_uint = convert_be(key);
-    /// Create round keys
-    std::vector<uint32_t> round_keys = aes_get_round_keys(key_len, key_uint, rounds + 1);
-
-    std::vector<uint32_t> state = data;
-
-    std::cout << "Initial State:\n";
-    aes_print_state(state);
-
-    /// Add Round Key
-    aes_add_round_key(state, round_keys.begin() + (10 * 4));
-    std::cout << "First Round Key:\n";
-    aes_print_state(state);
-
-    /// Shift Rows
-    aes_reverse_shift_rows(state);
-    std::cout << "First row shift:\n";
-    aes_print_state(state);
-
-    /// Sub-byte the state
-    for (auto& uint : state) {
-        uint = aes_inverse_sub_word32(uint);
+    aes_thread_pool pool(options.threads);
+    aes_cli_stream stream = {options, aes_expand_key(options.key, options.engine), pool, output};
+    if (options.mode == AES_CLI_CTR) {
+        /// The whole block counts so the counter never wraps, however big the file is.
+        stream.counter = aes_ctr_make_counter(options.iv, 128);
     }
-    std::cout << "First sub box:\n";
-    aes_print_state(state);
-
-
-    for (int round = rounds - 1; round > 0; round--) {
-        // Add Round Key
-        aes_add_round_key(state, round_keys.begin() + (round * 4));
-        std::cout << round << " Round key:\n";
-        aes_print_state(state);
-
-        /// Mix Columns
-        aes_inverse_mix_columns(state);
-        std::cout << round << " Round mix:\n";
-        aes_print_state(state);
-
-        /// Shift Rows
-        aes_reverse_shift_rows(state);
-        std::cout << round << " Round shift:\n";
-        aes_print_state(state);
-
-        /// Sub-byte the state
-        for (auto& uint : state) {
-            uint = aes_inverse_sub_word32(uint);
-        }
-        std::cout << round << " Round s-box:\n";
-        aes_print_state(state);
+    else if (options.mode == AES_CLI_CBC) {
+        stream.chaining = aes_cbc_make_iv(options.iv);
     }
 
-    /// Add original key to state.
-    aes_add_round_key(state, key_uint.begin());
-    std::cout << " Last Round key:\n";
-    aes_print_state(state);
+    aes_cli_pipeline(input, output, [&](const uint8_t* data, uint8_t* result, size_t length, bool last) {
+        return aes_cli_consume(stream, data, result, length, last);
+    });
 
-    return state;
+    if (output != STDOUT_FILENO && close(output) != 0) {
+        aes_cli_error("Can't write " + options.output + ": " + strerror(errno));
+    }
+    if (input != STDIN_FILENO) {
+        close(input);
+    }
 }
 
-int main() {
-    std::string msg = "Two One Nine Two";
-
-    std::string key_str = "Thats my Kung Fu";
-
-    std::vector<uint32_t> state = aes_encrypt(msg, key_str);
+int main(int argc, char** argv) {
+    aes_cli_options options = aes_cli_parse_options(argc, argv);
+    /// Picking the engine runs self-tests and timings, which would otherwise be in the stats.
+    aes_reset_instrument();
+    aes_cli_run(options);
 
-    std::vector<uint32_t> original = aes_decrypt(state, key_str);
+    if (options.stats == "text") {
+        aes_take_instrument_snapshot().print_text(std::cerr);
+    }
+    else if (options.stats == "json") {
+        aes_take_instrument_snapshot().print_json(std::cerr);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,213 @@
+#include "../aes.h"
+
+#include <cstdio>
+#include <new>
+
+/**
+ * Checks that the std::span functions never allocate. Every engine the CPU supports runs ECB, CBC, CTR and GCM in place and out of place at a few sizes,
+ * then key expansion, the multi-key CTR batches and the CMAC batch, with global operator new replaced by a counter, and the test fails if the count moves.
+ *
+ * To build and run: g++ -std=c++20 -O2 -pthread tests/allocation_test.cpp -o allocation_test && ./allocation_test
+ */
+
+/// Only counted between allocation_test::begin and allocation_test::end, so the keys and buffers can be set up normally.
+static bool allocation_test_counting = false;
+static size_t allocation_test_count = 0;
+
+/// Kept out of line, otherwise GCC inlines them into the standard containers and warns that memory from operator new goes to free.
+#define ALLOCATION_TEST_REPLACEMENT __attribute__((noinline))
+
+ALLOCATION_TEST_REPLACEMENT void* operator new(size_t size) {
+    if (allocation_test_counting) {
+        allocation_test_count++;
+    }
+    if (void* pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+ALLOCATION_TEST_REPLACEMENT void* operator new(size_t size, std::align_val_t alignment) {
+    if (allocation_test_counting) {
+        allocation_test_count++;
+    }
+    size_t align = (size_t) alignment;
+    if (void* pointer = std::aligned_alloc(align, (size + align - 1) / align * align)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+ALLOCATION_TEST_REPLACEMENT void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+ALLOCATION_TEST_REPLACEMENT void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+ALLOCATION_TEST_REPLACEMENT void operator delete(void* pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+ALLOCATION_TEST_REPLACEMENT void operator delete(void* pointer, size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+struct allocation_test {
+    size_t failures = 0;
+    size_t checks = 0;
+
+    void begin() {
+        allocation_test_count = 0;
+        allocation_test_counting = true;
+    }
+
+    /// @param name - what ran since begin, printed if it allocated
+    void end(const char* name, const char* engine, size_t size, bool in_place) {
+        allocation_test_counting = false;
+        checks++;
+        if (allocation_test_count) {
+            failures++;
+            std::printf("FAIL %s %s %zu bytes %s: %zu allocations\n", name, engine, size, in_place ? "in place" : "out of place", allocation_test_count);
+        }
+    }
+};
+
+void allocation_test_engine(allocation_test& test, const aes_backend& backend) {
+    aes_key key = aes_expand_key(std::string(16, 'k'), backend.engine);
+    aes_gcm_key gcm_key = aes_gcm_make_key(key);
+    aes_ctr_counter counter = aes_ctr_make_counter(std::string(16, 'c'), 32);
+
+    std::array<std::byte, 16> iv;
+    iv.fill(std::byte{0x11});
+    std::array<std::byte, 12> gcm_iv;
+    gcm_iv.fill(std::byte{0x22});
+    std::array<std::byte, 20> aad;
+    aad.fill(std::byte{0x33});
+    std::array<std::byte, 16> tag;
+
+    /// Whole blocks for ECB and CBC, the other sizes only for CTR and GCM. 4099 bytes is more than one batch of every mode.
+    for (size_t size : {0, 1, 16, 1000, 1008, 4096, 4099}) {
+        bool whole_blocks = size % 16 == 0;
+        std::vector<std::byte> input(size, std::byte{0x5a});
+        std::vector<std::byte> output(size);
+
+        for (bool in_place : {false, true}) {
+            std::span<const std::byte> in = in_place ? std::span<const std::byte>(output) : std::span<const std::byte>(input);
+            std::span<std::byte> out(output);
+            if (in_place) {
+                output = input;
+            }
+
+            if (whole_blocks) {
+                test.begin();
+                aes_ecb_encrypt(key, in, out);
+                aes_ecb_decrypt(key, in, out);
+                test.end("ecb", backend.name, size, in_place);
+
+                test.begin();
+                aes_cbc_encrypt(key, iv, in, out);
+                aes_cbc_decrypt(key, iv, in, out);
+                test.end("cbc", backend.name, size, in_place);
+            }
+
+            test.begin();
+            aes_ctr(key, counter, in, out);
+            aes_ctr(key, counter, in, out, 5);
+            test.end("ctr", backend.name, size, in_place);
+
+            test.begin();
+            aes_gcm_encrypt(gcm_key, gcm_iv, aad, in, out, tag);
+            test.end("gcm_encrypt", backend.name, size, in_place);
+
+            /// The ciphertext and tag of a fresh encryption, so decryption takes the path where the tag matches as well as the one where it doesn't.
+            std::vector<std::byte> ciphertext(size);
+            aes_gcm_encrypt(gcm_key, gcm_iv, aad, input, ciphertext, tag);
+            if (in_place) {
+                output = ciphertext;
+            }
+            std::span<const std::byte> encrypted = in_place ? std::span<const std::byte>(output) : std::span<const std::byte>(ciphertext);
+
+            test.begin();
+            bool matched = aes_gcm_decrypt(gcm_key, gcm_iv, aad, encrypted, out, tag);
+            test.end("gcm_decrypt", backend.name, size, in_place);
+            if (!matched || output != input) {
+                test.failures++;
+                std::printf("FAIL gcm_decrypt %s %zu bytes %s: wrong result\n", backend.name, size, in_place ? "in place" : "out of place");
+            }
+
+            tag[0] ^= std::byte{1};
+            test.begin();
+            aes_gcm_decrypt(gcm_key, gcm_iv, aad, ciphertext, out, tag);
+            test.end("gcm_decrypt with a bad tag", backend.name, size, in_place);
+        }
+    }
+}
+
+/// Keys of every size, so the AES-NI batch goes through its 192-bit schedule as well as the lockstep 128 and 256-bit ones, and more items than one group of lanes.
+/// The CMAC batch gets more items than one group of its buckets.
+void allocation_test_batch(allocation_test& test, const aes_backend& backend) {
+    std::array<std::byte, 32> key_bytes;
+    key_bytes.fill(std::byte{0x44});
+    std::array<std::byte, 16> counter_block;
+    counter_block.fill(std::byte{0x55});
+
+    const size_t item_count = 3 * AES_BATCH_LANES + 1;
+    std::vector<std::byte> buffer(item_count * 100, std::byte{0x66});
+    aes_key keys[3];
+    std::vector<aes_batch_item> items;
+    std::vector<aes_expanded_batch_item> expanded_items;
+    for (size_t index = 0; index < 3; index++) {
+        keys[index] = aes_expand_key(std::span<const std::byte>(key_bytes).first(16 + index * 8), backend.engine);
+    }
+    for (size_t index = 0; index < item_count; index++) {
+        std::span<std::byte> message = std::span<std::byte>(buffer).subspan(index * 100, index % 7 * 13);
+        items.push_back({std::span<const std::byte>(key_bytes).first(16 + index % 3 * 8), counter_block, message, message});
+        expanded_items.push_back({&keys[index % 3], counter_block, message, message});
+    }
+
+    const size_t cmac_item_count = AES_CMAC_BATCH_GROUP + 1;
+    std::vector<std::byte> tags(cmac_item_count * 16);
+    aes_cmac_key cmac_keys[3];
+    std::vector<aes_cmac_batch_item> cmac_items;
+    for (size_t index = 0; index < 3; index++) {
+        cmac_keys[index] = aes_cmac_make_key(keys[index]);
+    }
+    for (size_t index = 0; index < cmac_item_count; index++) {
+        std::span<const std::byte> message = std::span<const std::byte>(buffer).first(index % 9 * 11);
+        cmac_items.push_back({&cmac_keys[index % 3], message, std::span<std::byte>(tags).subspan(index * 16, 4 + index % 13)});
+    }
+
+    volatile uint32_t sink = 0;
+    test.begin();
+    for (size_t key_size : {16, 24, 32}) {
+        sink = sink + aes_expand_key(std::span<const std::byte>(key_bytes).first(key_size), backend.engine).round_keys[4];
+    }
+    test.end("expand_key", backend.name, 0, false);
+
+    test.begin();
+    aes_ctr_batch(items, backend.engine);
+    test.end("ctr_batch", backend.name, buffer.size(), true);
+
+    test.begin();
+    aes_ctr_batch(expanded_items);
+    test.end("ctr_batch with expanded keys", backend.name, buffer.size(), true);
+
+    test.begin();
+    aes_cmac_batch(cmac_items);
+    test.end("cmac_batch", backend.name, buffer.size(), false);
+}
+
+int main() {
+    allocation_test test;
+    for (const aes_backend& backend : aes_backends) {
+        if (backend.supported()) {
+            allocation_test_engine(test, backend);
+            allocation_test_batch(test, backend);
+        }
+    }
+
+    std::printf("%zu checks, %zu failed\n", test.checks, test.failures);
+    return test.failures ? 1 : 0;
+}